@@ -0,0 +1,379 @@
+#!mruby
+#
+# mruby-lz4 benchmark suite
+#
+# usage:
+#   mruby bench/bench.rb [options] > bench_output.txt
+#
+# options:
+#   --quick              reduce parameter sweep
+#   --max-size=SIZE      largest input size (default: 16M; up to 1G)
+#   --sizes=SIZE,...     input sizes (e.g. 64,4K,1M,1G)
+#   --corpus=NAME,...    corpus kinds (text, random, repeat, mixed)
+#   --entries=NAME,...   substring filter of entry names (e.g. Block,Gradual)
+#   --min-time=SECONDS   minimal measuring time per case (default: 0.2)
+#
+# The result is a JSON document written to stdout.
+#
+
+module LZ4Bench
+  SIZES = [64, 1 << 10, 4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20, 1 << 30]
+  CORPUS = %w(text random repeat mixed)
+  CHUNK_SIZE = 1 << 20
+  DICT_SIZE = 64 << 10
+  STREAM_PIECE = 64 << 10
+
+  WORDS = %w(
+    the of and to in is for on that with as was by at from this be are or it an
+    mruby lz4 compression frame block stream encoder decoder buffer dictionary
+    level size checksum header offset literal match token window history
+    "id": "name": "value": "time": "status": null true false 0 1 2 3 10 42 100 65536
+  )
+
+  # NOTE: mruby の core には Regexp がないため、手作業で解析する
+  def self.parse_size(str)
+    unit = str[-1].upcase
+    shift = { "K" => 10, "M" => 20, "G" => 30 }[unit]
+    num = (shift ? str[0 ... -1] : str)
+    unless !num.empty? && num.each_char.all? { |c| "0123456789".include?(c) }
+      raise ArgumentError, "wrong size - #{str}"
+    end
+    num.to_i << (shift || 0)
+  end
+
+  def self.parse_args(argv)
+    opts = {
+      quick: false,
+      max_size: 16 << 20,
+      sizes: nil,
+      corpus: CORPUS,
+      entries: nil,
+      min_time: 0.2,
+    }
+
+    argv.each do |arg|
+      name, value = arg.split("=", 2)
+      case name
+      when "--quick"
+        opts[:quick] = true
+      when "--max-size"
+        opts[:max_size] = parse_size(value)
+      when "--sizes"
+        opts[:sizes] = value.split(",").map { |e| parse_size(e) }
+      when "--corpus"
+        opts[:corpus] = value.split(",")
+      when "--entries"
+        opts[:entries] = value.split(",")
+      when "--min-time"
+        opts[:min_time] = value.to_f
+      else
+        raise ArgumentError, "unknown option - #{arg}"
+      end
+    end
+
+    opts[:sizes] ||= SIZES.select { |e| e <= opts[:max_size] }
+    opts
+  end
+
+  #
+  # 決定的な擬似乱数 (線形合同法) による合成コーパス
+  #
+  class Corpus
+    def initialize(seed)
+      @x = seed & 0x7fffffff
+      @bytes = (0 ... 256).map { |e| e.chr }
+    end
+
+    def rand(n)
+      @x = (@x * 1103515245 + 12345) & 0x7fffffff
+      (@x >> 8) % n
+    end
+
+    def text(size)
+      s = ""
+      while s.bytesize < size
+        s << WORDS[rand(WORDS.size)]
+        s << (rand(12) == 0 ? "\n" : " ")
+      end
+      s.byteslice(0, size)
+    end
+
+    def random(size)
+      s = ""
+      size.times { s << @bytes[rand(256)] }
+      s
+    end
+
+    def repeat(size)
+      pattern = text(40)
+      s = ""
+      while s.bytesize < size
+        s << pattern
+        s << @bytes[rand(256)] if rand(8) == 0
+      end
+      s.byteslice(0, size)
+    end
+
+    def mixed(size)
+      s = ""
+      while s.bytesize < size
+        s << (rand(2) == 0 ? text(4096) : random(4096))
+      end
+      s.byteslice(0, size)
+    end
+
+    def generate(kind, size)
+      case kind
+      when "text" then text(size)
+      when "random" then random(size)
+      when "repeat" then repeat(size)
+      when "mixed" then mixed(size)
+      else raise ArgumentError, "unknown corpus - #{kind}"
+      end
+    end
+
+    #
+    # CHUNK_SIZE バイトの塊を繰り返して size バイトにする。
+    # LZ4 の窓 (64 KiB) より大きな塊の繰り返しなので、圧縮率への影響はない。
+    #
+    def self.make(kind, size, seed = 1)
+      chunk = new(seed).generate(kind, [size, CHUNK_SIZE].min)
+      if chunk.bytesize < size
+        chunk = chunk * (size / chunk.bytesize + 1)
+      end
+      chunk.bytesize > size ? chunk.byteslice(0, size) : chunk
+    end
+  end
+
+  def self.now
+    Time.now.to_f
+  end
+
+  def self.measure(min_time)
+    iter = 0
+    t0 = now
+    elapsed = 0.0
+    while true
+      yield
+      iter += 1
+      elapsed = now - t0
+      break if elapsed >= min_time || iter >= 1000000
+    end
+    [iter, elapsed]
+  end
+
+  def self.to_json(obj)
+    case obj
+    when Hash
+      "{" + obj.map { |k, v| to_json(k.to_s) + ":" + to_json(v) }.join(",") + "}"
+    when Array
+      "[" + obj.map { |e| to_json(e) }.join(",") + "]"
+    when String
+      obj.inspect # NOTE: 識別子程度の文字列しか扱わない
+    when nil
+      "null"
+    when Float
+      (obj.finite? ? obj.to_s : "null")
+    else
+      obj.to_s
+    end
+  end
+
+  class Runner
+    def initialize(opts)
+      @opts = opts
+      @first = true
+      @corpus = {}
+      @dicts = {}
+    end
+
+    def corpus(kind, size)
+      @corpus[[kind, size]] ||= Corpus.make(kind, size, 1)
+    end
+
+    def dict(kind)
+      @dicts[kind] ||= Corpus.new(7).generate(kind, DICT_SIZE)
+    end
+
+    def enabled?(entry)
+      ents = @opts[:entries]
+      ents.nil? || ents.any? { |e| entry.include?(e) }
+    end
+
+    def emit(record)
+      print(@first ? "\n" : ",\n")
+      print LZ4Bench.to_json(record)
+      @first = false
+    end
+
+    def bench(entry, op, kind, params, src, compressed_size)
+      return unless enabled?(entry)
+
+      iter, sec = LZ4Bench.measure(@opts[:min_time]) { yield }
+      rawsize = src.bytesize
+      record = {
+        entry: entry,
+        op: op,
+        corpus: kind,
+        size: rawsize,
+      }
+      params.each { |k, v| record[k] = v }
+      record[:compressed_size] = compressed_size
+      record[:ratio] = (compressed_size > 0 ? rawsize.to_f / compressed_size : nil)
+      record[:iterations] = iter
+      record[:seconds] = sec
+      record[:mb_per_s] = (sec > 0 ? rawsize.to_f * iter / sec / 1000000 : nil)
+      record[:latency_us] = sec * 1000000 / iter
+      emit record
+    end
+
+    def frame_cases
+      levels = @opts[:quick] ? [nil] : [nil, 3, 9]
+      blocksizes = @opts[:quick] ? [64 << 10] : [64 << 10, 256 << 10, 1 << 20, 4 << 20]
+      links = [true, false]
+
+      cases = []
+      levels.each do |level|
+        blocksizes.each do |bs|
+          links.each do |link|
+            cases << { level: level, blocksize: bs, blocklink: link }
+          end
+        end
+      end
+      cases
+    end
+
+    def run_frame(kind, src)
+      frame_cases.each do |prefs|
+        params = prefs.merge(dict: false)
+        z = LZ4::Encoder.encode(src, prefs)
+
+        bench("LZ4::Encoder.encode", "encode", kind, params, src, z.bytesize) do
+          LZ4::Encoder.encode(src, prefs)
+        end
+
+        bench("LZ4::Encoder#write", "encode", kind, params, src, z.bytesize) do
+          LZ4::Encoder.wrap("", prefs) do |lz4|
+            off = 0
+            while off < src.bytesize
+              lz4.write(src.byteslice(off, STREAM_PIECE))
+              off += STREAM_PIECE
+            end
+          end
+        end
+
+        dest = ""
+        bench("LZ4::Decoder.decode", "decode", kind, params, src, z.bytesize) do
+          LZ4::Decoder.decode(z, dest)
+        end
+
+        buf = ""
+        bench("LZ4::Decoder#read", "decode", kind, params, src, z.bytesize) do
+          LZ4::Decoder.wrap(z) do |lz4|
+            while lz4.read(STREAM_PIECE, buf)
+            end
+          end
+        end
+      end
+    end
+
+    def block_cases
+      levels = @opts[:quick] ? [nil] : [nil, -8, 0, 9]
+      pieces = @opts[:quick] ? [64 << 10] : [4 << 10, 64 << 10]
+      dicts = [false, true]
+
+      cases = []
+      levels.each do |level|
+        pieces.each do |piece|
+          dicts.each do |d|
+            cases << { level: level, blocksize: piece, blocklink: true, dict: d }
+          end
+        end
+      end
+      cases
+    end
+
+    def run_block(kind, src)
+      block_cases.each do |params|
+        level = params[:level]
+        piece = params[:blocksize]
+        predict = (params[:dict] ? dict(kind) : nil)
+        opts = { level: level }
+        opts[:predict] = predict if predict
+
+        # 一括処理 (blocksize は関係しない)
+        z = LZ4::BlockEncoder.encode(src, opts)
+        if piece == block_cases.first[:blocksize]
+          oneshot = params.merge(blocksize: nil, blocklink: false)
+
+          bench("LZ4::BlockEncoder.encode", "encode", kind, oneshot, src, z.bytesize) do
+            LZ4::BlockEncoder.encode(src, opts)
+          end
+
+          dest = ""
+          decopts = predict ? { predict: predict } : {}
+          bench("LZ4::BlockDecoder.decode", "decode", kind, oneshot, src, z.bytesize) do
+            LZ4::BlockDecoder.decode(z, src.bytesize, dest, decopts)
+          end
+
+          if LZ4::BlockDecoder.const_defined?(:Gradual)
+            gopts = predict ? { predict: predict } : {}
+            bench("LZ4::BlockDecoder::Gradual#read", "decode", kind, oneshot, src, z.bytesize) do
+              g = LZ4::BlockDecoder::Gradual.new(z, gopts)
+              buf = ""
+              while g.read(STREAM_PIECE, buf)
+              end
+            end
+          end
+        end
+
+        # ストリーム処理 (piece ごとの連結ブロック)
+        pieces = []
+        encoder = LZ4::BlockEncoder.new(level, predict)
+        off = 0
+        while off < src.bytesize
+          pieces << encoder.encode(src.byteslice(off, piece))
+          off += piece
+        end
+        total = pieces.inject(0) { |a, e| a + e.bytesize }
+
+        bench("LZ4::BlockEncoder#encode", "encode", kind, params, src, total) do
+          lz4 = LZ4::BlockEncoder.new(level, predict)
+          off = 0
+          dest = ""
+          while off < src.bytesize
+            lz4.encode(src.byteslice(off, piece), nil, dest)
+            off += piece
+          end
+        end
+
+        bench("LZ4::BlockDecoder#decode", "decode", kind, params, src, total) do
+          lz4 = LZ4::BlockDecoder.new(predict)
+          dest = ""
+          pieces.each { |e| lz4.decode(e, piece, dest) }
+        end
+      end
+    end
+
+    def run
+      print "{"
+      print LZ4Bench.to_json("mruby") + ":" + LZ4Bench.to_json(Object.const_defined?(:MRUBY_VERSION) ? MRUBY_VERSION : nil) + ","
+      print LZ4Bench.to_json("time") + ":" + LZ4Bench.to_json(Time.now.to_i) + ","
+      print LZ4Bench.to_json("min_time") + ":" + LZ4Bench.to_json(@opts[:min_time]) + ","
+      print LZ4Bench.to_json("results") + ":["
+
+      @opts[:corpus].each do |kind|
+        @opts[:sizes].each do |size|
+          src = corpus(kind, size)
+          run_frame(kind, src) if LZ4.const_defined?(:Encoder)
+          run_block(kind, src)
+          @corpus.clear
+        end
+      end
+
+      print "\n]}\n"
+    end
+  end
+end
+
+LZ4Bench::Runner.new(LZ4Bench.parse_args(ARGV)).run
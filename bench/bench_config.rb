@@ -0,0 +1,17 @@
+#ruby
+
+# rake bench で用いられるビルド設定。
+#
+# 1 GB までの入力を扱えるように、文字列の最大長の制限を外している。
+
+MRuby::Build.new("bench", "build") do |conf|
+  toolchain :gcc
+
+  cc.flags << "-O2"
+  cc.defines << "MRB_STR_LENGTH_MAX=0"
+
+  gem core: "mruby-print"
+  gem core: "mruby-time"
+  gem core: "mruby-bin-mruby"
+  gem File.dirname(__dir__)
+end
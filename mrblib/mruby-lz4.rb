@@ -19,6 +19,29 @@ module LZ4
     #   blocksize = nil (nil OR unsigned integer)::
     #   blocklink = true (true OR false)::
     #   checksum = true (true OR false)::
+    #   size = nil (nil OR false OR unsigned integer)::
+    #     content size recorded in frame header.
+    #     nil means input length for one step processing (LZ4.encode(string)).
+    #     false means not recorded.
+    #   threads = nil (nil OR 0 OR positive integer)::
+    #     compress blocks on worker threads. 0 means number of CPUs.
+    #     need with blocklink: false.
+    #     output is same with any threads count.
+    #   context = nil (nil OR LZ4::Encoder::Context)::
+    #     reuse the compression context (one step processing only).
+    #   dictionary = nil (nil OR LZ4::Dictionary)::
+    #     compress with the dictionary and record its id in frame header.
+    #     can not be used with threads.
+    #   autoflush = true (true OR false)::
+    #     end a block on each write (streaming only).
+    #     false means a block is emitted when it is full.
+    #   flush_size = nil (nil OR unsigned integer)::
+    #     keep compressed data until it reaches this size before passing it
+    #     to the output port (streaming only).
+    #     nil means passing it on each write.
+    #   flush_interval = nil (nil OR unsigned integer)::
+    #     flush automatically when this many milliseconds have passed since
+    #     the first unflushed write (streaming only). checked on each write.
     #
     def LZ4.encode(port, *args, &block)
       if port.is_a?(String)
@@ -62,6 +85,9 @@ module LZ4
       alias compress encode
       alias decompress decode
       alias uncompress decode
+      alias compress_file encode_file
+      alias decompress_file decode_file
+      alias uncompress_file decode_file
     end
 
     class << Encoder
@@ -72,6 +98,80 @@ module LZ4
       alias decompress decode
       alias uncompress decode
     end
+
+    class Decoder
+      #
+      # call-seq:
+      #   each_chunk(buf = nil) { |chunk| ... } -> self
+      #   each_chunk(buf = nil) -> enumerator
+      #
+      # Yield decompressed data block by block (see LZ4::Decoder#read_chunk).
+      #
+      # If buf is given, the same string object is yielded every time and
+      # its content is replaced by the next chunk.
+      # Copy it (e.g. +chunk.dup+) if it must be kept.
+      #
+      def each_chunk(buf = nil)
+        return to_enum(:each_chunk, buf) unless block_given?
+
+        while chunk = read_chunk(buf)
+          yield chunk
+        end
+
+        self
+      end
+
+      private
+
+      # called by LZ4::Decoder#read_nonblock
+      def fetch_nonblock(size, buf)
+        port.read_nonblock(size, buf, exception: false)
+      end
+    end
+
+    class Encoder
+      private
+
+      # called by LZ4::Encoder#write_nonblock, #flush_nonblock and #close_nonblock
+      def emit_nonblock(buf)
+        port.write_nonblock(buf, exception: false)
+      end
+    end
+
+    #
+    # Registry of dictionaries looked up by dictID when decoding.
+    #
+    class Dictionary
+      @registry = {}
+
+      #
+      # call-seq:
+      #   register(*dicts) -> dicts
+      #
+      def Dictionary.register(*dicts)
+        dicts.each do |d|
+          raise TypeError, "expected LZ4::Dictionary" unless d.is_a?(Dictionary)
+          @registry[d.id] = d
+        end
+        dicts
+      end
+
+      #
+      # call-seq:
+      #   unregister(dict_or_id) -> dict or nil
+      #
+      def Dictionary.unregister(dict)
+        @registry.delete(dict.is_a?(Dictionary) ? dict.id : dict)
+      end
+
+      #
+      # call-seq:
+      #   Dictionary[id] -> dict or nil
+      #
+      def Dictionary.[](id)
+        @registry[id]
+      end
+    end
   end
 
   BlockCompressor = BlockEncoder
@@ -0,0 +1,259 @@
+#include "fdio.h"
+#include <errno.h>
+
+#if !defined(WITHOUT_LZ4_FDIO) && !defined(_WIN32)
+# define AUX_FDIO_USE_POSIX 1
+# include <fcntl.h>
+# include <limits.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+#endif
+
+#ifdef AUX_FDIO_USE_POSIX
+
+#if defined(IOV_MAX) && IOV_MAX < 64
+# define AUX_FD_IOV_MAX IOV_MAX
+#else
+# define AUX_FD_IOV_MAX 64
+#endif
+
+int
+aux_fd_check(int fd, int64_t *offset)
+{
+  if (fd < 0 || fcntl(fd, F_GETFL) < 0) { return EBADF; }
+
+  off_t off = lseek(fd, 0, SEEK_CUR);
+  if (off < 0) {
+    if (errno != ESPIPE) { return errno; }
+    *offset = -1;
+  } else {
+    *offset = (int64_t)off;
+  }
+
+  return 0;
+}
+
+int
+aux_fd_write(int fd, const void *buf, size_t size)
+{
+  const char *p = (const char *)buf;
+
+  while (size > 0) {
+    ssize_t s = write(fd, p, size);
+    if (s < 0) {
+      if (errno == EINTR) { continue; }
+      return errno;
+    }
+
+    p += s;
+    size -= (size_t)s;
+  }
+
+  return 0;
+}
+
+/*
+ * fd に O_NONBLOCK を設定する。元の状態を返し、失敗すれば -1 を返す。
+ *
+ * NOTE: ブロッキングのパイプやソケットでも待たずに戻れるように、呼び出しの間だけ設定する (IO#write_nonblock と同じ)。
+ */
+static int
+aux_fd_nonblock_begin(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) { return -1; }
+  if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) { return -1; }
+  return flags;
+}
+
+static void
+aux_fd_nonblock_end(int fd, int flags)
+{
+  if (!(flags & O_NONBLOCK)) {
+    int err = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = err;
+  }
+}
+
+int
+aux_fd_write_nonblock(int fd, const void *buf, size_t size, size_t *written)
+{
+  const char *p = (const char *)buf;
+  int err = 0;
+
+  *written = 0;
+
+  int flags = aux_fd_nonblock_begin(fd);
+  if (flags < 0) { return errno; }
+
+  while (*written < size) {
+    ssize_t s = write(fd, p + *written, size - *written);
+    if (s < 0) {
+      if (errno == EINTR) { continue; }
+      if (!AUX_FD_AGAIN_P(errno)) { err = errno; }
+      break;
+    }
+
+    *written += (size_t)s;
+  }
+
+  aux_fd_nonblock_end(fd, flags);
+
+  return err;
+}
+
+int
+aux_fd_writev(int fd, struct aux_fd_iovec *iov, int iovcnt)
+{
+  struct iovec v[AUX_FD_IOV_MAX];
+
+  for (;;) {
+    while (iovcnt > 0 && iov->size == 0) {
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt < 1) { break; }
+
+    int n;
+    for (n = 0; n < iovcnt && n < AUX_FD_IOV_MAX; n++) {
+      v[n].iov_base = (void *)iov[n].ptr;
+      v[n].iov_len = iov[n].size;
+    }
+
+    ssize_t s = writev(fd, v, n);
+    if (s < 0) {
+      if (errno == EINTR) { continue; }
+      return errno;
+    }
+
+    /* NOTE: 書き込まれた分だけ断片を進める */
+    while (s > 0) {
+      size_t k = ((size_t)s < iov->size ? (size_t)s : iov->size);
+      iov->ptr = (const char *)iov->ptr + k;
+      iov->size -= k;
+      s -= (ssize_t)k;
+
+      if (iov->size == 0) {
+        iov++;
+        iovcnt--;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int64_t
+aux_fd_read(int fd, void *buf, size_t size)
+{
+  for (;;) {
+    ssize_t s = read(fd, buf, size);
+    if (s < 0 && errno == EINTR) { continue; }
+    return (int64_t)s;
+  }
+}
+
+int64_t
+aux_fd_pread(int fd, void *buf, size_t size, int64_t offset)
+{
+  char *p = (char *)buf;
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t s = pread(fd, p + done, size - done, (off_t)(offset + done));
+    if (s < 0) {
+      if (errno == EINTR) { continue; }
+      return -1;
+    }
+
+    if (s == 0) { break; }
+    done += (size_t)s;
+  }
+
+  return (int64_t)done;
+}
+
+int64_t
+aux_fd_size(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) { return -1; }
+  return (int64_t)st.st_size;
+}
+
+void
+aux_fd_advise_sequential(int fd)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+  (void)fd;
+#endif
+}
+
+#else /* AUX_FDIO_USE_POSIX */
+
+int
+aux_fd_check(int fd, int64_t *offset)
+{
+  (void)fd;
+  *offset = -1;
+  return ENOSYS;
+}
+
+int
+aux_fd_write(int fd, const void *buf, size_t size)
+{
+  (void)fd; (void)buf; (void)size;
+  return ENOSYS;
+}
+
+int
+aux_fd_write_nonblock(int fd, const void *buf, size_t size, size_t *written)
+{
+  (void)fd; (void)buf; (void)size;
+  *written = 0;
+  return ENOSYS;
+}
+
+int
+aux_fd_writev(int fd, struct aux_fd_iovec *iov, int iovcnt)
+{
+  (void)fd; (void)iov; (void)iovcnt;
+  return ENOSYS;
+}
+
+int64_t
+aux_fd_read(int fd, void *buf, size_t size)
+{
+  (void)fd; (void)buf; (void)size;
+  errno = ENOSYS;
+  return -1;
+}
+
+int64_t
+aux_fd_pread(int fd, void *buf, size_t size, int64_t offset)
+{
+  (void)fd; (void)buf; (void)size; (void)offset;
+  errno = ENOSYS;
+  return -1;
+}
+
+int64_t
+aux_fd_size(int fd)
+{
+  (void)fd;
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+aux_fd_advise_sequential(int fd)
+{
+  (void)fd;
+}
+
+#endif /* AUX_FDIO_USE_POSIX */
@@ -0,0 +1,89 @@
+/**
+ * @file fdio.h
+ */
+
+#ifndef MRUBY_LZ4_FDIO_H
+#define MRUBY_LZ4_FDIO_H 1
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * err が非ブロッキングの fd で待つ必要があることを示すか判定します。
+ */
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+# define AUX_FD_AGAIN_P(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#else
+# define AUX_FD_AGAIN_P(err) ((err) == EAGAIN)
+#endif
+
+/**
+ * aux_fd_writev() に渡す断片です。
+ */
+struct aux_fd_iovec
+{
+  const void *ptr;
+  size_t size;
+};
+
+/**
+ * fd を直接読み書きできるか確認します。
+ *
+ * 利用できれば 0 を返し、offset に現在の位置を格納します。
+ * パイプなど位置を持たない場合の offset は -1 となります。
+ *
+ * 利用できなければ errno の値を返します。
+ * _WIN32 の場合や WITHOUT_LZ4_FDIO が定義されている場合は常に ENOSYS を返します。
+ */
+int aux_fd_check(int fd, int64_t *offset);
+
+/**
+ * 全てを書き込むまで write(2) を繰り返します。
+ *
+ * 成功すれば 0 を、失敗すれば errno の値を返します。
+ */
+int aux_fd_write(int fd, const void *buf, size_t size);
+
+/**
+ * 全てを書き込むか、書き込めなくなる (EAGAIN) まで write(2) を繰り返します。
+ *
+ * fd がブロッキングであっても、呼び出しの間だけ O_NONBLOCK を設定するため待ちません。
+ *
+ * 書き込んだ長さを written に格納します。
+ * 全てを書き込むか EAGAIN で止まれば 0 を、失敗すれば errno の値を返します。
+ */
+int aux_fd_write_nonblock(int fd, const void *buf, size_t size, size_t *written);
+
+/**
+ * 全てを書き込むまで writev(2) を繰り返します。iov の内容は書き換えられます。
+ *
+ * 成功すれば 0 を、失敗すれば errno の値を返します。
+ */
+int aux_fd_writev(int fd, struct aux_fd_iovec *iov, int iovcnt);
+
+/**
+ * read(2) で最大 size バイトを読み込みます。
+ *
+ * 読み込んだ長さ (終端であれば 0) を返し、失敗すれば -1 を返して errno を設定します。
+ */
+int64_t aux_fd_read(int fd, void *buf, size_t size);
+
+/**
+ * pread(2) で offset から最大 size バイトを読み込みます。全てを読み込むか終端に達するまで繰り返します。
+ *
+ * 読み込んだ長さを返し、失敗すれば -1 を返して errno を設定します。
+ */
+int64_t aux_fd_pread(int fd, void *buf, size_t size, int64_t offset);
+
+/**
+ * fd が指すファイルの大きさを返します。失敗すれば -1 を返して errno を設定します。
+ */
+int64_t aux_fd_size(int fd);
+
+/**
+ * 先読みを促すため、以降は先頭から順に読み込むことを伝えます。失敗しても何もしません。
+ */
+void aux_fd_advise_sequential(int fd);
+
+#endif /* MRUBY_LZ4_FDIO_H */
@@ -0,0 +1,229 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1 /* for fallocate() */
+#endif
+
+#include "mapfile.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(WITHOUT_LZ4_MMAP) && !defined(_WIN32)
+# define AUX_MAPFILE_USE_MMAP 1
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#ifdef AUX_MAPFILE_USE_MMAP
+
+int
+aux_mapfile_open(struct aux_mapfile *m, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return errno; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+
+  if ((uint64_t)st.st_size > SIZE_MAX) {
+    close(fd);
+    return EFBIG;
+  }
+
+  m->ptr = NULL;
+  m->size = (size_t)st.st_size;
+  m->fp = NULL;
+  m->mapped = 0;
+  m->dev = (uint64_t)st.st_dev;
+  m->ino = (uint64_t)st.st_ino;
+
+  if (m->size > 0) {
+    void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      return err;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(p, m->size, MADV_SEQUENTIAL);
+#endif
+
+    m->ptr = (char *)p;
+    m->mapped = 1;
+  }
+
+  /* NOTE: 対応付けた後であれば閉じても構わない */
+  close(fd);
+
+  return 0;
+}
+
+int
+aux_mapfile_same_p(const struct aux_mapfile *m, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0) { return 0; }
+
+  return ((uint64_t)st.st_dev == m->dev && (uint64_t)st.st_ino == m->ino);
+}
+
+int
+aux_mapfile_create(struct aux_mapfile *m, const char *path, uint64_t size)
+{
+  if (size > SIZE_MAX) { return EFBIG; }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) { return errno; }
+
+  int err = 0;
+  if (ftruncate(fd, (off_t)size) != 0) {
+    err = errno;
+  }
+
+#ifdef __linux__
+  /*
+   * NOTE: 穴の空いたファイルのままだと、容量が尽きた時に書き込みが SIGBUS となる。
+   *       対応していないファイルシステムであれば諦める。
+   */
+  if (err == 0 && size > 0 && fallocate(fd, 0, 0, (off_t)size) != 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+    err = errno;
+  }
+#endif
+
+  m->ptr = NULL;
+  m->size = (size_t)size;
+  m->fp = NULL;
+  m->mapped = 0;
+
+  if (err == 0 && size > 0) {
+    void *p = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      err = errno;
+    } else {
+      m->ptr = (char *)p;
+      m->mapped = 1;
+    }
+  }
+
+  close(fd);
+
+  return err;
+}
+
+int
+aux_mapfile_close(struct aux_mapfile *m)
+{
+  int err = 0;
+
+  if (m->mapped) {
+    if (munmap(m->ptr, m->size) != 0) { err = errno; }
+    m->mapped = 0;
+  }
+
+  m->ptr = NULL;
+  m->size = 0;
+
+  return err;
+}
+
+#else /* AUX_MAPFILE_USE_MMAP */
+
+int
+aux_mapfile_open(struct aux_mapfile *m, const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp) { return errno; }
+
+  long size;
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+    int err = errno;
+    fclose(fp);
+    return err;
+  }
+
+  m->ptr = NULL;
+  m->size = (size_t)size;
+  m->fp = NULL;
+  m->mapped = 0;
+
+  if (m->size > 0) {
+    m->ptr = (char *)malloc(m->size);
+    if (!m->ptr) {
+      fclose(fp);
+      return ENOMEM;
+    }
+
+    if (fread(m->ptr, 1, m->size, fp) != m->size) {
+      free(m->ptr);
+      m->ptr = NULL;
+      fclose(fp);
+      return EIO;
+    }
+
+    m->mapped = 1;
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
+int
+aux_mapfile_same_p(const struct aux_mapfile *m, const char *path)
+{
+  (void)m; (void)path;
+  return 0;
+}
+
+int
+aux_mapfile_create(struct aux_mapfile *m, const char *path, uint64_t size)
+{
+  if (size > SIZE_MAX) { return EFBIG; }
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) { return errno; }
+
+  m->ptr = NULL;
+  m->size = (size_t)size;
+  m->fp = fp;
+  m->mapped = 0;
+
+  if (size > 0) {
+    m->ptr = (char *)malloc(m->size);
+    if (!m->ptr) { return ENOMEM; }
+    m->mapped = 1;
+  }
+
+  return 0;
+}
+
+int
+aux_mapfile_close(struct aux_mapfile *m)
+{
+  int err = 0;
+
+  if (m->fp) {
+    if (m->size > 0 && m->ptr && fwrite(m->ptr, 1, m->size, (FILE *)m->fp) != m->size) { err = EIO; }
+    if (fclose((FILE *)m->fp) != 0 && err == 0) { err = errno; }
+    m->fp = NULL;
+  }
+
+  if (m->mapped) {
+    free(m->ptr);
+    m->mapped = 0;
+  }
+
+  m->ptr = NULL;
+  m->size = 0;
+
+  return err;
+}
+
+#endif /* AUX_MAPFILE_USE_MMAP */
@@ -0,0 +1,61 @@
+/**
+ * @file mapfile.h
+ */
+
+#ifndef MRUBY_LZ4_MAPFILE_H
+#define MRUBY_LZ4_MAPFILE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * メモリに対応付けたファイルです。
+ *
+ * mmap(2) が使えない場合 (_WIN32 の場合や WITHOUT_LZ4_MMAP が定義されている場合) は、
+ * 読み込みであればファイル全体を読み込んだ確保領域となり、
+ * 書き込みであれば閉じる時にファイルへ書き出す確保領域となります。
+ *
+ * 全ての要素を 0 で初期化してから用いて下さい。
+ */
+struct aux_mapfile
+{
+  char *ptr;
+  size_t size;
+  void *fp; /* mmap(2) が使えない場合の書き込み先 (FILE *) */
+  int mapped;
+  uint64_t dev; /* aux_mapfile_open() で開いたファイルの st_dev */
+  uint64_t ino; /* aux_mapfile_open() で開いたファイルの st_ino */
+};
+
+/**
+ * path を読み込み専用で対応付けます。
+ *
+ * 成功すれば 0 を、失敗すれば errno の値を返します。
+ * 空のファイルであれば ptr は NULL となります。
+ */
+int aux_mapfile_open(struct aux_mapfile *m, const char *path);
+
+/**
+ * path が aux_mapfile_open() で対応付けたファイルと同じもの (ハードリンクやシンボリックリンクを含む) であるかを調べます。
+ *
+ * 同じであれば 1 を、異なるか path が存在しなければ 0 を返します。
+ * mmap(2) が使えない場合は、入力を全て読み込んでいるため常に 0 を返します。
+ */
+int aux_mapfile_same_p(const struct aux_mapfile *m, const char *path);
+
+/**
+ * path を作成 (既にあれば切り詰め) して size バイトに伸ばし、書き込み可能として対応付けます。
+ *
+ * 成功すれば 0 を、失敗すれば errno の値を返します。
+ * 可能であればディスク上の領域も確保し、書き込みの途中で容量が尽きることを防ぎます。
+ */
+int aux_mapfile_create(struct aux_mapfile *m, const char *path, uint64_t size);
+
+/**
+ * 対応付けを解除してファイルを閉じます。二度目以降の呼び出しは何もしません。
+ *
+ * 成功すれば 0 を、失敗すれば errno の値を返します。
+ */
+int aux_mapfile_close(struct aux_mapfile *m);
+
+#endif /* MRUBY_LZ4_MAPFILE_H */
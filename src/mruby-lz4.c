@@ -1,4 +1,5 @@
 #include <mruby.h>
+#include <mruby/array.h>
 #include <mruby/class.h>
 #include <mruby/hash.h>
 #include <mruby/string.h>
@@ -7,14 +8,25 @@
 #include <mruby/variable.h>
 #include <mruby/error.h>
 #include <lz4.h>
+#define LZ4_HC_STATIC_LINKING_ONLY
 #include <lz4hc.h>
+#define LZ4F_STATIC_LINKING_ONLY
 #include <lz4frame.h>
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
 #include <mruby-aux.h>
 #include <mruby-aux/scanhash.h>
 #include <mruby-aux/string.h>
 #include <mruby-aux/fakedin.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h> /* for ssize_t */
+#include "parallel.h"
+#include "mapfile.h"
+#include "fdio.h"
+#include "probe.h"
 
 #define LOGF(FORMAT, ...) do { fprintf(stderr, "%s:%d:%s: " FORMAT "\n", __FILE__, __LINE__, __func__, __VA_ARGS__); } while (0)
 
@@ -22,9 +34,12 @@
 
 #define AUX_LZ4_PREFIX_MAX_CAPACITY  (65536L)
 
+#define AUX_LZ4_MT_BATCH_PER_THREAD ((size_t)1 << 20)
+
 #define AUX_OR_DEFAULT(primary, secondary) (NIL_P(primary) ? (secondary) : (primary))
 #define CLAMP(n, min, max) (n < min ? min : (n > max ? max : n))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define AUX_STR_MAX MRBX_STR_MAX
 
 #define AUX_NOT_REACHED_HERE                                            \
@@ -187,6 +202,64 @@ aux_to_sizet(MRB, mrb_value size)
   }
 }
 
+/*
+ * err を errno として SystemCallError を発生させる。
+ */
+static void
+aux_sys_fail(MRB, int err, const char *mesg)
+{
+  errno = err;
+  mrb_sys_fail(mrb, mesg);
+}
+
+/*
+ * port が mruby-io の IO オブジェクトであれば、そのファイル記述子を返す。
+ * そうでなければ (popen による IO を含む) -1 を返す。
+ *
+ * offset には現在の位置 (位置を持たなければ -1) を格納する。
+ */
+static int
+aux_io_raw_fileno(MRB, mrb_value port, int64_t *offset)
+{
+  if (!mrb_class_defined(mrb, "IO") || !mrb_obj_is_kind_of(mrb, port, mrb_class_get(mrb, "IO"))) {
+    return -1;
+  }
+
+  mrb_sym id_pid = mrb_intern_lit(mrb, "pid");
+  if (mrb_respond_to(mrb, port, id_pid) && !NIL_P(mrb_funcall_argv(mrb, port, id_pid, 0, NULL))) {
+    return -1;
+  }
+
+  mrb_value fileno = mrb_funcall_argv(mrb, port, mrb_intern_lit(mrb, "fileno"), 0, NULL);
+  if (!mrb_fixnum_p(fileno)) { return -1; }
+
+  int fd = (int)mrb_fixnum(fileno);
+  if (aux_fd_check(fd, offset) != 0) { return -1; }
+
+  return fd;
+}
+
+/*
+ * port が mruby-io の IO オブジェクトであれば、直接読み書きするためのファイル記述子を返す。
+ * そうでなければ -1 を返す。
+ *
+ * popen による IO や、IO 自身が読み込みバッファにデータを持っている (IO#pos が実際の位置と異なる) 場合は使わない。
+ * 位置を持たない (パイプなど) 場合は、読み込みバッファの有無を確かめられないため書き込みでのみ使う。
+ */
+static int
+aux_io_fileno(MRB, mrb_value port, mrb_bool reading)
+{
+  int64_t off;
+  int fd = aux_io_raw_fileno(mrb, port, &off);
+  if (fd < 0) { return -1; }
+  if (off < 0) { return (reading ? -1 : fd); }
+
+  mrb_value pos = mrb_funcall_argv(mrb, port, mrb_intern_lit(mrb, "pos"), 0, NULL);
+  if (!mrb_fixnum_p(pos) || mrb_fixnum(pos) != off) { return -1; }
+
+  return fd;
+}
+
 static void
 aux_lz4f_check_error(MRB, size_t status, const char *mesg)
 {
@@ -225,14 +298,25 @@ expand_size(MRB, const uint8_t *p, uintptr_t const pp, int32_t *size)
   return 0;
 }
 
+/*
+ * ブロック全体を走査して伸長後の長さを返す。
+ *
+ * inpos と outpos が与えられた場合、伸長後の位置が bound を超えずに始まる最後のシーケンスの
+ * 入力位置と出力位置を格納する。
+ */
 static int32_t
-aux_lz4_scan_size(MRB, const void *p, size_t len)
+aux_lz4_scan(MRB, const void *p, size_t len, size_t bound, size_t *inpos, size_t *outpos)
 {
   const uint8_t *q = (const uint8_t *)p;
   uintptr_t const qq = (uintptr_t)q + len;
   int32_t size = 0;
 
   while ((uintptr_t)q < qq) {
+    if (inpos && (size_t)size <= bound) {
+      *inpos = (uintptr_t)q - (uintptr_t)p;
+      *outpos = size;
+    }
+
     int32_t litlen = (*q >> 4) & 0x0f;
     int32_t duplen = (*q >> 0) & 0x0f;
     q++;
@@ -281,6 +365,146 @@ aux_lz4_scan_size(MRB, const void *p, size_t len)
   return 0;
 }
 
+static int32_t
+aux_lz4_scan_size(MRB, const void *p, size_t len)
+{
+  return aux_lz4_scan(mrb, p, len, 0, NULL, NULL);
+}
+
+/*
+ * 大きさ前置ブロック (sized: true) の前置部分。
+ *
+ * 伸長後の長さを下位から 7 ビットずつ並べた可変長整数 (LEB128) で、最大 5 バイトとなる。
+ */
+#define AUX_LZ4_VARINT_MAX 5
+
+static size_t
+aux_lz4_put_varint(char *p, uint32_t n)
+{
+  size_t i = 0;
+
+  for (; n >= 0x80; n >>= 7) {
+    p[i++] = (char)(n | 0x80);
+  }
+  p[i++] = (char)n;
+
+  return i;
+}
+
+static uint32_t
+aux_lz4_get_varint(MRB, const char **p, size_t *len)
+{
+  const uint8_t *q = (const uint8_t *)*p;
+  uint64_t n = 0;
+  size_t i;
+
+  for (i = 0; i < *len && i < AUX_LZ4_VARINT_MAX; i++) {
+    n |= (uint64_t)(q[i] & 0x7f) << (7 * i);
+    if (q[i] < 0x80) {
+      if (n > LZ4_MAX_INPUT_SIZE) { break; }
+      *p += i + 1;
+      *len -= i + 1;
+      return (uint32_t)n;
+    }
+  }
+
+  mrb_raise(mrb, E_RUNTIME_ERROR, "invalid size prefix");
+
+  return 0;
+}
+
+/*
+ * src をリテラルだけからなる一つのシーケンスとしてブロックに格納し、その長さを返す。
+ * destcapa に収まらなければ 0 を返す。
+ *
+ * 通常の LZ4 ブロックとして伸長でき、連結ブロックの履歴にもそのまま加わる。
+ */
+static size_t
+aux_lz4_store_block(char *dest, size_t destcapa, const char *src, size_t srclen)
+{
+  size_t headsize = 1 + (srclen >= 15 ? (srclen - 15) / 255 + 1 : 0);
+
+  if (srclen > LZ4_MAX_INPUT_SIZE || headsize + srclen > destcapa) {
+    return 0;
+  }
+
+  uint8_t *p = (uint8_t *)dest;
+
+  if (srclen < 15) {
+    *p++ = (uint8_t)(srclen << 4);
+  } else {
+    size_t n = srclen - 15;
+    *p++ = 0xf0;
+    for (; n >= 255; n -= 255) { *p++ = 255; }
+    *p++ = (uint8_t)n;
+  }
+
+  memcpy(p, src, srclen);
+
+  return headsize + srclen;
+}
+
+/*
+ * 伸長後の長さが分からない時の伸長先の見積もり (入力長に対する倍率)。
+ */
+#define AUX_LZ4_BLOCK_GUESS_RATIO 4
+
+/*
+ * 伸長後の長さが分からないブロックを伸長して、伸長後の長さを返す。失敗した場合は負の値を返す。
+ *
+ * 先に aux_lz4_scan_size() で全体を走査することはせず、見積もった大きさ (dest が既に確保していればその容量) まで伸長する。
+ * 収まらなかった場合に限って走査して正確な長さを求め、伸長先を広げて途中のシーケンスから伸長を続ける。
+ */
+static int
+aux_lz4_decode_unsized(MRB, const char *src, size_t srclen, struct RString *dest, const char *dict, size_t dictsize)
+{
+  /* NOTE: 1 バイトの入力から得られる出力は 255 バイトを超えない */
+  uint64_t limit = MIN((uint64_t)srclen * 255 + 16, (uint64_t)MIN(AUX_STR_MAX, LZ4_MAX_INPUT_SIZE));
+  size_t capa = MIN((uint64_t)srclen * AUX_LZ4_BLOCK_GUESS_RATIO, limit);
+
+  if ((size_t)RSTR_CAPA(dest) > capa) {
+    capa = MIN((size_t)RSTR_CAPA(dest), (size_t)limit);
+  } else {
+    mrbx_str_reserve(mrb, dest, capa);
+  }
+
+  int s = LZ4_decompress_safe_partial_usingDict(src, RSTR_PTR(dest), srclen, capa, capa, dict, dictsize);
+  if (s < 0 || (size_t)s < capa) {
+    return s;
+  }
+
+  size_t inpos = 0, outpos = 0;
+  size_t size = aux_lz4_scan(mrb, src, srclen, capa, &inpos, &outpos);
+  if (size <= capa) {
+    return s;
+  } else if (size > limit) {
+    return -1;
+  }
+
+  /*
+   * NOTE: 伸長済みの出力を続きの辞書とする。
+   *       出力が 64 KiB に満たなければ外部辞書も参照される可能性があるため、
+   *       その時は最初から伸長し直す。
+   */
+  if (outpos < AUX_LZ4_PREFIX_MAX_CAPACITY && dictsize > 0) {
+    inpos = outpos = 0;
+  }
+
+  mrbx_str_reserve(mrb, dest, size);
+
+  if (outpos > 0) {
+    dict = RSTR_PTR(dest);
+    dictsize = outpos;
+  }
+
+  s = LZ4_decompress_safe_usingDict(src + inpos, RSTR_PTR(dest) + outpos, srclen - inpos, size - outpos, dict, dictsize);
+  if (s < 0) {
+    return s;
+  }
+
+  return outpos + s;
+}
+
 #if !defined(WITHOUT_UNLZ4_GRADUAL)
 static void
 common_read_args(MRB, intptr_t *size, struct RString **dest)
@@ -310,549 +534,4016 @@ common_read_args(MRB, intptr_t *size, struct RString **dest)
 #endif
 
 /*
- * class LZ4::Encoder
+ * 一括処理 (LZ4::BlockEncoder.encode / LZ4::Decoder.decode) の作業状態の置き場所。
+ *
+ * mrb_state ごとに一つ用意して、呼び出しのたびの確保と解放を省く。
+ * 使用中の状態は置き場所から取り除いておくため、入れ子になった呼び出しは別の状態を確保する。
  */
 
-static LZ4F_preferences_t
-aux_lz4f_encode_args(MRB, mrb_value opts)
+enum aux_scratch_slot
 {
-  mrb_value level, blocksize, blocklink, checksum, size;
-  MRBX_SCANHASH(mrb, opts, Qnil,
-                MRBX_SCANHASH_ARGS("level", &level, Qnil),
-                MRBX_SCANHASH_ARGS("blocksize", &blocksize, Qnil),
-                MRBX_SCANHASH_ARGS("blocklink", &blocklink, Qtrue),
-                MRBX_SCANHASH_ARGS("checksum", &checksum, Qfalse),
-                MRBX_SCANHASH_ARGS("size", &size, Qnil));
+  AUX_SCRATCH_FAST, /* LZ4_stream_t */
+  AUX_SCRATCH_HC, /* LZ4_streamHC_t */
+  AUX_SCRATCH_DCTX, /* LZ4F_dctx */
+  AUX_SCRATCH_SLOTS
+};
 
-  LZ4F_preferences_t prefs = {
-    .frameInfo.blockSizeID = aux_lz4f_blocksizeid(mrb, size),
-    .frameInfo.blockMode = (NIL_P(blocklink) || mrb_bool(blocklink)) ? LZ4F_blockLinked : LZ4F_blockIndependent,
-    .frameInfo.contentChecksumFlag = (NIL_P(checksum) || mrb_bool(checksum)) ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum,
-    .frameInfo.frameType = LZ4F_frame,
-    .frameInfo.contentSize = aux_to_u64(mrb, size),
-    .compressionLevel = (int)aux_lz4f_compression_level(mrb, level),
-    .autoFlush = 1,
-  };
+struct aux_scratch
+{
+  void *slots[AUX_SCRATCH_SLOTS];
+  struct aux_probe_stats probestats; /* 一括処理 (probe: true) の判定の統計 */
+};
 
-  return prefs;
-}
+#define id_ivar_scratch mrb_intern_lit(mrb, "mruby-lz4.scratch")
 
 static void
-enc_s_encode_args(MRB, mrb_value *src, mrb_value *dest, LZ4F_preferences_t *prefs)
+aux_scratch_free_slot(MRB, enum aux_scratch_slot slot, void *p)
 {
-  mrb_int argc;
-  mrb_value *argv;
-  mrb_get_args(mrb, "*", &argv, &argc);
-  mrb_int argc0 = argc;
-  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-    *prefs = aux_lz4f_encode_args(mrb, argv[argc - 1]);
-    argc--;
+  if (slot == AUX_SCRATCH_DCTX) {
+    LZ4F_freeDecompressionContext((LZ4F_dctx *)p);
   } else {
-    memset(prefs, 0, sizeof(*prefs));
+    mrb_free(mrb, p);
   }
+}
 
-  size_t maxsize;
-  switch (argc) {
-  case 1:
-    *src = argv[0];
-    maxsize = -1;
-    *dest = Qnil;
-    break;
-  case 2:
-    *src = argv[0];
-    if (mrb_string_p(argv[1])) {
-      *dest = argv[1];
-      maxsize = -1;
-    } else {
-      *dest = Qnil;
-      maxsize = (NIL_P(argv[1]) ? -1 : aux_to_u64(mrb, argv[1]));
+static void
+aux_scratch_clear(MRB, struct aux_scratch *p)
+{
+  int i;
+  for (i = 0; i < AUX_SCRATCH_SLOTS; i++) {
+    if (p->slots[i]) {
+      aux_scratch_free_slot(mrb, (enum aux_scratch_slot)i, p->slots[i]);
+      p->slots[i] = NULL;
     }
+  }
+}
+
+static void
+aux_scratch_free(MRB, void *p)
+{
+  if (p) {
+    aux_scratch_clear(mrb, (struct aux_scratch *)p);
+    mrb_free(mrb, p);
+  }
+}
+
+static const mrb_data_type aux_scratch_type = {
+  .struct_name = "mruby-lz4.scratch",
+  .dfree = aux_scratch_free,
+};
+
+static struct aux_scratch *
+aux_scratch_get(MRB)
+{
+  /* NOTE: 置き場所が見つからなければ NULL を返し、呼び出し側はその都度確保と解放を行う */
+  mrb_value mLZ4 = mrb_obj_value(mrb_module_get(mrb, "LZ4"));
+  return (struct aux_scratch *)mrb_data_check_get_ptr(mrb, mrb_iv_get(mrb, mLZ4, id_ivar_scratch), &aux_scratch_type);
+}
+
+/*
+ * 置き場所から状態を取り出す。空であれば新しく確保して初期化する。
+ *
+ * AUX_SCRATCH_FAST と AUX_SCRATCH_HC は初期化済みであることだけを保証するため、
+ * 呼び出し側で LZ4_resetStream() / LZ4_resetStreamHC_fast() を行うこと。
+ * AUX_SCRATCH_DCTX はリセット済みであることを保証する。
+ */
+static void *
+aux_scratch_take(MRB, enum aux_scratch_slot slot)
+{
+  struct aux_scratch *s = aux_scratch_get(mrb);
+  void *p;
+
+  if (s && s->slots[slot]) {
+    p = s->slots[slot];
+    s->slots[slot] = NULL;
+    return p;
+  }
+
+  switch (slot) {
+  case AUX_SCRATCH_FAST:
+    p = mrb_malloc(mrb, sizeof(LZ4_stream_t));
+    LZ4_initStream(p, sizeof(LZ4_stream_t));
     break;
-  case 3:
-    *src = argv[0];
-    maxsize = (NIL_P(argv[1]) ? -1 : aux_to_u64(mrb, argv[1]));
-    *dest = argv[2];
+  case AUX_SCRATCH_HC:
+    p = mrb_malloc(mrb, sizeof(LZ4_streamHC_t));
+    LZ4_initStreamHC(p, sizeof(LZ4_streamHC_t));
+    break;
+  case AUX_SCRATCH_DCTX:
+    {
+      LZ4F_dctx *dctx;
+      size_t err = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+      aux_lz4f_check_error(mrb, err, "LZ4F_createDecompressionContext");
+      p = dctx;
+    }
     break;
   default:
-    mrb_raisef(mrb, E_ARGUMENT_ERROR,
-               "wrong number of arguments (given %S, expect 1..3 + keywords)",
-               mrb_fixnum_value(argc0));
+    AUX_NOT_REACHED_HERE;
   }
 
-  mrb_check_type(mrb, *src, MRB_TT_STRING);
-
-  if (maxsize == -1) {
-    maxsize = LZ4F_compressFrameBound(RSTRING_LEN(*src), prefs);
-  }
+  return p;
+}
 
-  maxsize = MIN(maxsize, AUX_STR_MAX);
+/*
+ * 取り出した状態を置き場所へ戻す。既に埋まっていれば解放する。
+ * AUX_SCRATCH_DCTX はリセットしてから戻すこと。
+ */
+static void
+aux_scratch_give(MRB, enum aux_scratch_slot slot, void *p)
+{
+  struct aux_scratch *s = aux_scratch_get(mrb);
 
-  if (NIL_P(*dest)) {
-    *dest = aux_str_buf_new(mrb, maxsize);
+  if (s && !s->slots[slot]) {
+    s->slots[slot] = p;
   } else {
-    mrb_check_type(mrb, *dest, MRB_TT_STRING);
-    mrbx_str_reserve(mrb, mrbx_str_ptr(mrb, *dest), maxsize);
-    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, *dest), 0);
+    aux_scratch_free_slot(mrb, slot, p);
   }
 }
 
+static struct aux_probe_stats *
+aux_scratch_probe_stats(MRB)
+{
+  struct aux_scratch *s = aux_scratch_get(mrb);
+  return (s ? &s->probestats : NULL);
+}
+
+static mrb_value
+aux_probe_stats_value(MRB, const struct aux_probe_stats *stats)
+{
+  mrb_value h = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "probed")), aux_int_value(mrb, stats->probed));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "magic")), aux_int_value(mrb, stats->magic));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "entropy")), aux_int_value(mrb, stats->entropy));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "bypassed")), aux_int_value(mrb, stats->bypassed));
+  return h;
+}
+
 /*
  * call-seq:
- *  encode(src, maxsize = nil, destbuf = "", prefs = {})
- *  encode(src, destbuf, prefs = {})
+ *  probe_stats(reset = false) -> hash
+ *
+ * Statistics of probe: true for one-shot functions
+ * (LZ4.encode, LZ4::Encoder.encode_file and LZ4::BlockEncoder.encode).
+ *
+ * [probed]   number of probed blocks (blocks shorter than 1 KiB are not probed)
+ * [magic]    number of blocks stored without compression by the magic number
+ * [entropy]  number of blocks stored without compression by the sampled entropy
+ * [bypassed] total bytes stored without compression
+ *
+ * If reset is true, clear the statistics after returning them.
  */
 static mrb_value
-enc_s_encode(MRB, mrb_value self)
+lz4_s_probe_stats(MRB, mrb_value self)
 {
-  mrb_value src, dest;
-  LZ4F_preferences_t prefs;
-  enc_s_encode_args(mrb, &src, &dest, &prefs);
+  mrb_bool reset = FALSE;
+  mrb_get_args(mrb, "|b", &reset);
 
-  size_t s = LZ4F_compressFrame(RSTRING_PTR(dest), RSTRING_CAPA(dest),
-                                RSTRING_PTR(src), RSTRING_LEN(src),
-                                &prefs);
-  aux_lz4f_check_error(mrb, s, "LZ4F_compressFrame");
-  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, dest), s);
-  return dest;
+  struct aux_probe_stats *stats = aux_scratch_probe_stats(mrb);
+  struct aux_probe_stats empty = { 0 };
+  mrb_value h = aux_probe_stats_value(mrb, (stats ? stats : &empty));
+
+  if (stats && reset) {
+    memset(stats, 0, sizeof(*stats));
+  }
+
+  return h;
 }
 
-struct encoder
+static void
+init_scratch(MRB, struct RClass *mLZ4)
 {
-  LZ4F_cctx *lz4f;
-  LZ4F_preferences_t prefs;
-  mrb_value io;
-  mrb_value outbuf;
-  size_t outbufsize;
-};
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb->object_class, NULL, &aux_scratch_type);
+  rd->data = mrb_calloc(mrb, 1, sizeof(struct aux_scratch));
+  mrb_iv_set(mrb, mrb_obj_value(mLZ4), id_ivar_scratch, mrb_obj_value(rd));
+
+  mrb_define_module_function(mrb, mLZ4, "probe_stats", lz4_s_probe_stats, MRB_ARGS_OPT(1));
+}
 
 static void
-encoder_free(MRB, struct encoder *p)
+final_scratch(MRB)
 {
-  if (p->lz4f) {
-    LZ4F_freeCompressionContext(p->lz4f);
+  struct aux_scratch *s = aux_scratch_get(mrb);
+
+  if (s) {
+    aux_scratch_clear(mrb, s);
   }
+}
+
+/*
+ * class LZ4::Dictionary
+ *
+ * LZ4F_createCDict() で下処理済みの辞書と、伸長のための辞書データ (最大 64 KiB) を保持する。
+ *
+ * 伸長の dictionary として与えられた文字列も、aux_lz4f_check_dicts() で id が 0 の辞書に変換する。
+ */
+
+struct dictionary
+{
+  LZ4F_CDict *cdict; /* 伸長専用の辞書であれば NULL */
+  uint32_t id; /* 0 であればどの dictID にも一致する */
+  size_t size;
+  char data[]; /* 伸長用の辞書データ */
+};
 
+static void
+dictionary_free(MRB, struct dictionary *p)
+{
+  LZ4F_freeCDict(p->cdict);
   mrb_free(mrb, p);
 }
 
-static const mrb_data_type encoder_type = {
-  .struct_name = "mruby-lz4.encoder",
-  .dfree = (void (*)(mrb_state *, void *))encoder_free,
+static const mrb_data_type dictionary_type = {
+  .struct_name = "mruby-lz4.dictionary",
+  .dfree = (void (*)(mrb_state *, void *))dictionary_free,
 };
 
-static struct encoder *
-getencoder(MRB, mrb_value self)
+static struct dictionary *
+get_dictionary(MRB, mrb_value obj)
 {
-  struct encoder *p;
-  Data_Get_Struct(mrb, self, &encoder_type, p);
+  struct dictionary *p = (struct dictionary *)mrb_data_get_ptr(mrb, obj, &dictionary_type);
+  if (!p) { mrb_raise(mrb, E_TYPE_ERROR, "uninitialized LZ4::Dictionary"); }
   return p;
 }
 
-static mrb_value
-encoder_set_outport(MRB, mrb_value self, struct encoder *p, mrb_value port)
+static mrb_bool
+dictionary_p(mrb_value obj)
 {
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.outport"), port);
-  p->io = port;
-  return port;
+  return mrb_data_p(obj) && DATA_TYPE(obj) == &dictionary_type;
 }
 
+/*
+ * 辞書データの末尾 64 KiB を複製した辞書オブジェクトを作る。
+ * cdict が偽であれば LZ4F_createCDict() を省き、伸長専用とする。
+ */
 static mrb_value
-encoder_set_outbuf(MRB, mrb_value obj, struct encoder *p, mrb_value buf)
+dictionary_new(MRB, struct RClass *klass, const char *data, size_t datalen, uint32_t id, mrb_bool cdict)
 {
-  p->outbuf = buf;
-  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-lz4.outbuf"), buf);
-  return buf;
+  if (datalen > AUX_LZ4_PREFIX_MAX_CAPACITY) {
+    data += datalen - AUX_LZ4_PREFIX_MAX_CAPACITY;
+    datalen = AUX_LZ4_PREFIX_MAX_CAPACITY;
+  }
+
+  struct RData *rd = mrb_data_object_alloc(mrb, klass, NULL, &dictionary_type);
+  struct dictionary *p = (struct dictionary *)mrb_malloc(mrb, sizeof(struct dictionary) + datalen);
+  memcpy(p->data, data, datalen);
+  p->size = datalen;
+  p->id = id;
+  p->cdict = NULL;
+  if (cdict) {
+    p->cdict = LZ4F_createCDict(p->data, datalen);
+    if (!p->cdict) {
+      mrb_free(mrb, p);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "LZ4F_createCDict failed");
+    }
+  }
+  rd->data = p;
+
+  return mrb_obj_value(rd);
 }
 
 /*
  * call-seq:
- *  new(outport, prefs = {})
+ *  new(data, id = nil) -> new dictionary
+ *
+ * [data (String)]
+ *
+ *  dictionary content. only the last 64 KiB is used.
+ *
+ * [id (nil OR 1..0xffffffff)]
+ *
+ *  dictID recorded in the frame header.
+ *  If nil, it is calculated from data by xxHash32.
  */
 static mrb_value
-enc_s_new(MRB, mrb_value self)
+dict_s_new(MRB, mrb_value self)
 {
-  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &encoder_type);
-  struct encoder *p = (struct encoder *)mrb_calloc(mrb, 1, sizeof(struct encoder));
-  rd->data = p;
-  LZ4F_errorCode_t err = LZ4F_createCompressionContext(&p->lz4f, LZ4F_getVersion());
-  aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
-  p->io = Qnil;
-  p->outbuf = Qnil;
-  p->outbufsize = MIN(256 << 10, AUX_STR_MAX); /* AUX_STR_MAX or 256 KiB */
+  const char *data;
+  mrb_int datalen;
+  mrb_value id = Qnil;
+  mrb_get_args(mrb, "s|o", &data, &datalen, &id);
+
+  uint32_t dictid;
+  if (NIL_P(id)) {
+    if (datalen > AUX_LZ4_PREFIX_MAX_CAPACITY) {
+      data += datalen - AUX_LZ4_PREFIX_MAX_CAPACITY;
+      datalen = AUX_LZ4_PREFIX_MAX_CAPACITY;
+    }
 
-  mrb_value obj = mrb_obj_value(rd);
-  mrb_int argc;
-  mrb_value *argv;
-  mrb_get_args(mrb, "*", &argv, &argc);
-  mrb_funcall_argv(mrb, obj, id_initialize, argc, argv);
+    dictid = XXH32(data, datalen, 0);
+    if (dictid == 0) { dictid = 1; }
+  } else {
+    mrb_int n = mrb_int(mrb, id);
+    if (n < 1 || (uint64_t)n > UINT32_MAX) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                 "wrong dictionary id (given %S, expect 1..0xffffffff)", id);
+    }
+    dictid = (uint32_t)n;
+  }
 
-  return obj;
+  return dictionary_new(mrb, mrb_class_ptr(self), data, datalen, dictid, TRUE);
+}
+
+/*
+ * call-seq:
+ *  id -> integer
+ */
+static mrb_value
+dict_get_id(MRB, mrb_value self)
+{
+  return aux_int_value(mrb, get_dictionary(mrb, self)->id);
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ */
+static mrb_value
+dict_get_size(MRB, mrb_value self)
+{
+  return aux_int_value(mrb, get_dictionary(mrb, self)->size);
+}
+
+/*
+ * call-seq:
+ *  to_s -> dictionary data
+ */
+static mrb_value
+dict_to_s(MRB, mrb_value self)
+{
+  struct dictionary *p = get_dictionary(mrb, self);
+  return mrb_str_new(mrb, p->data, p->size);
 }
 
 static void
-enc_initialize_args(MRB, mrb_value *outport, LZ4F_preferences_t *prefs)
+init_dictionary(MRB, struct RClass *mLZ4)
 {
-  mrb_int argc;
-  mrb_value *argv;
-  mrb_get_args(mrb, "*", &argv, &argc);
-  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-    *prefs = aux_lz4f_encode_args(mrb, argv[argc - 1]);
-    argc--;
-  } else {
-    memset(prefs, 0, sizeof(*prefs));
+  struct RClass *cDictionary = mrb_define_class_under(mrb, mLZ4, "Dictionary", mrb_cObject);
+  MRB_SET_INSTANCE_TT(cDictionary, MRB_TT_DATA);
+  mrb_define_class_method(mrb, cDictionary, "new", dict_s_new, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, cDictionary, "id", dict_get_id, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cDictionary, "size", dict_get_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cDictionary, "to_s", dict_to_s, MRB_ARGS_NONE());
+}
+
+/*
+ * 伸長のための辞書を選ぶ。
+ *
+ * dicts は nil, LZ4::Dictionary, またはその配列 (aux_lz4f_check_dicts() を通したもの)。
+ *
+ * dictID が 0 であれば、dicts が LZ4::Dictionary であればそれを使う。
+ * dictID が 0 以外であれば、id が 0 (文字列から変換したもの) か dictID が一致する LZ4::Dictionary を使う。
+ * dicts から見つからなければ LZ4::Dictionary.[] で登録済みのものを探し、それでもなければ例外を発生させる。
+ */
+static mrb_value
+aux_lz4f_select_dict(MRB, mrb_value dicts, uint32_t dictid)
+{
+  if (dictionary_p(dicts)) {
+    uint32_t id = get_dictionary(mrb, dicts)->id;
+    if (dictid == 0 || id == 0 || id == dictid) { return dicts; }
+  } else if (mrb_array_p(dicts)) {
+    mrb_int i;
+    for (i = 0; i < RARRAY_LEN(dicts); i++) {
+      mrb_value d = RARRAY_PTR(dicts)[i];
+      if (dictid != 0 && dictionary_p(d) && get_dictionary(mrb, d)->id == dictid) { return d; }
+    }
   }
 
-  if (argc == 1) {
-    *outport = argv[0];
-    return;
+  if (dictid == 0) { return Qnil; }
+
+  struct RClass *cDictionary = mrb_class_get_under(mrb, mrb_module_get(mrb, "LZ4"), "Dictionary");
+  mrb_value d = FUNCALL(mrb, mrb_obj_value(cDictionary), mrb_intern_lit(mrb, "[]"), aux_int_value(mrb, dictid));
+  if (!dictionary_p(d)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR,
+               "dictionary is not found (dictID=%S)",
+               aux_int_value(mrb, dictid));
+  }
+
+  return d;
+}
+
+static void
+aux_lz4f_dict_data(MRB, mrb_value dict, const char **ptr, size_t *size)
+{
+  if (mrb_string_p(dict)) {
+    *ptr = RSTRING_PTR(dict);
+    *size = RSTRING_LEN(dict);
+  } else if (dictionary_p(dict)) {
+    struct dictionary *d = get_dictionary(mrb, dict);
+    *ptr = d->data;
+    *size = d->size;
   } else {
-    mrb_raisef(mrb,
-               E_ARGUMENT_ERROR,
-               "wrong number of arguments (given %S, expect 1 with keywords)",
-               mrb_fixnum_value(argc));
+    *ptr = NULL;
+    *size = 0;
   }
 }
 
+/*
+ * 伸長の dictionary を検査して、aux_lz4f_select_dict() に渡せる値を返す。
+ *
+ * 文字列はフレームごとに複製することがないように、ここで一度だけ末尾 64 KiB を取り出して
+ * 伸長専用の LZ4::Dictionary (id は 0) に変換する。
+ */
 static mrb_value
-enc_initialize(MRB, mrb_value self)
+aux_lz4f_check_dicts(MRB, mrb_value dicts)
 {
-  struct encoder *p = getencoder(mrb, self);
-  enc_initialize_args(mrb, &p->io, &p->prefs);
-  encoder_set_outport(mrb, self, p, p->io);
+  if (NIL_P(dicts) || dictionary_p(dicts)) { return dicts; }
 
-  encoder_set_outbuf(mrb, self, p, aux_str_buf_new(mrb, p->outbufsize));
-  size_t s = LZ4F_compressBegin(p->lz4f, RSTRING_PTR(p->outbuf), RSTRING_CAPA(p->outbuf), &p->prefs);
-  aux_lz4f_check_error(mrb, s, "LZ4F_compressBegin");
-  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), s);
-  FUNCALL(mrb, p->io, mrb_intern_lit(mrb, "<<"), p->outbuf);
+  if (mrb_string_p(dicts)) {
+    struct RClass *cDictionary = mrb_class_get_under(mrb, mrb_module_get(mrb, "LZ4"), "Dictionary");
+    return dictionary_new(mrb, cDictionary, RSTRING_PTR(dicts), RSTRING_LEN(dicts), 0, FALSE);
+  }
 
-  return self;
+  if (mrb_array_p(dicts)) {
+    mrb_int i;
+    for (i = 0; i < RARRAY_LEN(dicts); i++) {
+      if (!dictionary_p(RARRAY_PTR(dicts)[i])) { goto wrong; }
+    }
+    return dicts;
+  }
+
+wrong:
+  mrb_raise(mrb, E_TYPE_ERROR,
+            "wrong dictionary (expect nil, String, LZ4::Dictionary or Array of LZ4::Dictionary)");
+
+  return Qnil;
+}
+
+/*
+ * class LZ4::Encoder
+ */
+
+struct encode_opts
+{
+  LZ4F_preferences_t prefs;
+  int threads; /* 0 であれば LZ4F_compressUpdate() による単一スレッド処理 */
+  mrb_bool autosize; /* size が省略された。一括処理であれば入力長を contentSize として記録する */
+  LZ4F_cctx *context; /* 一括処理で利用者が保持する圧縮コンテキスト。NULL であれば一時的に用意する */
+  mrb_value dictionary; /* LZ4::Dictionary OR nil */
+  const LZ4F_CDict *cdict;
+  size_t flushsize; /* ストリーム処理で、出力を溜め込んでから出力先へ渡す量。0 であれば溜め込まない */
+  uint32_t flushinterval; /* ストリーム処理で、書き込みからフラッシュまでの最大の待ち時間 (ミリ秒)。0 であれば無効 */
+  uint32_t framesize; /* LZ4::SeekableEncoder で一つのフレームに収める入力の長さ。0 であればフレームを区切らない */
+  mrb_bool probe; /* ブロックごとに圧縮できるかを調べ、できなければ無圧縮ブロックとして格納する */
+};
+
+/*
+ * class LZ4::Encoder::Context
+ *
+ * 一括処理 (LZ4::Encoder.encode) のために利用者が保持する LZ4F_cctx。
+ */
+
+static void
+enc_context_free(MRB, void *p)
+{
+  LZ4F_freeCompressionContext((LZ4F_cctx *)p);
+}
+
+static const mrb_data_type encoder_context_type = {
+  .struct_name = "mruby-lz4.encoder.context",
+  .dfree = enc_context_free,
+};
+
+static LZ4F_cctx *
+get_encoder_context(MRB, mrb_value obj)
+{
+  LZ4F_cctx *p = (LZ4F_cctx *)mrb_data_get_ptr(mrb, obj, &encoder_context_type);
+  if (!p) { mrb_raise(mrb, E_TYPE_ERROR, "uninitialized LZ4::Encoder::Context"); }
+  return p;
 }
 
 /*
  * call-seq:
- *  write(src) -> self
+ *  new -> new compression context
+ */
+static mrb_value
+enc_context_s_new(MRB, mrb_value self)
+{
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &encoder_context_type);
+  LZ4F_cctx *cctx;
+  LZ4F_errorCode_t err = LZ4F_createCompressionContext(&cctx, LZ4F_getVersion());
+  aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
+  rd->data = cctx;
+
+  return mrb_obj_value(rd);
+}
+
+static int
+aux_lz4f_threads(MRB, mrb_value threads)
+{
+  if (NIL_P(threads)) {
+    return 0;
+  }
+
+  mrb_int n = mrb_int(mrb, threads);
+  if (n < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong threads (given %S, expect nil or 0 or positive integer)",
+               threads);
+  } else if (n == 0) {
+    return aux_parallel_ncpu();
+  }
+
+  return (int)MIN(n, AUX_PARALLEL_MAX_THREADS);
+}
+
+static void
+aux_lz4f_encode_args(MRB, mrb_value opts, struct encode_opts *args)
+{
+  mrb_value level, blocksize, blocklink, checksum, size, threads, context, dictionary;
+  mrb_value autoflush, flush_size, flush_interval, probe;
+  MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("level", &level, Qnil),
+                MRBX_SCANHASH_ARGS("blocksize", &blocksize, Qnil),
+                MRBX_SCANHASH_ARGS("blocklink", &blocklink, Qtrue),
+                MRBX_SCANHASH_ARGS("checksum", &checksum, Qfalse),
+                MRBX_SCANHASH_ARGS("size", &size, Qnil),
+                MRBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                MRBX_SCANHASH_ARGS("context", &context, Qnil),
+                MRBX_SCANHASH_ARGS("dictionary", &dictionary, Qnil),
+                MRBX_SCANHASH_ARGS("autoflush", &autoflush, Qtrue),
+                MRBX_SCANHASH_ARGS("flush_size", &flush_size, Qnil),
+                MRBX_SCANHASH_ARGS("flush_interval", &flush_interval, Qnil),
+                MRBX_SCANHASH_ARGS("probe", &probe, Qfalse));
+
+  LZ4F_preferences_t prefs = {
+    .frameInfo.blockSizeID = aux_lz4f_blocksizeid(mrb, blocksize),
+    .frameInfo.blockMode = (NIL_P(blocklink) || mrb_bool(blocklink)) ? LZ4F_blockLinked : LZ4F_blockIndependent,
+    .frameInfo.contentChecksumFlag = (NIL_P(checksum) || mrb_bool(checksum)) ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum,
+    .frameInfo.frameType = LZ4F_frame,
+    .frameInfo.contentSize = (mrb_test(size) ? aux_to_u64(mrb, size) : 0),
+    .compressionLevel = (int)aux_lz4f_compression_level(mrb, level),
+    .autoFlush = (NIL_P(autoflush) || mrb_bool(autoflush)) ? 1 : 0,
+  };
+
+  args->prefs = prefs;
+  args->threads = aux_lz4f_threads(mrb, threads);
+  args->autosize = NIL_P(size);
+  args->context = (NIL_P(context) ? NULL : get_encoder_context(mrb, context));
+  args->dictionary = dictionary;
+  args->cdict = NULL;
+  args->flushsize = (mrb_test(flush_size) ? aux_to_u32(mrb, flush_size) : 0);
+  args->flushinterval = (mrb_test(flush_interval) ? aux_to_u32(mrb, flush_interval) : 0);
+  args->probe = mrb_test(probe);
+
+  if (!NIL_P(dictionary)) {
+    struct dictionary *d = get_dictionary(mrb, dictionary);
+    args->cdict = d->cdict;
+    args->prefs.frameInfo.dictID = d->id;
+
+    if (args->threads > 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "threads can not be used with dictionary");
+    }
+  }
+
+  if (args->threads > 0 && prefs.frameInfo.blockMode == LZ4F_blockLinked) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "threads requires blocklink: false");
+  }
+
+  if (args->probe) {
+    if (prefs.frameInfo.blockMode == LZ4F_blockLinked) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "probe requires blocklink: false");
+    }
+
+    if (!NIL_P(dictionary)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "probe can not be used with dictionary");
+    }
+
+    /* NOTE: ブロックごとに判定するため、LZ4F_compressUpdate() ではなく lz4f_mt で圧縮する */
+    if (args->threads == 0) {
+      args->threads = 1;
+    }
+  }
+}
+
+static void
+aux_lz4f_encode_opts_default(struct encode_opts *args)
+{
+  memset(args, 0, sizeof(*args));
+  args->prefs.autoFlush = 1;
+  args->autosize = TRUE;
+  args->dictionary = Qnil;
+}
+
+/*
+ * LZ4::SeekableEncoder / LZ4::SeekableDecoder の形式。
+ *
+ * 入力を frame_size ごとに独立したフレームとし、最後にシークテーブルを収めたスキップ可能フレームを置く。
+ * シークテーブルの配置は zstd の seekable format と同じ:
+ *
+ *  - スキップ可能フレームのマジックナンバー (0x184D2A5E) と長さ (各 4 バイト)
+ *  - フレームごとの圧縮後の長さと圧縮前の長さ (各 4 バイト)
+ *  - フレームの数 (4 バイト)、記述子 (1 バイト)、マジックナンバー (0x8F92EAB1, 4 バイト)
+ *
+ * 通常の LZ4 伸長器はスキップ可能フレームを読み飛ばすため、全体をそのまま伸長できる。
+ */
+
+#define AUX_SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5EU
+#define AUX_SEEKABLE_MAGIC 0x8F92EAB1U
+#define AUX_SEEKABLE_FOOTER_SIZE 9
+#define AUX_SEEKABLE_ENTRY_SIZE 8
+#define AUX_SEEKABLE_CHECKSUM_FLAG 0x80
+#define AUX_SEEKABLE_DEFAULT_FRAME_SIZE ((uint32_t)1 << 20)
+#define AUX_SEEKABLE_MAX_FRAME_SIZE ((uint32_t)1 << 30) /* 圧縮後の長さも 4 バイトに収まる */
+
+/*
+ * LZ4::SeekableEncoder の prefs を解釈する。
+ *
+ * frame_size を取り除いた残りは LZ4::Encoder と同じ。contentSize は記録しない。
+ */
+static void
+aux_seekable_encode_args(MRB, mrb_value prefs, struct encode_opts *opts)
+{
+  mrb_value framesize = Qnil;
+
+  if (NIL_P(prefs)) {
+    aux_lz4f_encode_opts_default(opts);
+  } else {
+    prefs = mrb_hash_dup(mrb, prefs);
+    framesize = mrb_hash_delete_key(mrb, prefs, mrb_symbol_value(mrb_intern_lit(mrb, "frame_size")));
+    aux_lz4f_encode_args(mrb, prefs, opts);
+  }
+
+  opts->framesize = (NIL_P(framesize) ? AUX_SEEKABLE_DEFAULT_FRAME_SIZE : aux_to_u32(mrb, framesize));
+  if (opts->framesize < 1 || opts->framesize > AUX_SEEKABLE_MAX_FRAME_SIZE) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong frame_size (given %S, expect 1..%S)",
+               framesize, mrb_fixnum_value(AUX_SEEKABLE_MAX_FRAME_SIZE));
+  }
+
+  opts->prefs.frameInfo.contentSize = 0;
+}
+
+/*
+ * 独立したブロック (blocklink: false) を複数のスレッドで圧縮するための作業領域。
+ *
+ * ブロックの区切りはスレッド数によらず (フラッシュされない限り) blocksize ごとになるため、
+ * 出力はスレッド数によらず同一となる。
+ *
+ * 各ブロックの圧縮方法は LZ4F_compressUpdate() と同じ。
+ */
+struct lz4f_mt
+{
+  int threads;
+  int level;
+  LZ4F_blockChecksum_t blockchecksum;
+  LZ4F_contentChecksum_t contentchecksum;
+  size_t blocksize;
+  size_t nslots;
+  size_t slotsize;
+  void **states;
+  size_t *slotlens;
+  uint8_t *probes; /* ブロックごとの aux_probe() の結果 */
+  char *slots;
+  char *inbuf;
+  size_t inbuflen;
+
+  mrb_bool probe;
+  struct aux_probe_stats *stats; /* probe の判定を加える統計。NULL であれば数えない */
+
+  const char *src;
+  size_t srclen;
+  size_t nblocks;
+  uint64_t total;
+  uint64_t contentsize;
+  XXH32_state_t xxh;
+
+  /* 直後の連続した領域に states, slotlens, probes, 圧縮状態, slots, inbuf が確保される */
+};
+
+#define AUX_ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+static void
+aux_store_u32le(char *p, uint32_t n)
+{
+  uint8_t *q = (uint8_t *)p;
+  q[0] = (uint8_t)(n >> 0);
+  q[1] = (uint8_t)(n >> 8);
+  q[2] = (uint8_t)(n >> 16);
+  q[3] = (uint8_t)(n >> 24);
+}
+
+static struct lz4f_mt *
+lz4f_mt_new(MRB, const LZ4F_preferences_t *prefs, int threads, mrb_bool streaming)
+{
+  size_t blocksize = LZ4F_getBlockSize(prefs->frameInfo.blockSizeID);
+  aux_lz4f_check_error(mrb, blocksize, "LZ4F_getBlockSize");
+
+  size_t nslots = (size_t)threads * MAX(1, AUX_LZ4_MT_BATCH_PER_THREAD / blocksize);
+  size_t slotsize = 4 + blocksize + 4;
+  size_t statesize = AUX_ALIGN_UP(prefs->compressionLevel < LZ4HC_CLEVEL_MIN ? LZ4_sizeofState() : LZ4_sizeofStateHC(), 16);
+  size_t headsize = AUX_ALIGN_UP(sizeof(struct lz4f_mt) + sizeof(void *) * threads + sizeof(size_t) * nslots + nslots, 16);
+  size_t allocsize = headsize + statesize * threads + slotsize * nslots + (streaming ? blocksize * nslots : 0);
+
+  struct lz4f_mt *mt = (struct lz4f_mt *)mrb_malloc(mrb, allocsize);
+  memset(mt, 0, sizeof(*mt));
+  mt->threads = threads;
+  mt->level = prefs->compressionLevel;
+  mt->blockchecksum = prefs->frameInfo.blockChecksumFlag;
+  mt->contentchecksum = prefs->frameInfo.contentChecksumFlag;
+  mt->blocksize = blocksize;
+  mt->nslots = nslots;
+  mt->slotsize = slotsize;
+  mt->states = (void **)(mt + 1);
+  mt->slotlens = (size_t *)(mt->states + threads);
+  mt->probes = (uint8_t *)(mt->slotlens + nslots);
+  mt->slots = (char *)mt + headsize + statesize * threads;
+  mt->inbuf = (streaming ? mt->slots + slotsize * nslots : NULL);
+  mt->contentsize = prefs->frameInfo.contentSize;
+  XXH32_reset(&mt->xxh, 0);
+
+  int i;
+  for (i = 0; i < threads; i++) {
+    mt->states[i] = (char *)mt + headsize + statesize * i;
+  }
+
+  return mt;
+}
+
+/*
+ * 同じ作業領域をそのまま使えるかどうか。
+ */
+static mrb_bool
+lz4f_mt_reusable_p(const struct lz4f_mt *mt, const LZ4F_preferences_t *prefs, int threads)
+{
+  return mt->threads == threads &&
+         mt->level == prefs->compressionLevel &&
+         mt->blockchecksum == prefs->frameInfo.blockChecksumFlag &&
+         mt->contentchecksum == prefs->frameInfo.contentChecksumFlag &&
+         mt->blocksize == LZ4F_getBlockSize(prefs->frameInfo.blockSizeID);
+}
+
+/*
+ * 新しいフレームを始めるために、作業領域を初期状態に戻す。
+ */
+static void
+lz4f_mt_reset(struct lz4f_mt *mt, uint64_t contentsize)
+{
+  mt->inbuflen = 0;
+  mt->src = NULL;
+  mt->srclen = 0;
+  mt->nblocks = 0;
+  mt->total = 0;
+  mt->contentsize = contentsize;
+  XXH32_reset(&mt->xxh, 0);
+}
+
+static void
+lz4f_mt_job(void *user, int worker, size_t index)
+{
+  struct lz4f_mt *mt = (struct lz4f_mt *)user;
+
+  if (mt->contentchecksum) {
+    /* NOTE: 仕事番号 0 は内容のチェックサムを計算する */
+    if (index == 0) {
+      XXH32_update(&mt->xxh, mt->src, mt->srclen);
+      return;
+    }
+
+    index--;
+  }
+
+  size_t off = mt->blocksize * index;
+  const char *src = mt->src + off;
+  int srclen = (int)MIN(mt->blocksize, mt->srclen - off);
+  char *dest = mt->slots + mt->slotsize * index;
+  int s;
+
+  if (mt->probe && (mt->probes[index] = aux_probe(src, srclen)) != AUX_PROBE_COMPRESSIBLE) {
+    s = 0;
+  } else if (mt->level < LZ4HC_CLEVEL_MIN) {
+    s = LZ4_compress_fast_extState(mt->states[worker], src, dest + 4, srclen, srclen - 1, (mt->level < 0 ? -mt->level + 1 : 1));
+  } else {
+    s = LZ4_compress_HC_extStateHC(mt->states[worker], src, dest + 4, srclen, srclen - 1, mt->level);
+  }
+
+  if (s <= 0 || s >= srclen) {
+    /* NOTE: 圧縮できなかったため、無圧縮ブロックとして格納する */
+    memcpy(dest + 4, src, srclen);
+    aux_store_u32le(dest, (uint32_t)srclen | 0x80000000UL);
+    s = srclen;
+  } else {
+    aux_store_u32le(dest, (uint32_t)s);
+  }
+
+  if (mt->blockchecksum) {
+    aux_store_u32le(dest + 4 + s, XXH32(dest + 4, s, 0));
+    mt->slotlens[index] = 4 + s + 4;
+  } else {
+    mt->slotlens[index] = 4 + s;
+  }
+}
+
+/*
+ * src から最大で nslots 個のブロックを圧縮する。
+ *
+ * 圧縮したバイト数を返す。結果は lz4f_mt_output() で取り出す。
  */
+static size_t
+lz4f_mt_compress(struct lz4f_mt *mt, const char *src, size_t srclen)
+{
+  srclen = MIN(srclen, mt->blocksize * mt->nslots);
+  mt->src = src;
+  mt->srclen = srclen;
+  mt->nblocks = (srclen + mt->blocksize - 1) / mt->blocksize;
+  mt->total += srclen;
+
+  aux_parallel_run(mt->threads, mt->nblocks + (mt->contentchecksum ? 1 : 0), lz4f_mt_job, mt);
+
+  if (mt->probe && mt->stats) {
+    size_t i;
+    for (i = 0; i < mt->nblocks; i++) {
+      aux_probe_count(mt->stats, (enum aux_probe_result)mt->probes[i], MIN(mt->blocksize, srclen - mt->blocksize * i));
+    }
+  }
+
+  return srclen;
+}
+
+static size_t
+lz4f_mt_output_size(const struct lz4f_mt *mt)
+{
+  size_t size = 0, i;
+
+  for (i = 0; i < mt->nblocks; i++) {
+    size += mt->slotlens[i];
+  }
+
+  return size;
+}
+
+static size_t
+lz4f_mt_output(struct lz4f_mt *mt, char *dest)
+{
+  char *p = dest;
+  size_t i;
+
+  for (i = 0; i < mt->nblocks; i++) {
+    memcpy(p, mt->slots + mt->slotsize * i, mt->slotlens[i]);
+    p += mt->slotlens[i];
+  }
+
+  mt->nblocks = 0;
+
+  return p - dest;
+}
+
+/*
+ * lz4f_mt_output() の代わりに、各ブロックの出力を複写せずに iov へ並べる。
+ *
+ * iov は nslots 個の要素を持たなければならない。並べた数を返す。
+ */
+static int
+lz4f_mt_output_iov(struct lz4f_mt *mt, struct aux_fd_iovec *iov)
+{
+  int n = (int)mt->nblocks;
+  size_t i;
+
+  for (i = 0; i < mt->nblocks; i++) {
+    iov[i].ptr = mt->slots + mt->slotsize * i;
+    iov[i].size = mt->slotlens[i];
+  }
+
+  mt->nblocks = 0;
+
+  return n;
+}
+
+/*
+ * prefs で与えた content_size と実際の入力長が一致するかどうか。
+ */
+static mrb_bool
+lz4f_mt_size_p(const struct lz4f_mt *mt)
+{
+  return mt->contentsize == 0 || mt->contentsize == mt->total;
+}
+
+static void
+lz4f_mt_size_error(MRB)
+{
+  mrb_raise(mrb, E_RUNTIME_ERROR,
+            "wrong content size (the size given by prefs and the input size are different)");
+}
+
+/*
+ * フレームの終端 (最大 8 バイト) を書き込む。
+ */
+static size_t
+lz4f_mt_end(MRB, struct lz4f_mt *mt, char *dest)
+{
+  if (!lz4f_mt_size_p(mt)) {
+    lz4f_mt_size_error(mrb);
+  }
+
+  aux_store_u32le(dest, 0);
+
+  if (mt->contentchecksum) {
+    aux_store_u32le(dest + 4, XXH32_digest(&mt->xxh));
+    return 8;
+  } else {
+    return 4;
+  }
+}
+
+static void
+enc_s_encode_args(MRB, mrb_value *src, mrb_value *dest, struct encode_opts *opts)
+{
+  mrb_int argc;
+  mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  mrb_int argc0 = argc;
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    aux_lz4f_encode_args(mrb, argv[argc - 1], opts);
+    argc--;
+  } else {
+    aux_lz4f_encode_opts_default(opts);
+  }
+  LZ4F_preferences_t *prefs = &opts->prefs;
+
+  size_t maxsize;
+  switch (argc) {
+  case 1:
+    *src = argv[0];
+    maxsize = -1;
+    *dest = Qnil;
+    break;
+  case 2:
+    *src = argv[0];
+    if (mrb_string_p(argv[1])) {
+      *dest = argv[1];
+      maxsize = -1;
+    } else {
+      *dest = Qnil;
+      maxsize = (NIL_P(argv[1]) ? -1 : aux_to_u64(mrb, argv[1]));
+    }
+    break;
+  case 3:
+    *src = argv[0];
+    maxsize = (NIL_P(argv[1]) ? -1 : aux_to_u64(mrb, argv[1]));
+    *dest = argv[2];
+    break;
+  default:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong number of arguments (given %S, expect 1..3 + keywords)",
+               mrb_fixnum_value(argc0));
+  }
+
+  mrb_check_type(mrb, *src, MRB_TT_STRING);
+
+  if (opts->autosize) {
+    /* NOTE: 一括処理であれば入力長が分かっているため、伸長側が事前に確保できるように記録する */
+    prefs->frameInfo.contentSize = RSTRING_LEN(*src);
+  }
+
+  if (maxsize == -1) {
+    maxsize = LZ4F_compressFrameBound(RSTRING_LEN(*src), prefs);
+  }
+
+  maxsize = MIN(maxsize, AUX_STR_MAX);
+
+  if (NIL_P(*dest)) {
+    *dest = aux_str_buf_new(mrb, maxsize);
+  } else {
+    mrb_check_type(mrb, *dest, MRB_TT_STRING);
+    mrbx_str_reserve(mrb, mrbx_str_ptr(mrb, *dest), maxsize);
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, *dest), 0);
+  }
+}
+
+static mrb_value
+enc_s_encode_mt(MRB, mrb_value src, mrb_value dest, struct encode_opts *opts)
+{
+  if (opts->prefs.frameInfo.contentSize != 0) {
+    /* LZ4F_compressFrame() と同様に、実際の入力長で置き換える */
+    opts->prefs.frameInfo.contentSize = RSTRING_LEN(src);
+  }
+
+  LZ4F_cctx *cctx = opts->context;
+  if (!cctx) {
+    LZ4F_errorCode_t err = LZ4F_createCompressionContext(&cctx, LZ4F_getVersion());
+    aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
+  }
+  char *destp = RSTRING_PTR(dest);
+  size_t destcapa = RSTRING_CAPA(dest);
+  size_t off = LZ4F_compressBegin(cctx, destp, destcapa, &opts->prefs);
+  if (cctx != opts->context) { LZ4F_freeCompressionContext(cctx); }
+  aux_lz4f_check_error(mrb, off, "LZ4F_compressBegin");
+
+  struct lz4f_mt *mt = lz4f_mt_new(mrb, &opts->prefs, opts->threads, FALSE);
+  mt->probe = opts->probe;
+  mt->stats = aux_scratch_probe_stats(mrb);
+  const char *srcp = RSTRING_PTR(src);
+  size_t srclen = RSTRING_LEN(src);
+  mrb_bool overflow = FALSE;
+
+  while (srclen > 0) {
+    size_t n = lz4f_mt_compress(mt, srcp, srclen);
+    if (lz4f_mt_output_size(mt) > destcapa - off) {
+      overflow = TRUE;
+      break;
+    }
+    off += lz4f_mt_output(mt, destp + off);
+    srcp += n;
+    srclen -= n;
+  }
+
+  if (overflow || destcapa - off < 8) {
+    mrb_free(mrb, mt);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "dest buffer is too small");
+  }
+
+  /* NOTE: lz4f_mt_end() の中で例外を起こすと mt を解放できないため、先に検査する */
+  if (!lz4f_mt_size_p(mt)) {
+    mrb_free(mrb, mt);
+    lz4f_mt_size_error(mrb);
+  }
+
+  off += lz4f_mt_end(mrb, mt, destp + off);
+  mrb_free(mrb, mt);
+  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, dest), off);
+
+  return dest;
+}
+
+/*
+ * call-seq:
+ *  encode(src, maxsize = nil, destbuf = "", prefs = {})
+ *  encode(src, destbuf, prefs = {})
+ */
+static mrb_value
+enc_s_encode(MRB, mrb_value self)
+{
+  mrb_value src, dest;
+  struct encode_opts opts;
+  enc_s_encode_args(mrb, &src, &dest, &opts);
+
+  if (opts.threads > 0) {
+    return enc_s_encode_mt(mrb, src, dest, &opts);
+  }
+
+  size_t s;
+  if (opts.context) {
+    /* NOTE: LZ4F_compressFrame() と違い、コンテキストの確保と初期化を省ける */
+    s = LZ4F_compressFrame_usingCDict(opts.context,
+                                      RSTRING_PTR(dest), RSTRING_CAPA(dest),
+                                      RSTRING_PTR(src), RSTRING_LEN(src),
+                                      opts.cdict, &opts.prefs);
+  } else if (opts.cdict) {
+    LZ4F_cctx *cctx;
+    LZ4F_errorCode_t err = LZ4F_createCompressionContext(&cctx, LZ4F_getVersion());
+    aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
+    s = LZ4F_compressFrame_usingCDict(cctx,
+                                      RSTRING_PTR(dest), RSTRING_CAPA(dest),
+                                      RSTRING_PTR(src), RSTRING_LEN(src),
+                                      opts.cdict, &opts.prefs);
+    LZ4F_freeCompressionContext(cctx);
+  } else {
+    s = LZ4F_compressFrame(RSTRING_PTR(dest), RSTRING_CAPA(dest),
+                           RSTRING_PTR(src), RSTRING_LEN(src),
+                           &opts.prefs);
+  }
+  aux_lz4f_check_error(mrb, s, "LZ4F_compressFrame");
+  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, dest), s);
+  return dest;
+}
+
+/*
+ * 単調増加する時計 (マイクロ秒)。待ち時間や処理速度を測るためだけに使う。
+ */
+static uint64_t
+aux_clock_us(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#elif defined(_WIN32)
+  /* NOTE: Windows の clock() は CPU 時間ではなく経過時間を返す */
+  return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#else
+  return (uint64_t)time(NULL) * 1000000;
+#endif
+}
+
+/*
+ * 単調増加する時計 (ミリ秒)。フラッシュまでの待ち時間を測るためだけに使う。
+ */
+static uint64_t
+aux_clock_ms(void)
+{
+  return aux_clock_us() / 1000;
+}
+
+struct encoder
+{
+  LZ4F_cctx *lz4f;
+  LZ4F_preferences_t prefs;
+  mrb_value io;
+  int fd; /* io が IO であれば、そのファイル記述子。そうでなければ -1 */
+  mrb_bool direct; /* io が String であり、outbuf として直接書き込む */
+  mrb_value outbuf; /* 出力先へ渡していない圧縮済みデータ */
+  size_t outbufsize;
+  struct lz4f_mt *mt;
+  struct aux_fd_iovec *iov; /* fd へ複数スレッドの出力を書き込むための作業領域 (mt->nslots + 1 個) */
+  size_t flushsize;
+  uint32_t flushinterval;
+  mrb_bool pending; /* 最後のフラッシュ以降に書き込みがあった */
+  uint64_t pendingsince;
+  mrb_bool nonblock; /* 出力先が受け付けない分を outbuf に残して戻る (*_nonblock の呼び出し中) */
+  mrb_bool stalled; /* 出力先が受け付けなかったデータが outbuf に残っている */
+  mrb_bool ended; /* フレームを閉じた */
+  uint32_t framesize; /* LZ4::SeekableEncoder で一つのフレームに収める入力の長さ。0 であればフレームを区切らない */
+  uint32_t framein; /* 現在のフレームへ書き込んだ入力の長さ */
+  uint64_t frameout; /* 現在のフレームの圧縮済みデータの長さ */
+  uint32_t *seektable; /* 閉じたフレームごとの圧縮後と圧縮前の長さ */
+  size_t nframes;
+  size_t seekcapa;
+  mrb_bool finished; /* シークテーブルを書き込んだ */
+  struct aux_probe_stats probestats;
+};
+
+static void
+encoder_free(MRB, struct encoder *p)
+{
+  if (p->lz4f) {
+    LZ4F_freeCompressionContext(p->lz4f);
+  }
+
+  mrb_free(mrb, p->mt);
+  mrb_free(mrb, p->iov);
+  mrb_free(mrb, p->seektable);
+
+  mrb_free(mrb, p);
+}
+
+static const mrb_data_type encoder_type = {
+  .struct_name = "mruby-lz4.encoder",
+  .dfree = (void (*)(mrb_state *, void *))encoder_free,
+};
+
+static struct encoder *
+getencoder(MRB, mrb_value self)
+{
+  struct encoder *p;
+  Data_Get_Struct(mrb, self, &encoder_type, p);
+  return p;
+}
+
+static mrb_value
+encoder_set_outbuf(MRB, mrb_value obj, struct encoder *p, mrb_value buf)
+{
+  p->outbuf = buf;
+  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-lz4.outbuf"), buf);
+  return buf;
+}
+
+static mrb_value
+encoder_set_outport(MRB, mrb_value self, struct encoder *p, mrb_value port)
+{
+  if (p->direct) {
+    /* NOTE: 以前の出力先の文字列を一時バッファとして上書きしないように手放す */
+    encoder_set_outbuf(mrb, self, p, Qnil);
+  } else if (!NIL_P(p->outbuf) && !MRB_FROZEN_P(RSTRING(p->outbuf))) {
+    /* NOTE: 閉じずに放棄したフレームの溜め込んだ出力は捨てる */
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), 0);
+  }
+
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.outport"), port);
+  p->io = port;
+  p->stalled = FALSE;
+
+  /* NOTE: String#<< を呼ぶ代わりに、出力先の文字列の末尾へ直接圧縮する */
+  p->direct = mrb_string_p(port) && mrb_obj_class(mrb, port) == mrb->string_class;
+  if (p->direct) {
+    p->fd = -1;
+    encoder_set_outbuf(mrb, self, p, port);
+  } else {
+    p->fd = aux_io_fileno(mrb, port, FALSE);
+  }
+
+  return port;
+}
+
+/*
+ * outbuf の先頭から size バイトを取り除く。
+ */
+static void
+encoder_consume(MRB, mrb_value self, struct encoder *p, size_t size)
+{
+  size_t rest = RSTRING_LEN(p->outbuf) - size;
+
+  if (MRB_FROZEN_P(RSTRING(p->outbuf))) {
+    /* NOTE: 出力先に凍結されたので、残りを別の文字列へ移す */
+    encoder_set_outbuf(mrb, self, p, mrb_str_new(mrb, RSTRING_PTR(p->outbuf) + size, rest));
+  } else {
+    if (size > 0 && rest > 0) {
+      memmove(RSTRING_PTR(p->outbuf), RSTRING_PTR(p->outbuf) + size, rest);
+    }
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), rest);
+  }
+}
+
+/*
+ * 出力先が受け付ける分だけを渡し、残りは outbuf に留める。
+ *
+ * 全てを渡せば TRUE を返す。
+ */
+static mrb_bool
+encoder_emit_nonblock(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->fd >= 0) {
+    size_t written;
+    int err = aux_fd_write_nonblock(p->fd, RSTRING_PTR(p->outbuf), RSTRING_LEN(p->outbuf), &written);
+    encoder_consume(mrb, self, p, (err == 0 ? written : RSTRING_LEN(p->outbuf)));
+    if (err != 0) { aux_sys_fail(mrb, err, "write"); }
+  } else {
+    int arena = mrb_gc_arena_save(mrb);
+
+    while (RSTRING_LEN(p->outbuf) > 0) {
+      mrb_gc_arena_restore(mrb, arena);
+
+      /* NOTE: exception: false を渡すため、mrblib で定義したメソッドを介する */
+      mrb_value n = FUNCALL(mrb, self, mrb_intern_lit(mrb, "emit_nonblock"), p->outbuf);
+      if (mrb_symbol_p(n)) { break; }
+      mrb_int written = mrb_int(mrb, n);
+      if (written < 1) { break; }
+      encoder_consume(mrb, self, p, MIN((size_t)written, (size_t)RSTRING_LEN(p->outbuf)));
+    }
+  }
+
+  p->stalled = (RSTRING_LEN(p->outbuf) > 0);
+
+  return !p->stalled;
+}
+
+/*
+ * 溜め込んだ圧縮済みデータを出力先へ渡す。
+ *
+ * *_nonblock の呼び出し中に出力先が全てを受け付けなかった場合に限って FALSE を返す。
+ */
+static mrb_bool
+encoder_emit(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->direct || NIL_P(p->outbuf) || RSTRING_LEN(p->outbuf) == 0) {
+    p->stalled = FALSE;
+    return TRUE;
+  }
+
+  if (p->nonblock) {
+    return encoder_emit_nonblock(mrb, self, p);
+  }
+
+  p->stalled = FALSE;
+
+  if (p->fd >= 0) {
+    int err = aux_fd_write(p->fd, RSTRING_PTR(p->outbuf), RSTRING_LEN(p->outbuf));
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), 0);
+    if (err != 0) { aux_sys_fail(mrb, err, "write"); }
+    return TRUE;
+  }
+
+  FUNCALL(mrb, p->io, mrb_intern_lit(mrb, "<<"), p->outbuf);
+
+  if (MRB_FROZEN_P(RSTRING(p->outbuf))) {
+    /* NOTE: 出力先に凍結されたので、次からは別の文字列を使う */
+    encoder_set_outbuf(mrb, self, p, Qnil);
+  } else {
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), 0);
+  }
+
+  return TRUE;
+}
+
+/*
+ * outbuf の末尾に size バイトの空きを確保し、その位置を返す。
+ *
+ * 溜め込んだデータと合わせて文字列の最大長を超える場合は、先に出力先へ渡す。
+ */
+static char *
+encoder_reserve(MRB, mrb_value self, struct encoder *p, size_t size)
+{
+  if (p->direct) {
+    struct RString *str = RSTRING(p->outbuf);
+    mrb_str_modify(mrb, str);
+    size_t off = RSTR_LEN(str);
+    if (size > AUX_STR_MAX - off) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "output string too large");
+    }
+
+    if (off + size > (size_t)RSTR_CAPA(str)) {
+      /* NOTE: 書き込みのたびに拡張しないように、幾何級数的に確保する */
+      size_t capa = RSTR_CAPA(str);
+      size_t grow = (capa < AUX_STR_MAX - capa / 2 ? capa + capa / 2 : AUX_STR_MAX);
+      mrbx_str_reserve(mrb, str, MAX(off + size, grow));
+    }
+
+    return RSTR_PTR(str) + off;
+  }
+
+  size_t off = (NIL_P(p->outbuf) ? 0 : (size_t)RSTRING_LEN(p->outbuf));
+  if (off > 0 && size > AUX_STR_MAX - off) {
+    if (!encoder_emit(mrb, self, p)) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "too much pending output");
+    }
+    off = 0;
+  }
+
+  encoder_set_outbuf(mrb, self, p, aux_str_alloc(mrb, p->outbuf, off + size));
+  return RSTRING_PTR(p->outbuf) + off;
+}
+
+static void
+encoder_advance(MRB, struct encoder *p, size_t size)
+{
+  struct RString *str = mrbx_str_ptr(mrb, p->outbuf);
+  mrbx_str_set_len(mrb, str, RSTR_LEN(str) + size);
+  p->frameout += size;
+}
+
+/*
+ * flush_size に達していれば出力先へ渡す。
+ */
+static void
+encoder_emit_if(MRB, mrb_value self, struct encoder *p)
+{
+  if (!NIL_P(p->outbuf) && (size_t)RSTRING_LEN(p->outbuf) >= MAX(p->flushsize, 1)) {
+    encoder_emit(mrb, self, p);
+
+    if (p->prefs.autoFlush && !p->mt) {
+      /* NOTE: LZ4F 側には何も残っていない */
+      p->pending = FALSE;
+    }
+  }
+}
+
+/*
+ * call-seq:
+ *  new(outport, prefs = {})
+ */
+static mrb_value
+enc_s_new(MRB, mrb_value self)
+{
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &encoder_type);
+  struct encoder *p = (struct encoder *)mrb_calloc(mrb, 1, sizeof(struct encoder));
+  rd->data = p;
+  LZ4F_errorCode_t err = LZ4F_createCompressionContext(&p->lz4f, LZ4F_getVersion());
+  aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
+  p->io = Qnil;
+  p->fd = -1;
+  p->outbuf = Qnil;
+  p->outbufsize = MIN(256 << 10, AUX_STR_MAX); /* AUX_STR_MAX or 256 KiB */
+
+  mrb_value obj = mrb_obj_value(rd);
+  mrb_int argc;
+  mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  mrb_funcall_argv(mrb, obj, id_initialize, argc, argv);
+
+  return obj;
+}
+
+static void
+enc_initialize_args(MRB, mrb_value *outport, struct encode_opts *opts)
+{
+  mrb_int argc;
+  mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    aux_lz4f_encode_args(mrb, argv[argc - 1], opts);
+    argc--;
+  } else {
+    aux_lz4f_encode_opts_default(opts);
+  }
+
+  if (argc == 1) {
+    *outport = argv[0];
+    return;
+  } else {
+    mrb_raisef(mrb,
+               E_ARGUMENT_ERROR,
+               "wrong number of arguments (given %S, expect 1 with keywords)",
+               mrb_fixnum_value(argc));
+  }
+}
+
+/*
+ * stableSrc で圧縮した入力文字列を、LZ4F が辞書として参照しなくなるまで GC から守る。
+ *
+ * LZ4F は直前に圧縮したブロックを辞書とするため、ブロックを圧縮した (出力があった) 後であれば、
+ * それより前の入力は不要となる。src が nil であれば、保持していた入力を手放すことを意味する。
+ */
+static void
+encoder_pin_source(MRB, mrb_value self, mrb_value src, mrb_bool compressed)
+{
+  mrb_sym id = mrb_intern_lit(mrb, "mruby-lz4.stable_src");
+
+  if (compressed) {
+    mrb_iv_set(mrb, self, id, src);
+  } else if (!NIL_P(src)) {
+    /* NOTE: ブロックを圧縮していなければ、辞書は以前の入力に残っている */
+    mrb_value pinned = mrb_iv_get(mrb, self, id);
+    if (NIL_P(pinned)) {
+      mrb_iv_set(mrb, self, id, src);
+    } else if (mrb_array_p(pinned)) {
+      mrb_ary_push(mrb, pinned, src);
+    } else {
+      mrb_iv_set(mrb, self, id, mrb_assoc_new(mrb, pinned, src));
+    }
+  }
+}
+
+/*
+ * フレームヘッダを書き込む。
+ */
+static void
+encoder_begin_frame(MRB, mrb_value self, struct encoder *p, const LZ4F_CDict *cdict)
+{
+  p->ended = FALSE;
+  p->framein = 0;
+  p->frameout = 0;
+
+  size_t headsize = (p->direct ? LZ4F_HEADER_SIZE_MAX : p->outbufsize);
+  char *dest = encoder_reserve(mrb, self, p, headsize);
+  size_t s = LZ4F_compressBegin_usingCDict(p->lz4f, dest, headsize, cdict, &p->prefs);
+  aux_lz4f_check_error(mrb, s, "LZ4F_compressBegin");
+  encoder_advance(mrb, p, s);
+
+  /* NOTE: fd へはフレームヘッダを最初のブロックと一緒に書き込む */
+  if (p->fd < 0) {
+    encoder_emit_if(mrb, self, p);
+  }
+}
+
+/*
+ * 既存の圧縮コンテキストと出力バッファを使って、新しいフレームを開始する。
+ */
+static void
+encoder_begin(MRB, mrb_value self, struct encoder *p, mrb_value port, const struct encode_opts *opts)
+{
+  encoder_set_outport(mrb, self, p, port);
+  p->prefs = opts->prefs;
+  p->flushsize = opts->flushsize;
+  p->flushinterval = opts->flushinterval;
+  p->pending = FALSE;
+  p->framesize = opts->framesize;
+  p->nframes = 0;
+  p->finished = FALSE;
+
+  if (p->mt && opts->threads > 0 && lz4f_mt_reusable_p(p->mt, &p->prefs, opts->threads)) {
+    lz4f_mt_reset(p->mt, p->prefs.frameInfo.contentSize);
+  } else {
+    mrb_free(mrb, p->mt);
+    p->mt = NULL;
+    mrb_free(mrb, p->iov);
+    p->iov = NULL;
+    if (opts->threads > 0) {
+      p->mt = lz4f_mt_new(mrb, &p->prefs, opts->threads, TRUE);
+    }
+  }
+
+  if (p->mt) {
+    p->mt->probe = opts->probe;
+    p->mt->stats = &p->probestats;
+  }
+
+  /* NOTE: フレームを閉じるまで辞書が解放されないように保持する */
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.dictionary"), opts->dictionary);
+  encoder_pin_source(mrb, self, Qnil, TRUE);
+
+  encoder_begin_frame(mrb, self, p, opts->cdict);
+}
+
+static mrb_value
+enc_initialize(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+  mrb_value port;
+  struct encode_opts opts;
+  enc_initialize_args(mrb, &port, &opts);
+  encoder_begin(mrb, self, p, port, &opts);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *  reset(outport = nil, prefs = nil) -> self
+ *
+ * Start a new frame, reusing the compression context and the buffers.
+ *
+ * If outport is nil, keep the current port.
+ * If prefs is not given, keep the current preferences.
+ *
+ * The current frame is abandoned without closing.
+ * Call close before reset to finish it.
+ */
+static mrb_value
+enc_reset(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+  mrb_int argc;
+  mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+
+  struct encode_opts opts;
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    if (p->framesize > 0) {
+      aux_seekable_encode_args(mrb, argv[argc - 1], &opts);
+    } else {
+      aux_lz4f_encode_args(mrb, argv[argc - 1], &opts);
+    }
+    argc--;
+  } else {
+    aux_lz4f_encode_opts_default(&opts);
+    opts.prefs = p->prefs;
+    opts.threads = (p->mt ? p->mt->threads : 0);
+    opts.probe = (p->mt ? p->mt->probe : FALSE);
+    opts.flushsize = p->flushsize;
+    opts.flushinterval = p->flushinterval;
+    opts.framesize = p->framesize;
+    opts.dictionary = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.dictionary"));
+    if (!NIL_P(opts.dictionary)) {
+      opts.cdict = get_dictionary(mrb, opts.dictionary)->cdict;
+    }
+  }
+
+  if (argc > 1) {
+    mrb_raisef(mrb,
+               E_ARGUMENT_ERROR,
+               "wrong number of arguments (given %S, expect 0..1 with keywords)",
+               mrb_fixnum_value(argc));
+  }
+
+  mrb_value port = (argc > 0 && !NIL_P(argv[0]) ? argv[0] : p->io);
+  encoder_begin(mrb, self, p, port, &opts);
+
+  return self;
+}
+
+static void
+encoder_emit_mt(MRB, mrb_value self, struct encoder *p)
+{
+  size_t size = lz4f_mt_output_size(p->mt);
+  size_t pending = (NIL_P(p->outbuf) ? 0 : RSTRING_LEN(p->outbuf));
+
+  if (p->fd >= 0 && !p->nonblock && pending + size >= p->flushsize) {
+    /* NOTE: 溜め込んだ出力 (フレームヘッダなど) と各ブロックの出力を複写せずにまとめて書き込む */
+    if (!p->iov) {
+      p->iov = (struct aux_fd_iovec *)mrb_calloc(mrb, p->mt->nslots + 1, sizeof(struct aux_fd_iovec));
+    }
+
+    p->iov[0].ptr = (pending > 0 ? RSTRING_PTR(p->outbuf) : NULL);
+    p->iov[0].size = pending;
+    int n = lz4f_mt_output_iov(p->mt, p->iov + 1);
+    p->frameout += size;
+    int err = aux_fd_writev(p->fd, p->iov, n + 1);
+    if (pending > 0) { mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), 0); }
+    if (err != 0) { aux_sys_fail(mrb, err, "writev"); }
+    return;
+  }
+
+  lz4f_mt_output(p->mt, encoder_reserve(mrb, self, p, size));
+  encoder_advance(mrb, p, size);
+  encoder_emit_if(mrb, self, p);
+}
+
+static void
+encoder_flush_mt(MRB, mrb_value self, struct encoder *p)
+{
+  struct lz4f_mt *mt = p->mt;
+
+  if (mt->inbuflen > 0) {
+    lz4f_mt_compress(mt, mt->inbuf, mt->inbuflen);
+    mt->inbuflen = 0;
+    encoder_emit_mt(mrb, self, p);
+  }
+}
+
+static void
+enc_write_mt(MRB, mrb_value self, struct encoder *p, const char *src, size_t srclen)
+{
+  struct lz4f_mt *mt = p->mt;
+  size_t batchsize = mt->blocksize * mt->nslots;
+
+  while (srclen > 0) {
+    if (mt->inbuflen == 0 && srclen >= batchsize) {
+      /* NOTE: 溜め込む必要がないため、直接圧縮する */
+      size_t n = lz4f_mt_compress(mt, src, srclen);
+      src += n;
+      srclen -= n;
+      encoder_emit_mt(mrb, self, p);
+    } else {
+      size_t n = MIN(srclen, batchsize - mt->inbuflen);
+      memcpy(mt->inbuf + mt->inbuflen, src, n);
+      mt->inbuflen += n;
+      src += n;
+      srclen -= n;
+
+      if (mt->inbuflen >= batchsize) {
+        encoder_flush_mt(mrb, self, p);
+      }
+    }
+  }
+}
+
+/*
+ * 溜め込んだ入力を圧縮し、全てを出力先へ渡す。
+ */
+static mrb_bool
+encoder_flush(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->mt) {
+    encoder_flush_mt(mrb, self, p);
+  } else {
+    const LZ4F_compressOptions_t opts = { .stableSrc = 0, };
+    size_t outsize = LZ4F_compressBound(0, &p->prefs);
+    char *dest = encoder_reserve(mrb, self, p, outsize);
+    size_t s = LZ4F_flush(p->lz4f, dest, outsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_flush");
+    encoder_advance(mrb, p, s);
+    if (s > 0) { encoder_pin_source(mrb, self, Qnil, TRUE); }
+  }
+
+  p->pending = FALSE;
+  return encoder_emit(mrb, self, p);
+}
+
+/*
+ * call-seq:
+ *  write(src, stable: false) -> self
+ *
+ * The compressed data is passed to the output port when it reaches
+ * flush_size, or when flush_interval milliseconds have passed since the
+ * first unflushed write (checked on each write).
+ *
+ * If src is frozen or stable: true is given, linked blocks are compressed
+ * directly from src without copying the history (the last 64 KiB).
+ * The encoder keeps src referenced while it is needed.
+ * With stable: true, the caller must not modify src until the frame is closed.
+ */
+static mrb_value
+enc_write_args(MRB, mrb_value *srcv)
+{
+  mrb_value opts = Qnil;
+  mrb_get_args(mrb, "S|H", srcv, &opts);
+
+  mrb_value stable = Qnil;
+  if (!NIL_P(opts)) {
+    MRBX_SCANHASH(mrb, opts, Qnil,
+                  MRBX_SCANHASH_ARGS("stable", &stable, Qnil));
+  }
+
+  return stable;
+}
+
+/*
+ * フレームの終端を outbuf へ書き込む。二度目以降の呼び出しは何もしない。
+ */
+static void
+encoder_end(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->ended) {
+    return;
+  }
+
+  if (p->mt) {
+    encoder_flush_mt(mrb, self, p);
+    size_t s = lz4f_mt_end(mrb, p->mt, encoder_reserve(mrb, self, p, 8));
+    encoder_advance(mrb, p, s);
+  } else {
+    const LZ4F_compressOptions_t opts = { .stableSrc = 0, };
+    size_t outsize = LZ4F_compressBound(0, &p->prefs);
+    char *dest = encoder_reserve(mrb, self, p, outsize);
+    size_t s = LZ4F_compressEnd(p->lz4f, dest, outsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_compressEnd");
+    encoder_advance(mrb, p, s);
+    encoder_pin_source(mrb, self, Qnil, TRUE);
+  }
+
+  p->ended = TRUE;
+  p->pending = FALSE;
+
+  if (p->framesize > 0) {
+    if (p->nframes >= p->seekcapa) {
+      p->seekcapa = (p->seekcapa < 64 ? 64 : p->seekcapa * 2);
+      p->seektable = (uint32_t *)mrb_realloc(mrb, p->seektable, sizeof(uint32_t) * 2 * p->seekcapa);
+    }
+
+    p->seektable[p->nframes * 2 + 0] = (uint32_t)p->frameout;
+    p->seektable[p->nframes * 2 + 1] = p->framein;
+    p->nframes++;
+  }
+}
+
+/*
+ * LZ4::SeekableEncoder で、閉じたフレームに続く新しいフレームを開始する。
+ */
+static void
+encoder_restart_frame(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->finished) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "seek table is already written (call reset)");
+  }
+
+  if (p->mt) {
+    lz4f_mt_reset(p->mt, p->prefs.frameInfo.contentSize);
+  }
+
+  mrb_value dict = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.dictionary"));
+  encoder_begin_frame(mrb, self, p, (NIL_P(dict) ? NULL : get_dictionary(mrb, dict)->cdict));
+}
+
+/*
+ * src から srclen バイトを現在のフレームへ圧縮する。src は srcv の中を指す。
+ */
+static void
+encoder_write_frame(MRB, mrb_value self, struct encoder *p, mrb_value srcv, const char *src, size_t srclen, mrb_value stable)
+{
+  if (p->mt) {
+    enc_write_mt(mrb, self, p, src, srclen);
+  } else if (srclen > 0) {
+    /* NOTE: 独立ブロックであれば辞書を保存しないため、stableSrc の意味がない */
+    mrb_bool stablesrc = p->prefs.frameInfo.blockMode == LZ4F_blockLinked &&
+                         (MRB_FROZEN_P(RSTRING(srcv)) || mrb_test(stable));
+    const LZ4F_compressOptions_t copts = { .stableSrc = (stablesrc ? 1 : 0), };
+    size_t total = 0;
+
+    /* NOTE: 例外で抜けても守られるように、圧縮する前に保持する */
+    if (stablesrc) { encoder_pin_source(mrb, self, srcv, FALSE); }
+
+    while (srclen > 0) {
+      size_t insize = MIN(srclen, 4 * 1024 * 1024);
+      size_t outsize = LZ4F_compressBound(insize, &p->prefs);
+      char *dest = encoder_reserve(mrb, self, p, outsize);
+      size_t s = LZ4F_compressUpdate(p->lz4f, dest, outsize, src, insize, &copts);
+      aux_lz4f_check_error(mrb, s, "LZ4F_compressUpdate");
+      total += s;
+      encoder_advance(mrb, p, s);
+      encoder_emit_if(mrb, self, p);
+      src += insize;
+      srclen -= insize;
+    }
+
+    if (total > 0) {
+      encoder_pin_source(mrb, self, (stablesrc ? srcv : Qnil), TRUE);
+    }
+  }
+}
+
+static void
+encoder_write(MRB, mrb_value self, struct encoder *p, mrb_value srcv, mrb_value stable)
+{
+  const char *src = RSTRING_PTR(srcv);
+  size_t srclen = RSTRING_LEN(srcv);
+
+  if (srclen > 0 && p->flushinterval > 0 && !p->pending) {
+    p->pending = TRUE;
+    p->pendingsince = aux_clock_ms();
+  }
+
+  if (p->framesize == 0) {
+    encoder_write_frame(mrb, self, p, srcv, src, srclen, stable);
+  } else {
+    /* NOTE: frame_size ごとにフレームを閉じる。次のフレームは続きを書き込む時に開始する */
+    while (srclen > 0) {
+      if (p->ended) { encoder_restart_frame(mrb, self, p); }
+
+      size_t n = MIN(srclen, p->framesize - p->framein);
+      encoder_write_frame(mrb, self, p, srcv, src, n, stable);
+      p->framein += n;
+      src += n;
+      srclen -= n;
+
+      if (p->framein >= p->framesize) {
+        encoder_end(mrb, self, p);
+        encoder_emit_if(mrb, self, p);
+      }
+    }
+  }
+
+  if (p->pending && aux_clock_ms() - p->pendingsince >= p->flushinterval) {
+    encoder_flush(mrb, self, p);
+  }
+}
+
+static mrb_value
+enc_write(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+  mrb_value srcv;
+  mrb_value stable = enc_write_args(mrb, &srcv);
+
+  p->nonblock = FALSE;
+  encoder_write(mrb, self, p, srcv, stable);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *  write_nonblock(src, stable: false) -> src.bytesize OR :wait_writable
+ *
+ * Like write, but never blocks on the output port.
+ *
+ * The output port needs +write_nonblock(string, exception: false)+, which
+ * returns the number of bytes written or +:wait_writable+
+ * (an IO of mruby-io is written through its file descriptor).
+ * The compressed data that the port did not accept is kept in the encoder
+ * and passed first by the next call of write_nonblock, flush_nonblock or
+ * close_nonblock.
+ *
+ * Returns :wait_writable without consuming src while such data remains.
+ */
+static mrb_value
+enc_write_nonblock(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+  mrb_value srcv;
+  mrb_value stable = enc_write_args(mrb, &srcv);
+  mrb_int srclen = RSTRING_LEN(srcv);
+
+  p->nonblock = TRUE;
+  if (p->stalled && !encoder_emit(mrb, self, p)) {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "wait_writable"));
+  }
+
+  encoder_write(mrb, self, p, srcv, stable);
+
+  return mrb_fixnum_value(srclen);
+}
+
+/*
+ * call-seq:
+ *  flush -> self
+ *
+ * Finish the current block and pass all pending data to the output port.
+ */
+static mrb_value
+enc_flush(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+
+  p->nonblock = FALSE;
+  encoder_flush(mrb, self, p);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *  flush_nonblock -> self OR :wait_writable
+ *
+ * Like flush, but returns :wait_writable if the output port did not accept
+ * all pending data. Call it again when the port becomes writable.
+ */
+static mrb_value
+enc_flush_nonblock(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+
+  p->nonblock = TRUE;
+  if (encoder_flush(mrb, self, p)) {
+    return self;
+  } else {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "wait_writable"));
+  }
+}
+
+/*
+ * LZ4::SeekableEncoder であれば、最後のフレームに続けてシークテーブルを書き込む。
+ */
+static void
+encoder_write_seektable(MRB, mrb_value self, struct encoder *p)
+{
+  if (p->nframes > (UINT32_MAX - AUX_SEEKABLE_FOOTER_SIZE) / AUX_SEEKABLE_ENTRY_SIZE) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "too many frames for seek table");
+  }
+
+  size_t tabsize = AUX_SEEKABLE_ENTRY_SIZE * p->nframes + AUX_SEEKABLE_FOOTER_SIZE;
+  char *dest = encoder_reserve(mrb, self, p, 8 + tabsize);
+  aux_store_u32le(dest, AUX_SEEKABLE_SKIPPABLE_MAGIC);
+  aux_store_u32le(dest + 4, (uint32_t)tabsize);
+
+  char *q = dest + 8;
+  size_t i;
+  for (i = 0; i < p->nframes; i++, q += AUX_SEEKABLE_ENTRY_SIZE) {
+    aux_store_u32le(q, p->seektable[i * 2 + 0]);
+    aux_store_u32le(q + 4, p->seektable[i * 2 + 1]);
+  }
+
+  aux_store_u32le(q, (uint32_t)p->nframes);
+  q[4] = 0; /* NOTE: 各フレームのチェックサムは記録しない */
+  aux_store_u32le(q + 5, AUX_SEEKABLE_MAGIC);
+
+  encoder_advance(mrb, p, 8 + tabsize);
+  p->finished = TRUE;
+}
+
+/*
+ * 現在のフレームを閉じる。LZ4::SeekableEncoder であればシークテーブルも書き込む。
+ */
+static void
+encoder_finish(MRB, mrb_value self, struct encoder *p)
+{
+  encoder_end(mrb, self, p);
+
+  if (p->framesize > 0 && !p->finished) {
+    encoder_write_seektable(mrb, self, p);
+  }
+}
+
+/*
+ * call-seq:
+ *  close -> self
+ */
+static mrb_value
+enc_close(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+
+  p->nonblock = FALSE;
+  encoder_finish(mrb, self, p);
+  encoder_emit(mrb, self, p);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *  close_nonblock -> self OR :wait_writable
+ *
+ * Like close, but returns :wait_writable if the output port did not accept
+ * all pending data. Call it again when the port becomes writable.
+ */
+static mrb_value
+enc_close_nonblock(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+
+  p->nonblock = TRUE;
+  encoder_finish(mrb, self, p);
+  if (encoder_emit(mrb, self, p)) {
+    return self;
+  } else {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "wait_writable"));
+  }
+}
+
+/*
+ * call-seq:
+ *  port -> outport
+ */
+static mrb_value
+enc_get_port(MRB, mrb_value self)
+{
+  return getencoder(mrb, self)->io;
+}
+
+/*
+ * call-seq:
+ *  probe_stats -> hash
+ *
+ * Statistics of probe: true since the encoder was created.
+ * See LZ4.probe_stats for the keys.
+ */
+static mrb_value
+enc_get_probe_stats(MRB, mrb_value self)
+{
+  return aux_probe_stats_value(mrb, &getencoder(mrb, self)->probestats);
+}
+
+/*
+ * call-seq:
+ *  new(outport, prefs = {})
+ *
+ * Compress the input into independent frames and write a seek table at close.
+ * The output can be read by LZ4::SeekableDecoder at random positions,
+ * and also by LZ4.decode as the concatenated frames.
+ *
+ * [prefs (hash)]
+ *
+ *  frame_size (integer)::
+ *
+ *      uncompressed length of each frame (default 1 MiB).
+ *      A random access decompresses whole frames that covers the range.
+ *
+ *  Other keys are same as LZ4::Encoder.new, except for size.
+ */
+static mrb_value
+senc_initialize(MRB, mrb_value self)
+{
+  struct encoder *p = getencoder(mrb, self);
+  mrb_value port, prefs = Qnil;
+  struct encode_opts opts;
+  mrb_get_args(mrb, "o|H", &port, &prefs);
+  aux_seekable_encode_args(mrb, prefs, &opts);
+  encoder_begin(mrb, self, p, port, &opts);
+
+  return self;
+}
+
+static void
+init_encoder(MRB, struct RClass *mLZ4)
+{
+  struct RClass *cEncoder = mrb_define_class_under(mrb, mLZ4, "Encoder", mrb_cObject);
+  mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cEncoder, "write", enc_write, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cEncoder, "write_nonblock", enc_write_nonblock, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cEncoder, "flush_nonblock", enc_flush_nonblock, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cEncoder, "close", enc_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cEncoder, "close_nonblock", enc_close_nonblock, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cEncoder, "reset", enc_reset, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cEncoder, "port", enc_get_port, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cEncoder, "probe_stats", enc_get_probe_stats, MRB_ARGS_NONE());
+
+  mrb_define_alias(mrb, cEncoder, "<<", "write");
+  mrb_define_alias(mrb, cEncoder, "finish", "close");
+
+  struct RClass *cContext = mrb_define_class_under(mrb, cEncoder, "Context", mrb_cObject);
+  MRB_SET_INSTANCE_TT(cContext, MRB_TT_DATA);
+  mrb_define_class_method(mrb, cContext, "new", enc_context_s_new, MRB_ARGS_NONE());
+
+  struct RClass *cSeekableEncoder = mrb_define_class_under(mrb, mLZ4, "SeekableEncoder", cEncoder);
+  mrb_define_method(mrb, cSeekableEncoder, "initialize", senc_initialize, MRB_ARGS_ARG(1, 1));
+}
+
+/*
+ * class LZ4::Decoder
+ */
+
+/*
+ * 伸長先の確保量を幾何級数的に増やす。
+ */
+static size_t
+aux_lz4_grow_size(size_t size)
+{
+  size_t grow = MAX(size / 2, AUX_LZ4_DEFAULT_PARTIAL_SIZE);
+
+  if (size >= AUX_STR_MAX - grow) {
+    return AUX_STR_MAX;
+  } else {
+    return size + grow;
+  }
+}
+
+/*
+ * フレームヘッダの contentSize から、伸長先として事前に確保する長さを求める。不明であれば 0 を返す。
+ *
+ * srclen は残りの入力長で、不明であれば SIZE_MAX を与える。
+ * LZ4 の伸長率は 255 倍を超えないため、それを大きく超える contentSize は信用せずに 0 を返す。
+ */
+static size_t
+aux_lz4f_presize(uint64_t contentsize, size_t srclen)
+{
+  if (contentsize == 0 ||
+      contentsize > AUX_STR_MAX ||
+      (srclen != SIZE_MAX && contentsize / 256 > srclen)) {
+    return 0;
+  }
+
+  return (size_t)contentsize;
+}
+
+/*
+ * class LZ4::Decoder::Context
+ *
+ * 一括処理 (LZ4::Decoder.decode) のために利用者が保持する LZ4F_dctx。
+ */
+
+static void
+dec_context_free(MRB, void *p)
+{
+  LZ4F_freeDecompressionContext((LZ4F_dctx *)p);
+}
+
+static const mrb_data_type decoder_context_type = {
+  .struct_name = "mruby-lz4.decoder.context",
+  .dfree = dec_context_free,
+};
+
+static LZ4F_dctx *
+get_decoder_context(MRB, mrb_value obj)
+{
+  LZ4F_dctx *p = (LZ4F_dctx *)mrb_data_get_ptr(mrb, obj, &decoder_context_type);
+  if (!p) { mrb_raise(mrb, E_TYPE_ERROR, "uninitialized LZ4::Decoder::Context"); }
+  return p;
+}
+
+/*
+ * call-seq:
+ *  new -> new decompression context
+ */
+static mrb_value
+dec_context_s_new(MRB, mrb_value self)
+{
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &decoder_context_type);
+  LZ4F_dctx *dctx;
+  LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+  aux_lz4f_check_error(mrb, err, "LZ4F_createDecompressionContext");
+  rd->data = dctx;
+
+  return mrb_obj_value(rd);
+}
+
+static void
+dec_s_decode_args(MRB, struct RString **src, struct RString **dest, ssize_t *maxdest, int *threads, LZ4F_dctx **context, mrb_value *dicts, mrb_bool *trusted)
+{
+  mrb_value *argv;
+  mrb_int argc;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    mrb_value athreads, acontext, atrusted;
+    MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
+                  MRBX_SCANHASH_ARGS("threads", &athreads, Qnil),
+                  MRBX_SCANHASH_ARGS("context", &acontext, Qnil),
+                  MRBX_SCANHASH_ARGS("dictionary", dicts, Qnil),
+                  MRBX_SCANHASH_ARGS("trusted", &atrusted, Qfalse));
+    *threads = aux_lz4f_threads(mrb, athreads);
+    *context = (NIL_P(acontext) ? NULL : get_decoder_context(mrb, acontext));
+    *trusted = mrb_test(atrusted);
+    *dicts = aux_lz4f_check_dicts(mrb, *dicts);
+    argc--;
+  } else {
+    *threads = 0;
+    *context = NULL;
+    *dicts = Qnil;
+    *trusted = FALSE;
+  }
+
+  switch (argc) {
+  case 1:
+    *maxdest = -1;
+    *dest = NULL;
+    break;
+  case 2:
+    if (mrb_string_p(argv[1])) {
+      *dest = RString(argv[1]);
+      *maxdest = -1;
+    } else {
+      *dest = NULL;
+      *maxdest = aux_to_sizet(mrb, argv[1]);
+    }
+    break;
+  case 3:
+    *maxdest = aux_to_sizet(mrb, argv[1]);
+    *dest = RString(argv[2]);
+    break;
+  default:
+    mrb_raisef(mrb,
+               E_ARGUMENT_ERROR,
+               "wrong number of arguments (given %S, expect 1..3 + keywords)",
+               mrb_fixnum_value(argc));
+      break;
+  }
+
+  mrb_check_type(mrb, argv[0], MRB_TT_STRING);
+  *src = RSTRING(argv[0]);
+
+  size_t size = (*maxdest < 0 ? AUX_LZ4_DEFAULT_PARTIAL_SIZE : *maxdest);
+  *dest = mrbx_str_force_recycle(mrb, *dest, size);
+}
+
+/*
+ * 一括処理の状態。
+ *
+ * contentsize, dict と dictsize は現在のフレームのもの (dict と dictsize は選ばれた辞書のデータ)。
+ */
+struct dec_s_decode
+{
+  mrb_value self;
+  struct RString *src, *dest;
+  ssize_t maxdest;
+  LZ4F_dctx *context;
+  mrb_bool owned; /* context を作業状態の置き場所から取り出した */
+  int threads;
+  mrb_bool trusted; /* チェックサムを確かめない */
+  void *work;
+  LZ4F_dctx **dctxs; /* フレームごとに並列に伸長する場合の作業者ごとのコンテキスト */
+  int ndctxs;
+  mrb_value dicts;
+  uint64_t contentsize;
+  const char *dict;
+  size_t dictsize;
+};
+
+/*
+ * srcp から始まるフレームのヘッダを読み込み、dictID から辞書を選ぶ。読み込んだ長さを返す。
+ *
+ * ヘッダを読み取れなければ (壊れている場合も含めて) 0 を返し、LZ4F_decompress() に任せる。
+ * スキップ可能フレームであれば、残りは LZ4F_decompress() が読み飛ばす。
+ */
+static size_t
+dec_s_decode_header(MRB, struct dec_s_decode *p, const char *srcp, size_t srcsize)
+{
+  LZ4F_frameInfo_t info;
+  size_t headsize = srcsize;
+  size_t s = LZ4F_getFrameInfo(p->context, &info, srcp, &headsize);
+
+  p->contentsize = 0;
+  p->dict = NULL;
+  p->dictsize = 0;
+
+  if (LZ4F_isError(s)) {
+    LZ4F_resetDecompressionContext(p->context);
+    return 0;
+  }
+
+  if (info.frameType == LZ4F_frame) {
+    p->contentsize = info.contentSize;
+    aux_lz4f_dict_data(mrb, aux_lz4f_select_dict(mrb, p->dicts, info.dictID), &p->dict, &p->dictsize);
+  }
+
+  return headsize;
+}
+
+/*
+ * 入力の終わりまで、連結された全てのフレームを伸長する。
+ */
+static void
+dec_s_decode_all(MRB, struct dec_s_decode *p)
+{
+  LZ4F_decompressOptions_t opts = { .stableDst = 0, .skipChecksums = p->trusted, };
+  LZ4F_dctx *lz4f = p->context;
+  struct RString *src = p->src;
+  struct RString *dest = p->dest;
+  size_t destoff = 0;
+  size_t maxdest = 0;
+  mrb_bool framehead = TRUE;
+
+  const char *srcp = RSTR_PTR(src);
+  size_t srcsize = RSTR_LEN(src);
+
+  for (;;) {
+    if (framehead) {
+      size_t headsize = dec_s_decode_header(mrb, p, srcp, srcsize);
+      srcp += headsize;
+      srcsize -= headsize;
+      framehead = FALSE;
+
+      /* NOTE: contentSize が記録されていれば一度で確保する */
+      size_t presize = aux_lz4f_presize(p->contentsize, srcsize);
+      if (presize > maxdest - destoff) {
+        maxdest = (presize > AUX_STR_MAX - destoff ? AUX_STR_MAX : destoff + presize);
+        dest = mrbx_str_reserve(mrb, dest, maxdest);
+      }
+    }
+
+    if (destoff >= maxdest) {
+      if (maxdest >= AUX_STR_MAX) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "decoded data is too large");
+      }
+
+      maxdest = aux_lz4_grow_size(maxdest);
+      dest = mrbx_str_reserve(mrb, dest, maxdest);
+    }
+
+    char *destp = RSTR_PTR(dest) + destoff;
+    size_t destsize = maxdest - destoff;
+
+    size_t s = LZ4F_decompress_usingDict(lz4f, destp, &destsize, srcp, &srcsize, p->dict, p->dictsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    destoff += destsize;
+    srcp += srcsize;
+    srcsize = RSTR_LEN(src) - (srcp - RSTR_PTR(src));
+
+    if (s > srcsize) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "``src'' is too small (unexpected termination)");
+    }
+
+    if (s == 0) {
+      /* NOTE: 続きがあれば、連結された次のフレーム (スキップ可能フレームを含む) として読む */
+      if (srcsize == 0) { break; }
+      framehead = TRUE;
+    }
+  }
+
+  mrbx_str_set_len(mrb, dest, destoff);
+}
+
+static void
+dec_s_decode_partial(MRB, struct dec_s_decode *p)
+{
+  LZ4F_decompressOptions_t opts = { .stableDst = 1, .skipChecksums = p->trusted, };
+
+  const char *srcp = RSTR_PTR(p->src);
+  size_t srcsize = RSTR_LEN(p->src);
+  char *destp = RSTR_PTR(p->dest);
+  size_t destoff = 0;
+
+  for (;;) {
+    size_t headsize = dec_s_decode_header(mrb, p, srcp, srcsize);
+    srcp += headsize;
+    srcsize -= headsize;
+
+    size_t destsize = p->maxdest - destoff;
+    size_t insize = srcsize;
+    size_t s = LZ4F_decompress_usingDict(p->context, destp + destoff, &destsize, srcp, &insize, p->dict, p->dictsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    destoff += destsize;
+    srcp += insize;
+    srcsize -= insize;
+
+    if (s > 0) {
+      if (destoff < (size_t)p->maxdest) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "``src'' is too small (unexpected termination)");
+      }
+      break;
+    }
+
+    if (srcsize == 0 || destoff >= (size_t)p->maxdest) { break; }
+  }
+
+  mrbx_str_set_len(mrb, p->dest, destoff);
+}
+
+/*
+ * 独立したブロック (blocklink: false) からなるフレームを複数のスレッドで伸長するための作業領域。
+ *
+ * ブロックヘッダを先に辿っておき、i 番目のブロックを dest + blocksize * i へ伸長する。
+ * 最大長に満たないブロックがあれば、最後に前へ詰める。
+ */
+struct lz4f_mt_block
+{
+  const char *src;
+  uint32_t srclen;
+  uint32_t stored;
+  int32_t destlen; /* 負の値は失敗を意味する */
+};
+
+struct lz4f_mt_decode
+{
+  struct lz4f_mt_block *blocks;
+  size_t nblocks;
+  size_t blocksize;
+  LZ4F_blockChecksum_t blockchecksum;
+  mrb_bool trusted; /* ブロックと内容のチェックサムを確かめない */
+  char *dest;
+  size_t destsize; /* 出力先の大きさ。最後のブロックの出力先はこれで制限される */
+};
+
+static uint32_t
+aux_load_u32le(const char *p)
+{
+  const uint8_t *q = (const uint8_t *)p;
+
+  return ((uint32_t)q[0] << 0) |
+         ((uint32_t)q[1] << 8) |
+         ((uint32_t)q[2] << 16) |
+         ((uint32_t)q[3] << 24);
+}
+
+/*
+ * ブロックヘッダを辿る。
+ *
+ * blocks が NULL であればブロック数を数えるだけ。
+ * 成功すればブロック数を返し、*endp に終端マークの位置を格納する。
+ * 不正なヘッダであれば -1 を返す。
+ */
+static ssize_t
+lz4f_mt_scan_blocks(const char *p, const char *term, size_t blocksize, LZ4F_blockChecksum_t blockchecksum, struct lz4f_mt_block *blocks, const char **endp)
+{
+  size_t n = 0;
+
+  for (;;) {
+    if (term - p < 4) { return -1; }
+
+    uint32_t head = aux_load_u32le(p);
+    p += 4;
+    if (head == 0) { break; }
+
+    uint32_t size = head & 0x7fffffffUL;
+    if (size > blocksize || (size_t)(term - p) < size + (blockchecksum ? 4 : 0)) { return -1; }
+
+    if (blocks) {
+      blocks[n].src = p;
+      blocks[n].srclen = size;
+      blocks[n].stored = head >> 31;
+      blocks[n].destlen = -1;
+    }
+
+    p += size + (blockchecksum ? 4 : 0);
+    n++;
+  }
+
+  *endp = p - 4;
+
+  return (ssize_t)n;
+}
+
+static void
+lz4f_mt_decode_job(void *user, int worker, size_t index)
+{
+  struct lz4f_mt_decode *mt = (struct lz4f_mt_decode *)user;
+  struct lz4f_mt_block *b = &mt->blocks[index];
+  char *dest = mt->dest + mt->blocksize * index;
+  size_t destcapa = MIN(mt->blocksize, mt->destsize - mt->blocksize * index);
+
+  (void)worker;
+
+  if (mt->blockchecksum && !mt->trusted && XXH32(b->src, b->srclen, 0) != aux_load_u32le(b->src + b->srclen)) {
+    b->destlen = -1;
+    return;
+  }
+
+  if (b->stored) {
+    if (b->srclen > destcapa) {
+      b->destlen = -1;
+      return;
+    }
+
+    memcpy(dest, b->src, b->srclen);
+    b->destlen = b->srclen;
+  } else {
+    b->destlen = LZ4_decompress_safe(b->src, dest, b->srclen, destcapa);
+  }
+}
+
+/*
+ * 伸長できない形式であれば FALSE を返す。この時 lz4f は初期状態に戻される。
+ */
+static mrb_bool
+dec_s_decode_mt(MRB, struct RString *src, struct RString *dest, LZ4F_dctx *lz4f, int threads, mrb_bool trusted, void **work)
+{
+  const char *srcp = RSTR_PTR(src);
+  const char *term = srcp + RSTR_LEN(src);
+  LZ4F_frameInfo_t info;
+  size_t headsize = RSTR_LEN(src);
+  size_t s = LZ4F_getFrameInfo(lz4f, &info, srcp, &headsize);
+  LZ4F_resetDecompressionContext(lz4f);
+
+  if (LZ4F_isError(s) ||
+      info.frameType != LZ4F_frame ||
+      info.blockMode != LZ4F_blockIndependent ||
+      info.dictID != 0) {
+    return FALSE;
+  }
+
+  struct lz4f_mt_decode mt = {
+    .blocksize = LZ4F_getBlockSize(info.blockSizeID),
+    .blockchecksum = info.blockChecksumFlag,
+    .trusted = trusted,
+  };
+  const char *endp;
+  ssize_t nblocks = lz4f_mt_scan_blocks(srcp + headsize, term, mt.blocksize, mt.blockchecksum, NULL, &endp);
+
+  /* NOTE: 連結された次のフレームが続く場合は扱わない */
+  if (LZ4F_isError(mt.blocksize) || nblocks < 0 ||
+      (size_t)(term - endp) != 4 + (info.contentChecksumFlag ? 4 : 0)) {
+    return FALSE;
+  }
+
+  uint64_t destsize;
+  if (info.contentSize != 0) {
+    /*
+     * NOTE: contentSize があれば、その大きさだけを確保する。
+     *       信用できない contentSize か、最後以外に満たされていないブロックがあれば逐次処理に任せる。
+     */
+    if (aux_lz4f_presize(info.contentSize, RSTR_LEN(src)) == 0 ||
+        (info.contentSize + mt.blocksize - 1) / mt.blocksize != (uint64_t)nblocks) {
+      return FALSE;
+    }
+
+    destsize = info.contentSize;
+  } else {
+    /* NOTE: LZ4 の伸長率は 255 倍を超えないため、入力に比べて大きすぎる確保になるのであれば逐次処理に任せる */
+    destsize = (uint64_t)nblocks * mt.blocksize;
+    if (destsize / 256 > (uint64_t)RSTR_LEN(src) || destsize > AUX_STR_MAX) {
+      return FALSE;
+    }
+  }
+
+  mt.nblocks = nblocks;
+  mt.destsize = (size_t)destsize;
+  *work = mt.blocks = (struct lz4f_mt_block *)mrb_malloc(mrb, sizeof(struct lz4f_mt_block) * MAX(nblocks, 1));
+  lz4f_mt_scan_blocks(srcp + headsize, term, mt.blocksize, mt.blockchecksum, mt.blocks, &endp);
+  dest = mrbx_str_reserve(mrb, dest, MAX(mt.destsize, 1));
+  mt.dest = RSTR_PTR(dest);
+
+  aux_parallel_run(threads, mt.nblocks, lz4f_mt_decode_job, &mt);
+
+  size_t destoff = 0, i;
+  for (i = 0; i < mt.nblocks; i++) {
+    struct lz4f_mt_block *b = &mt.blocks[i];
+
+    if (b->destlen < 0) {
+      /*
+       * NOTE: contentSize で出力先を制限した場合は、途中に満たされていないブロックがあるだけかもしれないため、
+       *       逐次処理でもう一度伸長させる (壊れていれば、そこで例外となる)。
+       */
+      if (info.contentSize != 0) { return FALSE; }
+
+      mrb_raise(mrb, E_RUNTIME_ERROR, "LZ4_decompress_safe failed (or wrong block checksum)");
+    }
+
+    if (destoff != mt.blocksize * i) {
+      memmove(mt.dest + destoff, mt.dest + mt.blocksize * i, b->destlen);
+    }
+
+    destoff += b->destlen;
+  }
+
+  if (info.contentSize != 0 && info.contentSize != destoff) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "wrong content size");
+  }
+
+  if (info.contentChecksumFlag && !trusted && XXH32(mt.dest, destoff, 0) != aux_load_u32le(endp + 4)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "wrong content checksum");
+  }
+
+  mrbx_str_set_len(mrb, dest, destoff);
+
+  return TRUE;
+}
+
+/*
+ * 連結されたフレームを、フレームごとに複数のスレッドで伸長するための作業領域。
+ *
+ * 全てのフレームに contentSize が記録されていれば、出力先での位置が事前に決まる。
+ */
+struct lz4f_mt_frame
+{
+  const char *src;
+  size_t srclen;
+  size_t destoff;
+  size_t destlen;
+  size_t status; /* 0 であれば成功、それ以外は LZ4F のエラーコードか最後の LZ4F_decompress() の戻り値 */
+};
+
+struct lz4f_mt_frames
+{
+  struct lz4f_mt_frame *frames;
+  LZ4F_dctx **dctxs;
+  char *dest;
+  mrb_bool trusted;
+};
+
+/*
+ * 連結されたフレームを辿る。スキップ可能フレームは飛ばす。
+ *
+ * frames が NULL であればフレーム数を数えるだけ。
+ * 成功すればフレーム数を返し、*destlen に伸長後の長さの合計を格納する。
+ * contentSize がないか、フレームの長さに比べて contentSize が大きすぎるか、辞書を使うフレームがある場合と、
+ * 不正な形式の場合は -1 を返す。
+ */
+static ssize_t
+lz4f_mt_scan_frames(LZ4F_dctx *lz4f, const char *p, const char *term, struct lz4f_mt_frame *frames, size_t *destlen)
+{
+  size_t n = 0;
+  uint64_t total = 0;
+
+  while (p < term) {
+    if (term - p < 8) { return -1; }
+
+    if ((aux_load_u32le(p) & 0xfffffff0UL) == LZ4F_MAGIC_SKIPPABLE_START) {
+      uint32_t size = aux_load_u32le(p + 4);
+      if ((size_t)(term - p) - 8 < size) { return -1; }
+      p += 8 + size;
+      continue;
+    }
+
+    LZ4F_frameInfo_t info;
+    size_t headsize = term - p;
+    size_t s = LZ4F_getFrameInfo(lz4f, &info, p, &headsize);
+    LZ4F_resetDecompressionContext(lz4f);
+
+    if (LZ4F_isError(s) || info.contentSize == 0 || info.dictID != 0) { return -1; }
+
+    size_t blocksize = LZ4F_getBlockSize(info.blockSizeID);
+    const char *endp;
+    if (LZ4F_isError(blocksize) ||
+        lz4f_mt_scan_blocks(p + headsize, term, blocksize, info.blockChecksumFlag, NULL, &endp) < 0 ||
+        (size_t)(term - endp) < 4 + (info.contentChecksumFlag ? 4 : 0)) {
+      return -1;
+    }
+
+    const char *next = endp + 4 + (info.contentChecksumFlag ? 4 : 0);
+
+    /* NOTE: 信用できない contentSize のフレームがあれば、逐次処理に任せる */
+    if (aux_lz4f_presize(info.contentSize, next - p) == 0 ||
+        info.contentSize > AUX_STR_MAX - total) {
+      return -1;
+    }
+
+    if (frames) {
+      frames[n].src = p;
+      frames[n].srclen = next - p;
+      frames[n].destoff = (size_t)total;
+      frames[n].destlen = (size_t)info.contentSize;
+      frames[n].status = 1;
+    }
+
+    total += info.contentSize;
+    n++;
+    p = next;
+  }
+
+  *destlen = (size_t)total;
+
+  return (ssize_t)n;
+}
+
+static void
+lz4f_mt_decode_frame_job(void *user, int worker, size_t index)
+{
+  struct lz4f_mt_frames *mt = (struct lz4f_mt_frames *)user;
+  struct lz4f_mt_frame *f = &mt->frames[index];
+  LZ4F_dctx *lz4f = mt->dctxs[worker];
+  LZ4F_decompressOptions_t opts = { .stableDst = 1, .skipChecksums = mt->trusted, };
+  const char *src = f->src;
+  size_t srclen = f->srclen;
+  char *dest = mt->dest + f->destoff;
+  size_t destlen = f->destlen;
+
+  LZ4F_resetDecompressionContext(lz4f);
+
+  for (;;) {
+    size_t destsize = destlen;
+    size_t srcsize = srclen;
+    size_t s = LZ4F_decompress(lz4f, dest, &destsize, src, &srcsize, &opts);
+    f->status = s;
+    if (LZ4F_isError(s)) { return; }
+
+    dest += destsize;
+    destlen -= destsize;
+    src += srcsize;
+    srclen -= srcsize;
+
+    if (s == 0) {
+      if (destlen != 0 || srclen != 0) { f->status = 1; }
+      return;
+    }
+
+    if (destsize == 0 && srcsize == 0) { return; }
+  }
+}
+
+/*
+ * 連結された複数のフレームを、フレームごとに複数のスレッドで一つの出力先へ伸長する。
+ *
+ * 伸長できない形式 (フレームが一つだけの場合を含む) であれば FALSE を返す。
+ */
+static mrb_bool
+dec_s_decode_frames_mt(MRB, struct dec_s_decode *p)
+{
+  const char *srcp = RSTR_PTR(p->src);
+  const char *term = srcp + RSTR_LEN(p->src);
+  size_t destlen;
+  ssize_t nframes = lz4f_mt_scan_frames(p->context, srcp, term, NULL, &destlen);
+
+  if (nframes < 2) { return FALSE; }
+
+  struct lz4f_mt_frames mt = { .trusted = p->trusted, };
+  p->work = mt.frames = (struct lz4f_mt_frame *)mrb_malloc(mrb, sizeof(struct lz4f_mt_frame) * nframes);
+  lz4f_mt_scan_frames(p->context, srcp, term, mt.frames, &destlen);
+
+  p->ndctxs = (int)MIN(p->threads, nframes);
+  p->dctxs = mt.dctxs = (LZ4F_dctx **)mrb_calloc(mrb, p->ndctxs, sizeof(LZ4F_dctx *));
+  int i;
+  for (i = 0; i < p->ndctxs; i++) {
+    LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&mt.dctxs[i], LZ4F_VERSION);
+    aux_lz4f_check_error(mrb, err, "LZ4F_createDecompressionContext");
+  }
+
+  struct RString *dest = mrbx_str_reserve(mrb, p->dest, MAX(destlen, 1));
+  mt.dest = RSTR_PTR(dest);
+
+  aux_parallel_run(p->ndctxs, nframes, lz4f_mt_decode_frame_job, &mt);
+
+  ssize_t j;
+  for (j = 0; j < nframes; j++) {
+    aux_lz4f_check_error(mrb, mt.frames[j].status, "LZ4F_decompress");
+
+    if (mt.frames[j].status != 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR,
+                 "wrong content size or unexpected termination (frame #%S)",
+                 aux_int_value(mrb, (mrb_int)j));
+    }
+  }
+
+  mrbx_str_set_len(mrb, dest, destlen);
+
+  return TRUE;
+}
+
+static mrb_value
+dec_s_decode_try(MRB, mrb_value argv)
+{
+  struct dec_s_decode *p = (struct dec_s_decode *)mrb_cptr(argv);
+
+  if (p->maxdest < 0 && p->threads > 0 && NIL_P(p->dicts) &&
+      (dec_s_decode_frames_mt(mrb, p) ||
+       dec_s_decode_mt(mrb, p->src, p->dest, p->context, p->threads, p->trusted, &p->work))) {
+    return mrb_obj_value(p->dest);
+  }
+
+  if (p->maxdest < 0) {
+    dec_s_decode_all(mrb, p);
+  } else {
+    dec_s_decode_partial(mrb, p);
+  }
+
+  return mrb_obj_value(p->dest);
+}
+
+static mrb_value
+dec_s_decode_ensure(MRB, mrb_value argv)
+{
+  struct dec_s_decode *p = (struct dec_s_decode *)mrb_cptr(argv);
+
+  /* NOTE: 例外で中断した場合でも、コンテキストは次に使えるようにする */
+  LZ4F_resetDecompressionContext(p->context);
+
+  if (p->owned) {
+    aux_scratch_give(mrb, AUX_SCRATCH_DCTX, p->context);
+  }
+
+  mrb_free(mrb, p->work);
+
+  if (p->dctxs) {
+    int i;
+    for (i = 0; i < p->ndctxs; i++) {
+      if (p->dctxs[i]) { LZ4F_freeDecompressionContext(p->dctxs[i]); }
+    }
+    mrb_free(mrb, p->dctxs);
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *  decode(src, destsize = nil, dest = "", opts = {}) -> dest
+ *  decode(src, dest, opts = {}) -> dest
+ *
+ * [opts (hash)]
+ *
+ *  threads (nil OR 0 OR positive integer)::
+ *
+ *      decompress on worker threads.
+ *      0 means number of CPUs.
+ *
+ *      Concatenated frames are decompressed in parallel if all of them have the content size.
+ *      A single frame is decompressed in parallel if it has independent blocks (blocklink: false).
+ *      Only used when destsize is not given and no dictionary is used.
+ *      Otherwise decompress on the calling thread.
+ *
+ *  context (nil OR LZ4::Decoder::Context)::
+ *
+ *      reuse the given decompression context instead of creating new one.
+ *
+ *  dictionary (nil OR LZ4::Dictionary OR Array of LZ4::Dictionary OR String)::
+ *
+ *      dictionaries for the frame.
+ *      The dictionary is chosen by dictID in the frame header.
+ *      If not found, look up the dictionaries registered by LZ4::Dictionary.register.
+ *      A String is used as the dictionary regardless of dictID.
+ *
+ *  trusted (true OR false)::
+ *
+ *      skip verifying the block and content checksums (default false).
+ *      Use only for input already verified by other means.
+ *      Broken input is still detected as far as the block format allows.
+ */
+static mrb_value
+dec_s_decode(MRB, mrb_value self)
+{
+  struct dec_s_decode args = { self, 0 };
+
+  dec_s_decode_args(mrb, &args.src, &args.dest, &args.maxdest, &args.threads, &args.context, &args.dicts, &args.trusted);
+
+  if (args.context) {
+    LZ4F_resetDecompressionContext(args.context);
+  } else {
+    args.context = (LZ4F_dctx *)aux_scratch_take(mrb, AUX_SCRATCH_DCTX);
+    args.owned = TRUE;
+  }
+
+  return mrb_ensure(mrb,
+                    dec_s_decode_try, mrb_cptr_value(mrb, &args),
+                    dec_s_decode_ensure, mrb_cptr_value(mrb, &args));
+}
+
+struct decoder
+{
+  LZ4F_dctx *lz4f;
+  mrb_value predict;
+  mrb_value inport;
+  int fd; /* inport が IO であれば、そのファイル記述子。そうでなければ -1 */
+  mrb_value inbuf;
+  mrb_int inoff;
+  mrb_int inbufsize;
+  uint64_t total_out; /* 現在のフレームで伸長した長さ */
+  uint64_t contentsize; /* 現在のフレームの contentSize */
+  size_t blocksize; /* 現在のフレームの最大ブロック長 */
+  mrb_bool presized; /* 現在のフレームで contentSize による事前確保を済ませた */
+  mrb_bool header_done; /* 現在のフレームのヘッダを読み込み、辞書を選んだ */
+  uint8_t headlen;
+  char head[LZ4F_HEADER_SIZE_MAX];
+  const char *dict; /* 現在のフレームの辞書 (ivar "mruby-lz4.dictionary" で保持する) */
+  size_t dictsize;
+  mrb_bool trusted; /* チェックサムを確かめない */
+};
+
+static void
+decoder_free(MRB, struct decoder *p)
+{
+  if (p->lz4f) {
+    LZ4F_freeDecompressionContext(p->lz4f);
+  }
+
+  mrb_free(mrb, p);
+}
+
+static const mrb_data_type decoder_type = {
+  .struct_name = "mruby-lz4.decoder",
+  .dfree = (void (*)(mrb_state *, void *))decoder_free,
+};
+
+static struct decoder *
+getdecoder(MRB, mrb_value self)
+{
+  struct decoder *p;
+  Data_Get_Struct(mrb, self, &decoder_type, p);
+  return p;
+}
+
+static mrb_value
+decoder_set_predict(MRB, mrb_value self, struct decoder *p, mrb_value predict)
+{
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.predict"), predict);
+  p->predict = predict;
+  return predict;
+}
+
+static void
+decoder_set_dict(MRB, mrb_value self, struct decoder *p, mrb_value dict)
+{
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.dictionary"), dict);
+  aux_lz4f_dict_data(mrb, dict, &p->dict, &p->dictsize);
+}
+
+/*
+ * 次のフレームに備える。
+ */
+static void
+decoder_clear_frame(MRB, mrb_value self, struct decoder *p)
+{
+  p->total_out = 0;
+  p->contentsize = 0;
+  p->presized = FALSE;
+  p->header_done = FALSE;
+  p->headlen = 0;
+  decoder_set_dict(mrb, self, p, Qnil);
+}
+
+static mrb_value
+decoder_set_inport(MRB, mrb_value self, struct decoder *p, mrb_value port)
+{
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.inport"), port);
+  p->inport = port;
+  p->fd = (mrb_string_p(port) ? -1 : aux_io_fileno(mrb, port, TRUE));
+  if (p->fd >= 0) { aux_fd_advise_sequential(p->fd); }
+  return port;
+}
+
+static mrb_value
+decoder_set_inbuf(MRB, mrb_value obj, struct decoder *p, mrb_value buf)
+{
+  p->inbuf = buf;
+  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-lz4.inbuf"), buf);
+  return buf;
+}
+
+
+/*
+ * call-seq:
+ *  new(inport)
+ */
+static mrb_value
+dec_s_new(MRB, mrb_value self)
+{
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &decoder_type);
+  struct decoder *p = (struct decoder *)mrb_calloc(mrb, 1, sizeof(struct decoder));
+  rd->data = p;
+
+  LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&p->lz4f, LZ4F_VERSION);
+  aux_lz4f_check_error(mrb, err, "LZ4F_createDecompressionContext");
+  p->inport = Qnil;
+  p->fd = -1;
+  p->inbuf = Qnil;
+  p->inbufsize = MIN(1 << 20, AUX_STR_MAX); /* AUX_STR_MAX or 1 MiB */
+
+  mrb_int argc;
+  mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  mrb_funcall_argv(mrb, mrb_obj_value(rd), id_initialize, argc, argv);
+
+  return mrb_obj_value(rd);
+}
+
+/*
+ * call-seq:
+ *  initialize(inport, opts = {})
+ *
+ * [opts (hash)]
+ *
+ *  dictionary (nil OR LZ4::Dictionary OR Array of LZ4::Dictionary OR String)::
+ *
+ *      dictionaries for each frames.
+ *      The dictionary is chosen by dictID in the frame header.
+ *      See LZ4::Decoder.decode.
+ *
+ *  predict (string OR nil)::
+ *
+ *      same as dictionary (for compatibility).
+ *
+ *  trusted (true OR false)::
+ *
+ *      skip verifying the checksums. See LZ4::Decoder.decode.
+ */
+static mrb_value
+dec_initialize_predict(MRB, mrb_value opts, mrb_bool *trusted)
+{
+  mrb_value predict, dicts, atrusted;
+  MRBX_SCANHASH(mrb, opts, Qnil,
+      MRBX_SCANHASH_ARGS("predict", &predict, Qnil),
+      MRBX_SCANHASH_ARGS("dictionary", &dicts, Qnil),
+      MRBX_SCANHASH_ARGS("trusted", &atrusted, Qfalse));
+  *trusted = mrb_test(atrusted);
+  if (NIL_P(dicts)) {
+    if (!NIL_P(predict)) { mrb_check_type(mrb, predict, MRB_TT_STRING); }
+    dicts = predict;
+  }
+  return aux_lz4f_check_dicts(mrb, dicts);
+}
+
+/*
+ * 新しいフレームの読み込みを開始する。
+ */
+static void
+decoder_begin(MRB, mrb_value self, struct decoder *p, mrb_value port, mrb_value predict)
+{
+  decoder_set_predict(mrb, self, p, predict);
+
+  if (mrb_string_p(port)) {
+    decoder_set_inbuf(mrb, self, p, port);
+    p->inbufsize = -1;
+    p->inoff = 0;
+  } else {
+    if (mrb_string_p(p->inport) && mrb_obj_eq(mrb, p->inbuf, p->inport)) {
+      /* NOTE: 以前の入力文字列を読み込み用の一時バッファとして上書きしないように手放す */
+      decoder_set_inbuf(mrb, self, p, Qnil);
+    }
+
+    p->inbufsize = AUX_LZ4_DEFAULT_PARTIAL_SIZE;
+    p->inoff = (NIL_P(p->inbuf) ? 0 : RSTRING_LEN(p->inbuf));
+  }
+
+  decoder_set_inport(mrb, self, p, port);
+  decoder_clear_frame(mrb, self, p);
+}
+
+static mrb_value
+dec_initialize(MRB, mrb_value self)
+{
+  struct decoder *p = getdecoder(mrb, self);
+  mrb_value port, predict, opts;
+  switch (mrb_get_args(mrb, "o|H", &port, &opts)) {
+  case 1:
+    predict = Qnil;
+    p->trusted = FALSE;
+    break;
+  case 2:
+    predict = dec_initialize_predict(mrb, opts, &p->trusted);
+    break;
+  default:
+    AUX_NOT_REACHED_HERE;
+  }
+
+  decoder_begin(mrb, self, p, port, predict);
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *  reset(inport = nil, opts = nil) -> self
+ *
+ * Start reading a new frame, reusing the decompression context and the buffers.
+ *
+ * If inport is nil, keep the current port and continue from the unread input.
+ * If opts is not given, keep the current options.
+ */
+static mrb_value
+dec_reset(MRB, mrb_value self)
+{
+  struct decoder *p = getdecoder(mrb, self);
+  mrb_value port = Qnil, opts = Qnil;
+  mrb_get_args(mrb, "|oH!", &port, &opts);
+  if (mrb_hash_p(port) && NIL_P(opts)) {
+    opts = port;
+    port = Qnil;
+  }
+
+  mrb_value predict = (NIL_P(opts) ? p->predict : dec_initialize_predict(mrb, opts, &p->trusted));
+
+  LZ4F_resetDecompressionContext(p->lz4f);
+
+  if (NIL_P(port)) {
+    decoder_set_predict(mrb, self, p, predict);
+    decoder_clear_frame(mrb, self, p);
+  } else {
+    decoder_begin(mrb, self, p, port, predict);
+  }
+
+  return self;
+}
+
+/*
+ * 入力を使い切っていれば、入力元から読み込む。
+ *
+ * 入力があれば 0 を、終端であれば -1 を返す。
+ * nonblock であれば、入力元が待つ必要があることを示した場合に 1 を返す。
+ */
+static int
+dec_read_fetch(MRB, mrb_value self, struct decoder *p, mrb_bool nonblock)
+{
+  if (NIL_P(p->inbuf) || p->inoff >= RSTRING_LEN(p->inbuf)) {
+    if (p->inbufsize < 1) { p->inbufsize = 0; return -1; }
+
+    if (p->fd >= 0) {
+      decoder_set_inbuf(mrb, self, p, aux_str_alloc(mrb, p->inbuf, p->inbufsize));
+      int64_t n = aux_fd_read(p->fd, RSTRING_PTR(p->inbuf), p->inbufsize);
+      if (n < 0) {
+        int err = errno;
+        mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->inbuf), 0);
+        if (nonblock && AUX_FD_AGAIN_P(err)) { return 1; }
+        aux_sys_fail(mrb, err, "read");
+      }
+      mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->inbuf), n);
+      if (n < 1) { p->inbufsize = 0; return -1; }
+      p->inoff = 0;
+      return 0;
+    }
+
+    mrb_value v;
+    if (nonblock) {
+      /* NOTE: exception: false を渡すため、mrblib で定義したメソッドを介する */
+      v = FUNCALL(mrb, self, mrb_intern_lit(mrb, "fetch_nonblock"), mrb_fixnum_value(p->inbufsize), p->inbuf);
+      if (mrb_symbol_p(v)) { return 1; }
+    } else {
+      v = FUNCALL(mrb, p->inport, mrb_intern_lit(mrb, "read"), mrb_fixnum_value(p->inbufsize), p->inbuf);
+    }
+    if (NIL_P(v)) { p->inbufsize = 0; return -1; }
+    mrb_check_type(mrb, v, MRB_TT_STRING);
+    if (RSTRING_LEN(v) < 1) { p->inbufsize = 0; return -1; }
+    if (!mrb_obj_eq(mrb, v, p->inbuf)) {
+      decoder_set_inbuf(mrb, self, p, v);
+    }
+
+    p->inoff = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * フレームヘッダを読み込んで、dictID から辞書を選ぶ。
+ *
+ * LZ4F_decompress_usingDict() はヘッダの解析が終わる前にしか辞書を受け付けないため、
+ * ヘッダ全体を p->head に集めてから LZ4F_getFrameInfo() で解析する。
+ *
+ * ヘッダが揃っていなければ FALSE を返す。
+ */
+static mrb_bool
+decoder_read_header(MRB, mrb_value self, struct decoder *p)
+{
+  for (;;) {
+    /* NOTE: LZ4F_headerSize() は最低でも 5 バイトを必要とする */
+    size_t need = 5;
+    if (p->headlen >= need) {
+      need = LZ4F_headerSize(p->head, p->headlen);
+      aux_lz4f_check_error(mrb, need, "LZ4F_headerSize");
+    }
+
+    if (p->headlen >= need) { break; }
+
+    size_t rest = RSTRING_LEN(p->inbuf) - p->inoff;
+    if (rest < 1) { return FALSE; }
+    size_t n = MIN(need - p->headlen, rest);
+    memcpy(p->head + p->headlen, RSTRING_PTR(p->inbuf) + p->inoff, n);
+    p->headlen += n;
+    p->inoff += n;
+  }
+
+  LZ4F_frameInfo_t info;
+  size_t headsize = p->headlen;
+  size_t s = LZ4F_getFrameInfo(p->lz4f, &info, p->head, &headsize);
+  aux_lz4f_check_error(mrb, s, "LZ4F_getFrameInfo");
+
+  if (headsize < p->headlen) {
+    /* NOTE: スキップ可能フレームは 4 バイトしか消費されないため、残りを渡す */
+    size_t destsize = 0;
+    size_t srcsize = p->headlen - headsize;
+    LZ4F_decompressOptions_t opts = { .skipChecksums = p->trusted, };
+    s = LZ4F_decompress(p->lz4f, p->head, &destsize, p->head + headsize, &srcsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+
+    if (s == 0) {
+      /* NOTE: 中身のないスキップ可能フレームはここで終わる */
+      decoder_clear_frame(mrb, self, p);
+      return FALSE;
+    }
+  }
+
+  p->header_done = TRUE;
+  p->contentsize = info.contentSize;
+  p->blocksize = LZ4F_getBlockSize(info.blockSizeID);
+  if (LZ4F_isError(p->blocksize)) { p->blocksize = AUX_LZ4_DEFAULT_PARTIAL_SIZE; }
+  p->blocksize = MIN(p->blocksize, AUX_STR_MAX);
+
+  if (p->fd >= 0 && p->blocksize + 8 > (size_t)p->inbufsize) {
+    /* NOTE: ブロック全体 (ブロック長とチェックサムを含む) を一度に読み込めば、LZ4F 内部への複写を省ける */
+    p->inbufsize = MIN(p->blocksize + 8, AUX_STR_MAX);
+  }
+  decoder_set_dict(mrb, self, p, aux_lz4f_select_dict(mrb, p->predict, info.dictID));
+
+  return TRUE;
+}
+
+/*
+ * read(nil) で全てを読み込む場合に、contentSize が記録されていれば残りの伸長後の長さを一度で確保する。
+ */
+static void
+decoder_presize(MRB, struct decoder *p, struct RString *dest)
+{
+  p->presized = TRUE;
+
+  if (p->contentsize <= p->total_out) { return; }
+
+  /* NOTE: 入力が文字列であれば残りの入力長が分かるため、contentSize の妥当性を確認できる */
+  size_t srcrest = (p->inbufsize < 0 ? RSTRING_LEN(p->inbuf) - p->inoff : SIZE_MAX);
+  size_t rest = aux_lz4f_presize(p->contentsize - p->total_out, srcrest);
+
+  if (rest > RSTR_CAPA(dest) - RSTR_LEN(dest)) {
+    mrbx_str_reserve(mrb, dest, MIN(RSTR_LEN(dest) + rest, AUX_STR_MAX));
+  }
+}
+
+/*
+ * dest の末尾へ最大 size バイト (負であれば入力の終わりまで) を伸長する。
+ *
+ * nonblock であれば、入力元を待つ必要が生じた時点で TRUE を返す。
+ */
+static mrb_bool
+decoder_read(MRB, mrb_value self, struct decoder *p, intptr_t size, struct RString *dest, mrb_bool nonblock)
+{
+  int arena = mrb_gc_arena_save(mrb);
+
+  while (size < 0 || RSTR_LEN(dest) < size) {
+    mrb_gc_arena_restore(mrb, arena);
+
+    int fetched = dec_read_fetch(mrb, self, p, nonblock);
+    if (fetched < 0) {
+      break;
+    } else if (fetched > 0) {
+      return TRUE;
+    }
+
+    if (!p->header_done && !decoder_read_header(mrb, self, p)) {
+      continue;
+    }
+
+    if (size < 0 && !p->presized) {
+      decoder_presize(mrb, p, dest);
+    }
+
+    const char *srcp = RSTRING_PTR(p->inbuf) + p->inoff;
+    size_t srcsize = RSTRING_LEN(p->inbuf) - p->inoff;
+    char *destp = RSTR_PTR(dest) + RSTR_LEN(dest);
+    size_t destsize = (size < 0 ? RSTR_CAPA(dest) : size) - RSTR_LEN(dest);
+    LZ4F_decompressOptions_t opts = { .skipChecksums = p->trusted, };
+    size_t s = LZ4F_decompress_usingDict(p->lz4f, destp, &destsize, srcp, &srcsize, p->dict, p->dictsize, &opts);
+    p->inoff += srcsize;
+    p->total_out += destsize;
+    RSTR_SET_LEN(dest, RSTR_LEN(dest) + destsize);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    if (s == 0) {
+      decoder_clear_frame(mrb, self, p);
+      break;
+    }
+
+    if (RSTR_LEN(dest) >= AUX_STR_MAX) {
+      break;
+    }
+
+    if (size < 0 && RSTR_LEN(dest) >= RSTR_CAPA(dest)) {
+      mrbx_str_reserve(mrb, dest, aux_lz4_grow_size(RSTR_CAPA(dest)));
+    }
+  }
+
+  return FALSE;
+}
+
+/*
+ * call-seq:
+ *  read(size = nil, dest = "") -> dest
+ */
+static mrb_value
+dec_read(MRB, mrb_value self)
+{
+  struct decoder *p = getdecoder(mrb, self);
+  intptr_t size;
+  struct RString *dest;
+  common_read_args(mrb, &size, &dest);
+  if (size == 0) { return mrb_obj_value(dest); }
+
+  decoder_read(mrb, self, p, size, dest, FALSE);
+
+  if (RSTR_LEN(dest) > 0) {
+    return mrb_obj_value(dest);
+  } else {
+    return Qnil;
+  }
+}
+
+/*
+ * call-seq:
+ *  read_nonblock(size = nil, dest = "") -> dest OR :wait_readable OR nil
+ *
+ * Like read, but never blocks on the input port.
+ * Returns the data decompressed so far (up to size) without waiting for
+ * the rest.
+ *
+ * The input port needs +read_nonblock(size, buf, exception: false)+, which
+ * returns a string, +:wait_readable+ or nil at the end of input
+ * (an IO of mruby-io is read through its file descriptor).
+ * The input that is not yet decompressed is kept in the decoder.
+ *
+ * Returns :wait_readable if nothing could be decompressed without waiting,
+ * or nil at the end of input.
+ */
+static mrb_value
+dec_read_nonblock(MRB, mrb_value self)
+{
+  struct decoder *p = getdecoder(mrb, self);
+  intptr_t size;
+  struct RString *dest;
+  common_read_args(mrb, &size, &dest);
+  if (size == 0) { return mrb_obj_value(dest); }
+
+  mrb_bool wait = decoder_read(mrb, self, p, size, dest, TRUE);
+
+  if (RSTR_LEN(dest) > 0) {
+    return mrb_obj_value(dest);
+  } else if (wait) {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "wait_readable"));
+  } else {
+    return Qnil;
+  }
+}
+
+/*
+ * call-seq:
+ *  read_chunk(buf = nil) -> chunk OR nil
+ *
+ * Decompress the next block and return it.
+ * The size of the chunk does not exceed the block size of the frame.
+ *
+ * If buf is given, it is cleared and reused as the chunk every time.
+ * Returns nil at the end of input.
+ */
+static mrb_value
+dec_read_chunk(MRB, mrb_value self)
+{
+  struct decoder *p = getdecoder(mrb, self);
+  mrb_value buf = Qnil;
+  mrb_get_args(mrb, "|S!", &buf);
+
+  struct RString *dest = (NIL_P(buf) ? NULL : mrbx_str_ptr(mrb, buf));
+  mrb_bool prepared = FALSE;
+  int arena = mrb_gc_arena_save(mrb);
+
+  for (;;) {
+    mrb_gc_arena_restore(mrb, arena);
+
+    if (dec_read_fetch(mrb, self, p, FALSE) < 0) {
+      break;
+    }
+
+    if (!p->header_done && !decoder_read_header(mrb, self, p)) {
+      continue;
+    }
+
+    if (!prepared) {
+      /* NOTE: ブロック長の容量があれば、LZ4F 内部を経由せずに出力先へ直接伸長される */
+      dest = mrbx_str_force_recycle(mrb, dest, p->blocksize);
+      mrbx_str_set_len(mrb, dest, 0);
+      prepared = TRUE;
+      arena = mrb_gc_arena_save(mrb);
+    }
+
+    const char *srcp = RSTRING_PTR(p->inbuf) + p->inoff;
+    size_t srcsize = RSTRING_LEN(p->inbuf) - p->inoff;
+    char *destp = RSTR_PTR(dest) + RSTR_LEN(dest);
+    size_t destsize = RSTR_CAPA(dest) - RSTR_LEN(dest);
+    LZ4F_decompressOptions_t opts = { .skipChecksums = p->trusted, };
+    size_t s = LZ4F_decompress_usingDict(p->lz4f, destp, &destsize, srcp, &srcsize, p->dict, p->dictsize, &opts);
+    p->inoff += srcsize;
+    p->total_out += destsize;
+    RSTR_SET_LEN(dest, RSTR_LEN(dest) + destsize);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    if (s == 0) {
+      decoder_clear_frame(mrb, self, p);
+    }
+
+    if (RSTR_LEN(dest) > 0) {
+      if (NIL_P(buf)) {
+        /*
+         * NOTE: 新しく作った文字列はブロック長の容量を抱えたままなので、長さまで切り詰める。
+         *       mrb_str_resize() は長さが変わる場合にしか容量を変えないため、一度容量いっぱいの長さにする。
+         */
+        mrb_int len = RSTR_LEN(dest);
+        RSTR_SET_LEN(dest, RSTR_CAPA(dest));
+        mrb_str_resize(mrb, mrb_obj_value(dest), len);
+      }
+
+      return mrb_obj_value(dest);
+    }
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ */
+static mrb_value
+dec_close(MRB, mrb_value self)
+{
+  getdecoder(mrb, self)->inbufsize = 0;
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *  eof -> true OR false
+ */
+static mrb_value
+dec_eof(MRB, mrb_value self)
+{
+  if (getdecoder(mrb, self)->inbufsize > 0) {
+    return Qfalse;
+  } else {
+    return Qtrue;
+  }
+}
+
+/*
+ * call-seq:
+ *  port -> inport
+ */
+static mrb_value
+dec_get_port(MRB, mrb_value self)
+{
+  return getdecoder(mrb, self)->inport;
+}
+
+static void
+init_decoder(MRB, struct RClass *mLZ4)
+{
+  struct RClass *cDecoder = mrb_define_class_under(mrb, mLZ4, "Decoder", mrb_cObject);
+  MRB_SET_INSTANCE_TT(cDecoder, MRB_TT_DATA);
+
+  mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "read", dec_read, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "read_chunk", dec_read_chunk, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "read_nonblock", dec_read_nonblock, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "close", dec_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cDecoder, "eof", dec_eof, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cDecoder, "reset", dec_reset, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cDecoder, "port", dec_get_port, MRB_ARGS_NONE());
+
+  mrb_define_alias(mrb, cDecoder, "finish", "close");
+  mrb_define_alias(mrb, cDecoder, "eof?", "eof");
+
+  struct RClass *cContext = mrb_define_class_under(mrb, cDecoder, "Context", mrb_cObject);
+  MRB_SET_INSTANCE_TT(cContext, MRB_TT_DATA);
+  mrb_define_class_method(mrb, cContext, "new", dec_context_s_new, MRB_ARGS_NONE());
+}
+
+/*
+ * LZ4.encode_file / LZ4.decode_file
+ *
+ * 入力ファイルをメモリに対応付けて、mruby の文字列を介さずにファイルからファイルへ処理する。
+ */
+
+#define AUX_LZ4_FILE_CHUNK ((size_t)4 << 20)
+
+struct lz4_file
+{
+  const char *inpath;
+  const char *outpath;
+  struct aux_mapfile in;
+  struct aux_mapfile out; /* 伸長で contentSize が分かっている場合の出力先 */
+  FILE *outfp; /* それ以外の出力先 */
+  char *buf;
+  LZ4F_cctx *cctx;
+  LZ4F_dctx *dctx;
+  struct lz4f_mt *mt;
+  struct encode_opts opts;
+  mrb_value dicts;
+  mrb_bool trusted; /* 伸長でチェックサムを確かめない */
+  uint64_t total; /* 出力した長さ */
+};
+
+static void
+lz4_file_check_paths(MRB, struct lz4_file *p)
+{
+  /* NOTE: 出力先を切り詰めると、対応付けた入力も失われる */
+  if (strcmp(p->inpath, p->outpath) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "same path for input and output");
+  }
+}
+
+static void
+lz4_file_open(MRB, struct lz4_file *p, mrb_bool outfp)
+{
+  int err = aux_mapfile_open(&p->in, p->inpath);
+  if (err != 0) { aux_sys_fail(mrb, err, p->inpath); }
+
+  /* NOTE: 別名のパス (リンクなど) で同じファイルを指していれば、切り詰めた入力の参照が SIGBUS となる */
+  if (aux_mapfile_same_p(&p->in, p->outpath)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "same file for input and output");
+  }
+
+  if (outfp) {
+    p->outfp = fopen(p->outpath, "wb");
+    if (!p->outfp) { aux_sys_fail(mrb, errno, p->outpath); }
+  }
+}
+
+static void
+lz4_file_write(MRB, struct lz4_file *p, const char *buf, size_t len)
+{
+  if (len > 0 && fwrite(buf, 1, len, p->outfp) != len) {
+    aux_sys_fail(mrb, errno, p->outpath);
+  }
+
+  p->total += len;
+}
+
+/*
+ * 出力先を閉じて、書き込みの失敗を例外として報告する。
+ */
+static void
+lz4_file_finish(MRB, struct lz4_file *p)
+{
+  if (p->outfp) {
+    FILE *fp = p->outfp;
+    p->outfp = NULL;
+    if (fclose(fp) != 0) { aux_sys_fail(mrb, errno, p->outpath); }
+  }
+
+  int err = aux_mapfile_close(&p->out);
+  if (err != 0) { aux_sys_fail(mrb, err, p->outpath); }
+}
+
 static mrb_value
-enc_write(MRB, mrb_value self)
+lz4_file_ensure(MRB, mrb_value arg)
 {
-  struct encoder *p = getencoder(mrb, self);
-  const char *src;
-  mrb_int srclen;
-  mrb_get_args(mrb, "s", &src, &srclen);
+  struct lz4_file *p = (struct lz4_file *)mrb_cptr(arg);
 
-  const LZ4F_compressOptions_t opts = { .stableSrc = 0, };
+  aux_mapfile_close(&p->in);
+  aux_mapfile_close(&p->out);
+  if (p->outfp) { fclose(p->outfp); }
+  mrb_free(mrb, p->buf);
+  mrb_free(mrb, p->mt);
 
-  while (srclen > 0) {
-    size_t insize = MIN(srclen, 4 * 1024 * 1024);
-    size_t outsize = LZ4F_compressBound(insize, &p->prefs);
-    encoder_set_outbuf(mrb, self, p, aux_str_alloc(mrb, p->outbuf, outsize));
-    char *dest = RSTRING_PTR(p->outbuf);
-    size_t s = LZ4F_compressUpdate(p->lz4f, dest, outsize, src, insize, &opts);
-    aux_lz4f_check_error(mrb, s, "LZ4F_compressUpdate");
-    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), s);
-    FUNCALL(mrb, p->io, mrb_intern_lit(mrb, "<<"), p->outbuf);
-    src += insize;
-    srclen -= insize;
+  if (p->cctx && p->cctx != p->opts.context) {
+    LZ4F_freeCompressionContext(p->cctx);
   }
 
-  return self;
+  if (p->dctx) {
+    LZ4F_resetDecompressionContext(p->dctx);
+    aux_scratch_give(mrb, AUX_SCRATCH_DCTX, p->dctx);
+  }
+
+  return Qnil;
 }
 
-/*
- * call-seq:
- *  flush -> self
- */
 static mrb_value
-enc_flush(MRB, mrb_value self)
+enc_s_encode_file_try(MRB, mrb_value arg)
 {
-  struct encoder *p = getencoder(mrb, self);
-  const LZ4F_compressOptions_t opts = { .stableSrc = 0, };
-
-  size_t insize = 4 * 1024 * 1024 + 16;
-  size_t outsize = LZ4F_compressBound(insize, &p->prefs);
-  encoder_set_outbuf(mrb, self, p, aux_str_alloc(mrb, p->outbuf, outsize));
-  char *dest = RSTRING_PTR(p->outbuf);
-  size_t s = LZ4F_flush(p->lz4f, dest, outsize, &opts);
-  aux_lz4f_check_error(mrb, s, "LZ4F_flush");
-  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), s);
-  FUNCALL(mrb, p->io, mrb_intern_lit(mrb, "<<"), p->outbuf);
+  struct lz4_file *p = (struct lz4_file *)mrb_cptr(arg);
+  LZ4F_preferences_t *prefs = &p->opts.prefs;
 
-  return self;
-}
+  lz4_file_open(mrb, p, TRUE);
 
-/*
- * call-seq:
- *  close -> self
- */
-static mrb_value
-enc_close(MRB, mrb_value self)
-{
-  struct encoder *p = getencoder(mrb, self);
-  const LZ4F_compressOptions_t opts = { .stableSrc = 0, };
-
-  size_t insize = 4 * 1024 * 1024 + 16;
-  size_t outsize = LZ4F_compressBound(insize, &p->prefs);
-  encoder_set_outbuf(mrb, self, p, aux_str_alloc(mrb, p->outbuf, outsize));
-  char *dest = RSTRING_PTR(p->outbuf);
-  size_t s = LZ4F_compressEnd(p->lz4f, dest, outsize, &opts);
-  aux_lz4f_check_error(mrb, s, "LZ4F_compressEnd");
-  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, p->outbuf), s);
-  FUNCALL(mrb, p->io, mrb_intern_lit(mrb, "<<"), p->outbuf);
+  if (p->opts.autosize) {
+    prefs->frameInfo.contentSize = p->in.size;
+  }
 
-  return self;
+  if (p->opts.context) {
+    p->cctx = p->opts.context;
+  } else {
+    LZ4F_errorCode_t err = LZ4F_createCompressionContext(&p->cctx, LZ4F_getVersion());
+    aux_lz4f_check_error(mrb, err, "LZ4F_createCompressionContext");
+  }
+
+  size_t bufsize;
+  if (p->opts.threads > 0) {
+    p->mt = lz4f_mt_new(mrb, prefs, p->opts.threads, FALSE);
+    p->mt->probe = p->opts.probe;
+    p->mt->stats = aux_scratch_probe_stats(mrb);
+    bufsize = MAX(p->mt->slotsize * p->mt->nslots, LZ4F_HEADER_SIZE_MAX);
+  } else {
+    bufsize = LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(AUX_LZ4_FILE_CHUNK, prefs);
+  }
+  p->buf = (char *)mrb_malloc(mrb, bufsize);
+
+  size_t s = LZ4F_compressBegin_usingCDict(p->cctx, p->buf, bufsize, p->opts.cdict, prefs);
+  aux_lz4f_check_error(mrb, s, "LZ4F_compressBegin");
+  lz4_file_write(mrb, p, p->buf, s);
+
+  const char *src = p->in.ptr;
+  size_t srclen = p->in.size;
+
+  if (p->mt) {
+    while (srclen > 0) {
+      size_t n = lz4f_mt_compress(p->mt, src, srclen);
+      lz4_file_write(mrb, p, p->buf, lz4f_mt_output(p->mt, p->buf));
+      src += n;
+      srclen -= n;
+    }
+
+    lz4_file_write(mrb, p, p->buf, lz4f_mt_end(mrb, p->mt, p->buf));
+  } else {
+    while (srclen > 0) {
+      size_t n = MIN(srclen, AUX_LZ4_FILE_CHUNK);
+      s = LZ4F_compressUpdate(p->cctx, p->buf, bufsize, src, n, NULL);
+      aux_lz4f_check_error(mrb, s, "LZ4F_compressUpdate");
+      lz4_file_write(mrb, p, p->buf, s);
+      src += n;
+      srclen -= n;
+    }
+
+    s = LZ4F_compressEnd(p->cctx, p->buf, bufsize, NULL);
+    aux_lz4f_check_error(mrb, s, "LZ4F_compressEnd");
+    lz4_file_write(mrb, p, p->buf, s);
+  }
+
+  lz4_file_finish(mrb, p);
+
+  return aux_int_value(mrb, p->total);
 }
 
 /*
  * call-seq:
- *  port -> outport
+ *  encode_file(input_path, output_path, prefs = {}) -> compressed size
+ *
+ * Compress the file to the file without mruby strings.
+ * The input file is mapped into memory (mmap).
+ *
+ * [prefs (hash)]
+ *
+ *  same as LZ4.encode.
+ *  content size is recorded in frame header unless size: false.
  */
 static mrb_value
-enc_get_port(MRB, mrb_value self)
+enc_s_encode_file(MRB, mrb_value self)
 {
-  return getencoder(mrb, self)->io;
-}
+  struct lz4_file f = { 0 };
+  mrb_value opts = Qnil;
+  mrb_get_args(mrb, "zz|H", &f.inpath, &f.outpath, &opts);
 
-static void
-init_encoder(MRB, struct RClass *mLZ4)
-{
-  struct RClass *cEncoder = mrb_define_class_under(mrb, mLZ4, "Encoder", mrb_cObject);
-  mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
-  mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
-  mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
-  mrb_define_method(mrb, cEncoder, "write", enc_write, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
-  mrb_define_method(mrb, cEncoder, "close", enc_close, MRB_ARGS_NONE());
-  mrb_define_method(mrb, cEncoder, "port", enc_get_port, MRB_ARGS_NONE());
+  if (NIL_P(opts)) {
+    aux_lz4f_encode_opts_default(&f.opts);
+  } else {
+    aux_lz4f_encode_args(mrb, opts, &f.opts);
+  }
+  f.opts.prefs.autoFlush = 1;
+  f.dicts = Qnil;
+  lz4_file_check_paths(mrb, &f);
 
-  mrb_define_alias(mrb, cEncoder, "<<", "write");
-  mrb_define_alias(mrb, cEncoder, "finish", "close");
+  return mrb_ensure(mrb,
+                    enc_s_encode_file_try, mrb_cptr_value(mrb, &f),
+                    lz4_file_ensure, mrb_cptr_value(mrb, &f));
 }
 
 /*
- * class LZ4::Decoder
+ * src から始まるフレームのヘッダを読み込み、dictID から辞書を選ぶ。読み込んだ長さを返す。
+ *
+ * ヘッダを読み取れなければ (壊れている場合も含めて) 0 を返し、LZ4F_decompress() に任せる。
  */
-
-static void
-dec_s_decode_args(MRB, struct RString **src, struct RString **dest, ssize_t *maxdest)
+static size_t
+lz4_file_decode_header(MRB, struct lz4_file *p, const char *src, size_t srclen, const char **dict, size_t *dictsize)
 {
-  mrb_value *argv;
-  mrb_int argc;
-  mrb_get_args(mrb, "*", &argv, &argc);
+  LZ4F_frameInfo_t info;
+  size_t headsize = srclen;
+  size_t s = LZ4F_getFrameInfo(p->dctx, &info, src, &headsize);
 
-  switch (argc) {
-  case 1:
-    *maxdest = -1;
-    *dest = NULL;
-    break;
-  case 2:
-    if (mrb_string_p(argv[1])) {
-      *dest = RString(argv[1]);
-      *maxdest = -1;
-    } else {
-      *dest = NULL;
-      *maxdest = aux_to_sizet(mrb, argv[1]);
-    }
-    break;
-  case 3:
-    *maxdest = aux_to_sizet(mrb, argv[1]);
-    *dest = RString(argv[2]);
-    break;
-  default:
-    mrb_raisef(mrb,
-               E_ARGUMENT_ERROR,
-               "wrong number of arguments (given %S, expect 1..3)",
-               mrb_fixnum_value(argc));
-      break;
+  *dict = NULL;
+  *dictsize = 0;
+
+  if (LZ4F_isError(s)) {
+    LZ4F_resetDecompressionContext(p->dctx);
+    return 0;
   }
 
-  mrb_check_type(mrb, argv[0], MRB_TT_STRING);
-  *src = RSTRING(argv[0]);
+  if (info.frameType == LZ4F_frame) {
+    aux_lz4f_dict_data(mrb, aux_lz4f_select_dict(mrb, p->dicts, info.dictID), dict, dictsize);
+  }
 
-  size_t size = (*maxdest < 0 ? AUX_LZ4_DEFAULT_PARTIAL_SIZE : *maxdest);
-  *dest = mrbx_str_force_recycle(mrb, *dest, size);
+  return headsize;
 }
 
+/*
+ * 対応付けた出力先 (大きさは全てのフレームの contentSize の合計) へ直接伸長する。
+ */
 static void
-dec_s_decode_all(MRB, mrb_value self, struct RString *src, struct RString *dest, LZ4F_dctx *lz4f)
+lz4_file_decode_mapped(MRB, struct lz4_file *p, const char *src, size_t srclen)
 {
-  LZ4F_decompressOptions_t opts = { .stableDst = 0, };
-  size_t destoff = 0;
-  size_t maxdest = 0;
-
-  const char *srcp = RSTR_PTR(src);
-  size_t srcsize = RSTR_LEN(src);
+  /* NOTE: 出力先は一続きの領域であるため、連結ブロックの履歴を LZ4F_dctx に複写させずに済む */
+  LZ4F_decompressOptions_t opts = { .stableDst = 1, .skipChecksums = p->trusted, };
+  const char *dict = NULL;
+  size_t dictsize = 0;
+  size_t off = 0;
+  mrb_bool framehead = TRUE;
 
   for (;;) {
-    if (!dest || destoff >= maxdest) {
-      maxdest += AUX_LZ4_DEFAULT_PARTIAL_SIZE;
-      dest = mrbx_str_reserve(mrb, dest, maxdest);
+    if (framehead) {
+      size_t headsize = lz4_file_decode_header(mrb, p, src, srclen, &dict, &dictsize);
+      src += headsize;
+      srclen -= headsize;
+      framehead = FALSE;
     }
 
-    char *destp = RSTR_PTR(dest) + destoff;
-    size_t destsize = maxdest - destoff;
-
-    size_t s = LZ4F_decompress(lz4f, destp, &destsize, srcp, &srcsize, &opts);
+    size_t destsize = p->out.size - off;
+    size_t srcsize = srclen;
+    size_t s = LZ4F_decompress_usingDict(p->dctx, p->out.ptr + off, &destsize, src, &srcsize, dict, dictsize, &opts);
     aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
-    destoff += destsize;
-    srcp += srcsize;
-    srcsize = RSTR_LEN(src) - (srcp - RSTR_PTR(src));
+    off += destsize;
+    src += srcsize;
+    srclen -= srcsize;
+
+    if (s == 0) {
+      /* NOTE: 続きがあれば、連結された次のフレーム (スキップ可能フレームを含む) として読む */
+      if (srclen == 0) { break; }
+      framehead = TRUE;
+      continue;
+    }
 
-    if (s > srcsize) {
-      mrb_raise(mrb, E_RUNTIME_ERROR, "``src'' is too small (unexpected termination)");
+    if (destsize == 0 && srcsize == 0) {
+      if (off >= p->out.size) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "wrong content size (decoded data is too large)");
+      } else {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "input file is too small (unexpected termination)");
+      }
     }
+  }
 
-    if (s == 0) { break; }
+  if (off != p->out.size) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "wrong content size (decoded data is too small)");
   }
 
-  mrbx_str_set_len(mrb, dest, destoff);
+  p->total = off;
 }
 
 static void
-dec_s_decode_partial(MRB, mrb_value self, struct RString *src, struct RString *dest, size_t maxdest, LZ4F_dctx *lz4f)
+lz4_file_decode_stream(MRB, struct lz4_file *p, const char *src, size_t srclen)
 {
-  LZ4F_decompressOptions_t opts = { .stableDst = 1, };
+  LZ4F_decompressOptions_t opts = { .stableDst = 0, .skipChecksums = p->trusted, };
+  const char *dict = NULL;
+  size_t dictsize = 0;
+  mrb_bool framehead = TRUE;
 
-  const char *srcp = RSTR_PTR(src);
-  size_t srcsize = RSTR_LEN(src);
-  char *destp = RSTR_PTR(dest);
-  size_t destsize = maxdest;
+  p->buf = (char *)mrb_malloc(mrb, AUX_LZ4_FILE_CHUNK);
 
-  size_t s = LZ4F_decompress(lz4f, destp, &destsize, srcp, &srcsize, &opts);
-  aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+  for (;;) {
+    if (framehead) {
+      size_t headsize = lz4_file_decode_header(mrb, p, src, srclen, &dict, &dictsize);
+      src += headsize;
+      srclen -= headsize;
+      framehead = FALSE;
+    }
 
-  if (s > 0 && destsize < maxdest) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "``src'' is too small (unexpected termination)");
-  }
+    size_t destsize = AUX_LZ4_FILE_CHUNK;
+    size_t srcsize = srclen;
+    size_t s = LZ4F_decompress_usingDict(p->dctx, p->buf, &destsize, src, &srcsize, dict, dictsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    lz4_file_write(mrb, p, p->buf, destsize);
+    src += srcsize;
+    srclen -= srcsize;
+
+    if (s == 0) {
+      if (srclen == 0) { break; }
+      framehead = TRUE;
+      continue;
+    }
 
-  mrbx_str_set_len(mrb, dest, destsize);
+    if (destsize == 0 && srcsize == 0) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "input file is too small (unexpected termination)");
+    }
+  }
 }
 
-struct dec_s_decode
-{
-  mrb_value self;
-  struct RString *src, *dest;
-  ssize_t maxdest;
-  LZ4F_dctx *context;
-};
-
 static mrb_value
-dec_s_decode_try(MRB, mrb_value argv)
+dec_s_decode_file_try(MRB, mrb_value arg)
 {
-  struct dec_s_decode *p = (struct dec_s_decode *)mrb_cptr(argv);
+  struct lz4_file *p = (struct lz4_file *)mrb_cptr(arg);
 
-  if (p->maxdest < 0) {
-    dec_s_decode_all(mrb, p->self, p->src, p->dest, p->context);
-  } else {
-    dec_s_decode_partial(mrb, p->self, p->src, p->dest, p->maxdest, p->context);
-  }
+  lz4_file_open(mrb, p, FALSE);
+  p->dctx = (LZ4F_dctx *)aux_scratch_take(mrb, AUX_SCRATCH_DCTX);
 
-  return mrb_obj_value(p->dest);
-}
+  const char *src = p->in.ptr;
+  size_t srclen = p->in.size;
+  size_t destlen = 0;
 
-static mrb_value
-dec_s_decode_ensure(MRB, mrb_value argv)
-{
-  struct dec_s_decode *p = (struct dec_s_decode *)mrb_cptr(argv);
+  /*
+   * NOTE: 連結されたフレームの全てに信用できる contentSize が記録されていれば、
+   *       その合計の大きさで出力先を対応付ける。
+   */
+  if (lz4f_mt_scan_frames(p->dctx, src, src + srclen, NULL, &destlen) > 0 && destlen > 0) {
+    int err = aux_mapfile_create(&p->out, p->outpath, destlen);
+    if (err != 0) { aux_sys_fail(mrb, err, p->outpath); }
+    lz4_file_decode_mapped(mrb, p, src, srclen);
+  } else {
+    p->outfp = fopen(p->outpath, "wb");
+    if (!p->outfp) { aux_sys_fail(mrb, errno, p->outpath); }
+    lz4_file_decode_stream(mrb, p, src, srclen);
+  }
 
-  LZ4F_freeDecompressionContext(p->context);
+  lz4_file_finish(mrb, p);
 
-  return Qnil;
+  return aux_int_value(mrb, p->total);
 }
 
 /*
  * call-seq:
- *  decode(src, destsize = nil, dest = "") -> dest
+ *  decode_file(input_path, output_path, opts = {}) -> decompressed size
+ *
+ * Decompress the file to the file without mruby strings.
+ * The input file is mapped into memory (mmap).
+ * Concatenated frames and skippable frames are also decompressed.
+ * If every frame header has the content size,
+ * the output file is extended to the total size and decompressed into the mapped region.
+ *
+ * [opts (hash)]
+ *
+ *  dictionary, trusted::
+ *
+ *      same as LZ4::Decoder.decode.
  */
 static mrb_value
-dec_s_decode(MRB, mrb_value self)
+dec_s_decode_file(MRB, mrb_value self)
 {
-  struct dec_s_decode args = { self, 0 };
-
-  dec_s_decode_args(mrb, &args.src, &args.dest, &args.maxdest);
+  struct lz4_file f = { 0 };
+  mrb_value opts = Qnil, trusted;
+  mrb_get_args(mrb, "zz|H", &f.inpath, &f.outpath, &opts);
 
-  size_t s = LZ4F_createDecompressionContext(&args.context, LZ4F_VERSION);
-  aux_lz4f_check_error(mrb, s, "LZ4F_createDecompressionContext");
+  MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("dictionary", &f.dicts, Qnil),
+                MRBX_SCANHASH_ARGS("trusted", &trusted, Qfalse));
+  f.dicts = aux_lz4f_check_dicts(mrb, f.dicts);
+  f.trusted = mrb_test(trusted);
+  f.opts.dictionary = Qnil;
+  lz4_file_check_paths(mrb, &f);
 
   return mrb_ensure(mrb,
-                    dec_s_decode_try, mrb_cptr_value(mrb, &args),
-                    dec_s_decode_ensure, mrb_cptr_value(mrb, &args));
+                    dec_s_decode_file_try, mrb_cptr_value(mrb, &f),
+                    lz4_file_ensure, mrb_cptr_value(mrb, &f));
 }
 
-struct decoder
+static void
+init_file(MRB, struct RClass *mLZ4)
+{
+  mrb_define_class_method(mrb, mLZ4, "encode_file", enc_s_encode_file, MRB_ARGS_ARG(2, 1));
+  mrb_define_class_method(mrb, mLZ4, "decode_file", dec_s_decode_file, MRB_ARGS_ARG(2, 1));
+}
+
+/*
+ * class LZ4::SeekableDecoder
+ */
+
+struct seekable_decoder
 {
   LZ4F_dctx *lz4f;
-  mrb_value predict;
-  mrb_value inport;
-  mrb_value inbuf;
-  mrb_int inoff;
-  mrb_int inbufsize;
+  mrb_value input; /* ivar "mruby-lz4.inport" で保持する */
+  int fd;          /* pread(2) で読み込む場合のファイル記述子。それ以外は -1 */
+  uint64_t insize;
+  mrb_value dicts;
+  size_t nframes;
+  uint64_t *offsets; /* フレームごとの圧縮後と伸長後の開始位置の組 (nframes + 1 組) */
+  size_t cached;     /* ivar "mruby-lz4.outbuf" に伸長済みのフレーム番号 + 1 (なければ 0) */
+  mrb_bool dictready;
+  uint32_t dictid;
+  const char *dict; /* ivar "mruby-lz4.dictionary" で保持する */
+  size_t dictsize;
+  mrb_bool trusted; /* チェックサムを確かめない */
 };
 
 static void
-decoder_free(MRB, struct decoder *p)
+seekable_decoder_free(MRB, struct seekable_decoder *p)
 {
   if (p->lz4f) {
     LZ4F_freeDecompressionContext(p->lz4f);
   }
 
+  mrb_free(mrb, p->offsets);
   mrb_free(mrb, p);
 }
 
-static const mrb_data_type decoder_type = {
-  .struct_name = "mruby-lz4.decoder",
-  .dfree = (void (*)(mrb_state *, void *))decoder_free,
+static const mrb_data_type seekable_decoder_type = {
+  .struct_name = "mruby-lz4.seekable_decoder",
+  .dfree = (void (*)(mrb_state *, void *))seekable_decoder_free,
 };
 
-static struct decoder *
-getdecoder(MRB, mrb_value self)
+static struct seekable_decoder *
+get_seekable_decoder(MRB, mrb_value self)
 {
-  struct decoder *p;
-  Data_Get_Struct(mrb, self, &decoder_type, p);
+  struct seekable_decoder *p;
+  Data_Get_Struct(mrb, self, &seekable_decoder_type, p);
+  if (!p->offsets) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized LZ4::SeekableDecoder");
+  }
   return p;
 }
 
-static mrb_value
-decoder_set_predict(MRB, mrb_value self, struct decoder *p, mrb_value predict)
+/*
+ * 入力の offset から size バイトを読み込み、その先頭を返す。
+ *
+ * 入力が文字列であれば直接参照し、それ以外は ivar "mruby-lz4.inbuf" へ読み込む。
+ */
+static const char *
+seekdec_load(MRB, mrb_value self, struct seekable_decoder *p, uint64_t offset, size_t size)
 {
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.predict"), predict);
-  p->predict = predict;
-  return predict;
+  if (offset > p->insize || size > p->insize - offset) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of input");
+  }
+
+  if (mrb_string_p(p->input)) {
+    return RSTRING_PTR(p->input) + offset;
+  }
+
+  mrb_sym id = mrb_intern_lit(mrb, "mruby-lz4.inbuf");
+  mrb_value buf;
+  if (p->fd >= 0) {
+    buf = aux_str_alloc(mrb, mrb_iv_get(mrb, self, id), size);
+    mrb_iv_set(mrb, self, id, buf);
+    int64_t n = aux_fd_pread(p->fd, RSTRING_PTR(buf), size, (int64_t)offset);
+    if (n < 0) {
+      int err = errno;
+      mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, buf), 0);
+      aux_sys_fail(mrb, err, "pread");
+    }
+    mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, buf), n);
+  } else {
+    mrb_value argv[] = { aux_int_value(mrb, (mrb_int)size), aux_int_value(mrb, (mrb_int)offset) };
+    buf = mrb_funcall_argv(mrb, p->input, mrb_intern_lit(mrb, "pread"), 2, argv);
+    mrb_check_type(mrb, buf, MRB_TT_STRING);
+    mrb_iv_set(mrb, self, id, buf);
+  }
+
+  if ((size_t)RSTRING_LEN(buf) < size) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of input");
+  }
+
+  return RSTRING_PTR(buf);
 }
 
-static mrb_value
-decoder_set_inport(MRB, mrb_value self, struct decoder *p, mrb_value port)
+/*
+ * 入力の末尾からシークテーブルを読み込み、各フレームの開始位置を求める。
+ */
+static void
+seekdec_read_table(MRB, mrb_value self, struct seekable_decoder *p)
 {
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.inport"), port);
-  p->inport = port;
-  return port;
+  if (p->insize < 8 + AUX_SEEKABLE_FOOTER_SIZE) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "seek table is not found");
+  }
+
+  const char *foot = seekdec_load(mrb, self, p, p->insize - AUX_SEEKABLE_FOOTER_SIZE, AUX_SEEKABLE_FOOTER_SIZE);
+  uint32_t nframes = aux_load_u32le(foot);
+  uint8_t desc = (uint8_t)foot[4];
+  if (aux_load_u32le(foot + 5) != AUX_SEEKABLE_MAGIC) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "seek table is not found");
+  }
+  if (desc & 0x7c) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "unsupported seek table (reserved bits are set)");
+  }
+
+  /* NOTE: チェックサム付きのシークテーブルも読めるが、チェックサムは確かめない (フレーム自体のチェックサムに任せる) */
+  size_t esize = (desc & AUX_SEEKABLE_CHECKSUM_FLAG) ? 12 : AUX_SEEKABLE_ENTRY_SIZE;
+  uint64_t tabsize = 8 + (uint64_t)nframes * esize + AUX_SEEKABLE_FOOTER_SIZE;
+  if (tabsize > p->insize || tabsize > AUX_STR_MAX) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "broken seek table (too many frames)");
+  }
+
+  const char *tab = seekdec_load(mrb, self, p, p->insize - tabsize, (size_t)tabsize);
+  if (aux_load_u32le(tab) != AUX_SEEKABLE_SKIPPABLE_MAGIC || aux_load_u32le(tab + 4) != tabsize - 8) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "broken seek table (wrong skippable frame)");
+  }
+
+  uint64_t *offsets = (uint64_t *)mrb_calloc(mrb, (size_t)nframes + 1, 2 * sizeof(uint64_t));
+  p->offsets = offsets;
+
+  const char *e = tab + 8;
+  size_t i;
+  for (i = 0; i < nframes; i++, e += esize) {
+    offsets[i * 2 + 2] = offsets[i * 2 + 0] + aux_load_u32le(e);
+    offsets[i * 2 + 3] = offsets[i * 2 + 1] + aux_load_u32le(e + 4);
+  }
+
+  if (offsets[nframes * 2] != p->insize - tabsize) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "broken seek table (frame sizes do not match the input)");
+  }
+
+  p->nframes = nframes;
 }
 
-static mrb_value
-decoder_set_inbuf(MRB, mrb_value obj, struct decoder *p, mrb_value buf)
+/*
+ * i 番目のフレームを dest へ伸長する。dest はフレームの伸長後の長さを持つこと。
+ */
+static void
+seekdec_decode_frame(MRB, mrb_value self, struct seekable_decoder *p, size_t i, char *dest)
 {
-  p->inbuf = buf;
-  mrb_iv_set(mrb, obj, mrb_intern_lit(mrb, "mruby-lz4.inbuf"), buf);
-  return buf;
-}
+  uint64_t inoff = p->offsets[i * 2];
+  size_t insize = (size_t)(p->offsets[i * 2 + 2] - inoff);
+  size_t outsize = (size_t)(p->offsets[i * 2 + 3] - p->offsets[i * 2 + 1]);
+  const char *src = seekdec_load(mrb, self, p, inoff, insize);
+
+  LZ4F_resetDecompressionContext(p->lz4f);
+  LZ4F_frameInfo_t info;
+  size_t inpos = insize;
+  size_t s = LZ4F_getFrameInfo(p->lz4f, &info, src, &inpos);
+  aux_lz4f_check_error(mrb, s, "LZ4F_getFrameInfo");
+
+  if (!p->dictready || p->dictid != info.dictID) {
+    mrb_value dict = aux_lz4f_select_dict(mrb, p->dicts, info.dictID);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.dictionary"), dict);
+    aux_lz4f_dict_data(mrb, dict, &p->dict, &p->dictsize);
+    p->dictid = info.dictID;
+    p->dictready = TRUE;
+  }
+
+  LZ4F_decompressOptions_t opts = { .stableDst = 1, .skipChecksums = p->trusted, };
+  size_t outpos = 0;
+  while (s != 0) {
+    size_t destsize = outsize - outpos;
+    size_t srcsize = insize - inpos;
+    s = LZ4F_decompress_usingDict(p->lz4f, dest + outpos, &destsize, src + inpos, &srcsize, p->dict, p->dictsize, &opts);
+    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
+    outpos += destsize;
+    inpos += srcsize;
+
+    if (s != 0 && destsize == 0 && srcsize == 0) { break; }
+  }
 
+  if (s != 0 || outpos != outsize || inpos != insize) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR,
+               "frame does not match the seek table (frame #%S)",
+               aux_int_value(mrb, (mrb_int)i));
+  }
+}
 
 /*
  * call-seq:
- *  new(inport)
+ *  new(input, opts = {})
+ *
+ * Read the output of LZ4::SeekableEncoder at random positions.
+ *
+ * [input]
+ *
+ *  String, File (IO with a file descriptor), or any object which has
+ *  +pread(length, offset)+ and +size+ methods.
+ *
+ * [opts (hash)]
+ *
+ *  dictionary, trusted::
+ *
+ *      same as LZ4::Decoder.new.
  */
 static mrb_value
-dec_s_new(MRB, mrb_value self)
+sdec_s_new(MRB, mrb_value self)
 {
-  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &decoder_type);
-  struct decoder *p = (struct decoder *)mrb_calloc(mrb, 1, sizeof(struct decoder));
+  struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &seekable_decoder_type);
+  struct seekable_decoder *p = (struct seekable_decoder *)mrb_calloc(mrb, 1, sizeof(struct seekable_decoder));
   rd->data = p;
 
   LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&p->lz4f, LZ4F_VERSION);
   aux_lz4f_check_error(mrb, err, "LZ4F_createDecompressionContext");
-  p->inport = Qnil;
-  p->inbuf = Qnil;
-  p->inbufsize = MIN(1 << 20, AUX_STR_MAX); /* AUX_STR_MAX or 1 MiB */
+  p->input = Qnil;
+  p->fd = -1;
+  p->dicts = Qnil;
 
   mrb_int argc;
   mrb_value *argv;
@@ -862,167 +4553,180 @@ dec_s_new(MRB, mrb_value self)
   return mrb_obj_value(rd);
 }
 
-/*
- * call-seq:
- *  initialize(inport, opts = {})
- *
- * [opts (hash)]
- *
- *  predict (string OR nil)::
- *
- *      decompress with dictionary.
- */
 static mrb_value
-dec_initialize(MRB, mrb_value self)
+sdec_initialize(MRB, mrb_value self)
 {
-  struct decoder *p = getdecoder(mrb, self);
-  mrb_value port, predict, opts;
-  switch (mrb_get_args(mrb, "o|H", &port, &opts)) {
-  case 1:
-    predict = Qnil;
-    break;
-  case 2:
-    MRBX_SCANHASH(mrb, opts, Qnil,
-        MRBX_SCANHASH_ARGS("predict", &predict, Qnil));
-    if (!NIL_P(predict)) { mrb_check_type(mrb, predict, MRB_TT_STRING); }
-    break;
-  default:
-    AUX_NOT_REACHED_HERE;
-  }
-
-  decoder_set_inport(mrb, self, p, port);
-  decoder_set_predict(mrb, self, p, predict);
-
-  if (mrb_string_p(p->inport)) {
-    decoder_set_inbuf(mrb, self, p, port);
-    p->inbufsize = -1;
+  struct seekable_decoder *p;
+  Data_Get_Struct(mrb, self, &seekable_decoder_type, p);
+  mrb_value input, opts = Qnil;
+  mrb_get_args(mrb, "o|H", &input, &opts);
+
+  p->trusted = FALSE;
+  p->dicts = (NIL_P(opts) ? Qnil : dec_initialize_predict(mrb, opts, &p->trusted));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.predict"), p->dicts);
+  p->fd = -1;
+  p->cached = 0;
+  p->dictready = FALSE;
+  mrb_free(mrb, p->offsets);
+  p->offsets = NULL;
+  p->nframes = 0;
+
+  if (mrb_string_p(input)) {
+    if (!MRB_FROZEN_P(RSTRING(input))) {
+      /* NOTE: シークテーブルを読んだ後に書き換えられないように複製する */
+      input = mrb_str_dup(mrb, input);
+      MRB_SET_FROZEN_FLAG(mrb_obj_ptr(input));
+    }
+    p->insize = RSTRING_LEN(input);
   } else {
-    p->inbufsize = AUX_LZ4_DEFAULT_PARTIAL_SIZE;
-  }
-
-  return self;
-}
-
-static int
-dec_read_fetch(MRB, mrb_value self, struct decoder *p)
-{
-  if (p->inoff >= RSTRING_LEN(p->inbuf)) {
-    if (p->inbufsize < 1) { p->inbufsize = 0; return -1; }
-
-    mrb_value v = FUNCALL(mrb, p->inport, mrb_intern_lit(mrb, "read"), mrb_fixnum_value(p->inbufsize), p->inbuf);
-    if (NIL_P(v)) { p->inbufsize = 0; return -1; }
-    mrb_check_type(mrb, v, MRB_TT_STRING);
-    if (RSTRING_LEN(v) < 1) { p->inbufsize = 0; return -1; }
-    if (mrb_obj_eq(mrb, v, p->inbuf)) {
-      decoder_set_inbuf(mrb, self, p, v);
+    int64_t off;
+    int fd = aux_io_raw_fileno(mrb, input, &off);
+    if (fd >= 0 && off >= 0) {
+      int64_t size = aux_fd_size(fd);
+      if (size < 0) { aux_sys_fail(mrb, errno, "fstat"); }
+      p->fd = fd;
+      p->insize = (uint64_t)size;
+    } else if (mrb_respond_to(mrb, input, mrb_intern_lit(mrb, "pread")) &&
+               mrb_respond_to(mrb, input, mrb_intern_lit(mrb, "size"))) {
+      p->insize = aux_to_u64(mrb, mrb_funcall_argv(mrb, input, mrb_intern_lit(mrb, "size"), 0, NULL));
+    } else {
+      mrb_raisef(mrb, E_TYPE_ERROR,
+                 "wrong input - %S (expect String, File or an object with pread and size)",
+                 input);
     }
-
-    p->inoff = 0;
   }
 
-  return 0;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.inport"), input);
+  p->input = input;
+  seekdec_read_table(mrb, self, p);
+
+  return self;
 }
 
 /*
  * call-seq:
- *  read(size = nil, dest = "") -> dest
+ *  pread(offset, length, dest = "") -> dest or nil
+ *
+ * Read up to length bytes of the decompressed data from offset.
+ * Only the frames that overlap the range are decompressed.
+ *
+ * Return nil if offset is at (or beyond) the end.
  */
 static mrb_value
-dec_read(MRB, mrb_value self)
+sdec_pread(MRB, mrb_value self)
 {
-  struct decoder *p = getdecoder(mrb, self);
-  intptr_t size;
-  struct RString *dest;
-  common_read_args(mrb, &size, &dest);
-  if (size == 0) { return mrb_obj_value(dest); }
+  struct seekable_decoder *p = get_seekable_decoder(mrb, self);
+  mrb_int off, len;
+  mrb_value buf = Qnil;
+  mrb_get_args(mrb, "ii|S!", &off, &len, &buf);
 
-  int arena = mrb_gc_arena_save(mrb);
+  if (off < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative offset - %S", mrb_fixnum_value(off));
+  }
+  if (len < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length - %S", mrb_fixnum_value(len));
+  }
 
-  while (size < 0 || RSTR_LEN(dest) < size) {
-    mrb_gc_arena_restore(mrb, arena);
+  uint64_t total = p->offsets[p->nframes * 2 + 1];
+  size_t want = 0;
+  if ((uint64_t)off < total) {
+    want = (size_t)MIN((uint64_t)len, total - (uint64_t)off);
+    want = MIN(want, AUX_STR_MAX);
+  } else if (len > 0) {
+    return Qnil;
+  }
 
-    if (dec_read_fetch(mrb, self, p) < 0) {
-      break;
-    }
+  struct RString *dest = mrbx_str_force_recycle(mrb, (NIL_P(buf) ? NULL : mrbx_str_ptr(mrb, buf)), want);
+  mrbx_str_set_len(mrb, dest, 0);
+  if (want == 0) { return mrb_obj_value(dest); }
 
-    const char *srcp = RSTRING_PTR(p->inbuf) + p->inoff;
-    size_t srcsize = RSTRING_LEN(p->inbuf) - p->inoff;
-    char *destp = RSTR_PTR(dest) + RSTR_LEN(dest);
-    size_t destsize = (size < 0 ? RSTR_CAPA(dest) : size) - RSTR_LEN(dest);
-    size_t s = LZ4F_decompress(p->lz4f, destp, &destsize, srcp, &srcsize, NULL);
-    p->inoff += srcsize;
-    RSTR_SET_LEN(dest, RSTR_LEN(dest) + destsize);
-    aux_lz4f_check_error(mrb, s, "LZ4F_decompress");
-    if (s == 0 || RSTR_LEN(dest) >= AUX_STR_MAX) {
-      break;
-    }
+  /* NOTE: 伸長後の開始位置が off 以下となる最後のフレームを探す (空のフレームは飛ばされる) */
+  size_t lo = 0, hi = p->nframes;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p->offsets[mid * 2 + 1] <= (uint64_t)off) { lo = mid; } else { hi = mid; }
+  }
 
-    if (size < 0 && RSTR_LEN(dest) >= RSTR_CAPA(dest)) {
-      size_t capa = RSTR_CAPA(dest) + AUX_LZ4_DEFAULT_PARTIAL_SIZE;
-      capa = MIN(capa, AUX_STR_MAX);
-      mrbx_str_reserve(mrb, dest, capa);
+  uint64_t pos = (uint64_t)off;
+  size_t i;
+  for (i = lo; (size_t)RSTR_LEN(dest) < want; i++) {
+    uint64_t fstart = p->offsets[i * 2 + 1];
+    size_t flen = (size_t)(p->offsets[i * 2 + 3] - fstart);
+    size_t skip = (size_t)(pos - fstart);
+    size_t n = MIN(flen - skip, want - RSTR_LEN(dest));
+    if (n < 1) { continue; }
+
+    if (skip == 0 && n == flen) {
+      seekdec_decode_frame(mrb, self, p, i, RSTR_PTR(dest) + RSTR_LEN(dest));
+    } else {
+      /* NOTE: 一部だけが必要なフレームは一時バッファへ伸長し、続けて同じフレームを読む場合に再利用する */
+      mrb_sym id = mrb_intern_lit(mrb, "mruby-lz4.outbuf");
+      mrb_value tmp = mrb_iv_get(mrb, self, id);
+      if (p->cached != i + 1) {
+        p->cached = 0;
+        tmp = aux_str_alloc(mrb, tmp, flen);
+        mrb_iv_set(mrb, self, id, tmp);
+        seekdec_decode_frame(mrb, self, p, i, RSTRING_PTR(tmp));
+        mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, tmp), flen);
+        p->cached = i + 1;
+      }
+      memcpy(RSTR_PTR(dest) + RSTR_LEN(dest), RSTRING_PTR(tmp) + skip, n);
     }
-  }
 
-  if (RSTR_LEN(dest) > 0) {
-    return mrb_obj_value(dest);
-  } else {
-    return Qnil;
+    RSTR_SET_LEN(dest, RSTR_LEN(dest) + n);
+    pos += n;
   }
+
+  return mrb_obj_value(dest);
 }
 
 /*
  * call-seq:
- *  close -> nil
+ *  size -> integer
+ *
+ * Return the total length of the decompressed data.
  */
 static mrb_value
-dec_close(MRB, mrb_value self)
+sdec_get_size(MRB, mrb_value self)
 {
-  getdecoder(mrb, self)->inbufsize = 0;
-
-  return Qnil;
+  struct seekable_decoder *p = get_seekable_decoder(mrb, self);
+  return aux_int_value(mrb, (mrb_int)p->offsets[p->nframes * 2 + 1]);
 }
 
 /*
  * call-seq:
- *  eof -> true OR false
+ *  frames -> integer
+ *
+ * Return the number of the frames recorded in the seek table.
  */
 static mrb_value
-dec_eof(MRB, mrb_value self)
+sdec_get_frames(MRB, mrb_value self)
 {
-  if (getdecoder(mrb, self)->inbufsize > 0) {
-    return Qfalse;
-  } else {
-    return Qtrue;
-  }
+  return aux_int_value(mrb, (mrb_int)get_seekable_decoder(mrb, self)->nframes);
 }
 
 /*
  * call-seq:
- *  port -> inport
+ *  port -> input
  */
 static mrb_value
-dec_get_port(MRB, mrb_value self)
+sdec_get_port(MRB, mrb_value self)
 {
-  return getdecoder(mrb, self)->inport;
+  return get_seekable_decoder(mrb, self)->input;
 }
 
 static void
-init_decoder(MRB, struct RClass *mLZ4)
+init_seekable_decoder(MRB, struct RClass *mLZ4)
 {
-  struct RClass *cDecoder = mrb_define_class_under(mrb, mLZ4, "Decoder", mrb_cObject);
-  MRB_SET_INSTANCE_TT(cDecoder, MRB_TT_DATA);
-
-  mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
-  mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
-  mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
-  mrb_define_method(mrb, cDecoder, "read", dec_read, MRB_ARGS_ANY());
-  mrb_define_method(mrb, cDecoder, "close", dec_close, MRB_ARGS_NONE());
-  mrb_define_method(mrb, cDecoder, "eof", dec_eof, MRB_ARGS_NONE());
-  mrb_define_method(mrb, cDecoder, "port", dec_get_port, MRB_ARGS_NONE());
-
-  mrb_define_alias(mrb, cDecoder, "finish", "close");
-  mrb_define_alias(mrb, cDecoder, "eof?", "eof");
+  struct RClass *cSeekableDecoder = mrb_define_class_under(mrb, mLZ4, "SeekableDecoder", mrb_cObject);
+  MRB_SET_INSTANCE_TT(cSeekableDecoder, MRB_TT_DATA);
+
+  mrb_define_class_method(mrb, cSeekableDecoder, "new", sdec_s_new, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cSeekableDecoder, "initialize", sdec_initialize, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, cSeekableDecoder, "pread", sdec_pread, MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, cSeekableDecoder, "size", sdec_get_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cSeekableDecoder, "frames", sdec_get_frames, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cSeekableDecoder, "port", sdec_get_port, MRB_ARGS_NONE());
 }
 
 /*
@@ -1059,6 +4763,12 @@ aux_LZ4_resetStreamHC(void *cx, int level)
   LZ4_resetStreamHC((LZ4_streamHC_t *)cx, level);
 }
 
+static void
+aux_LZ4_resetStreamHC_fast(void *cx, int level)
+{
+  LZ4_resetStreamHC_fast((LZ4_streamHC_t *)cx, level);
+}
+
 static int
 aux_LZ4_loadDictHC(void *cx, const char *predict, size_t dictsize)
 {
@@ -1085,6 +4795,13 @@ struct block_encoder_traits
   int (*load_dict)(void *, const char *, size_t);
   int (*save_dict)(void *, char *, size_t);
   int (*compress_continue)(void *, const char *, char *, size_t, size_t, int);
+  /*
+   * 一度 reset_stream() で初期化した状態を、reset_stream() と同じ圧縮結果となるように再初期化する。
+   *
+   * NOTE: LZ4_resetStream_fast() は残ったハッシュ表によって圧縮結果が変わるため使わない。
+   *       LZ4_resetStreamHC_fast() は以前の位置を全て窓の外に置くため、結果は変わらない。
+   */
+  void (*renew_stream)(void *, int);
 };
 
 static const struct
@@ -1092,8 +4809,59 @@ static const struct
   struct block_encoder_traits fast;
   struct block_encoder_traits hc;
 } block_encoder_traits = {
-  { "LZ4_compress_fast_continue", sizeof(LZ4_stream_t), aux_LZ4_resetStream, aux_LZ4_loadDict, aux_LZ4_saveDict, aux_LZ4_compress_fast_continue },
-  { "LZ4_compress_HC_continue", sizeof(LZ4_streamHC_t), aux_LZ4_resetStreamHC, aux_LZ4_loadDictHC, aux_LZ4_saveDictHC, aux_LZ4_compress_HC_continue },
+  { "LZ4_compress_fast_continue", sizeof(LZ4_stream_t), aux_LZ4_resetStream, aux_LZ4_loadDict, aux_LZ4_saveDict, aux_LZ4_compress_fast_continue, aux_LZ4_resetStream },
+  { "LZ4_compress_HC_continue", sizeof(LZ4_streamHC_t), aux_LZ4_resetStreamHC, aux_LZ4_loadDictHC, aux_LZ4_saveDictHC, aux_LZ4_compress_HC_continue, aux_LZ4_resetStreamHC_fast },
+};
+
+/*
+ * 連結ブロックの履歴の持ち方。
+ *
+ * BLOCK_ENCODER_COPY::
+ *    ブロックごとに LZ4_saveDict() で prefix に複写する (prefix_capacity が 64 KiB 未満の場合)。
+ * BLOCK_ENCODER_RING::
+ *    入力を prefix (環状バッファ) に複写してから圧縮し、履歴をそのまま残す。
+ *    環状バッファに入らない大きなブロックは BLOCK_ENCODER_COPY と同様に処理する。
+ * BLOCK_ENCODER_STABLE::
+ *    呼び出し元が以前の入力を変更しないことを約束し、入力から直接圧縮する。
+ */
+enum block_encoder_history
+{
+  BLOCK_ENCODER_COPY,
+  BLOCK_ENCODER_RING,
+  BLOCK_ENCODER_STABLE,
+};
+
+/*
+ * 環状バッファは 64 KiB の履歴に加えて、二つ分のブロックが収まる大きさにする。
+ * 折り返した直後のブロックが 64 KiB の履歴と重ならないようにするため。
+ */
+#define AUX_LZ4_RING_BLOCK_MAX (32L << 10)
+#define AUX_LZ4_RING_CAPACITY (AUX_LZ4_PREFIX_MAX_CAPACITY + 2 * AUX_LZ4_RING_BLOCK_MAX)
+
+/*
+ * 適応モードで移動する圧縮レベルの段階 (速い順)。
+ * 負の値は LZ4_compress_fast_continue() の acceleration、0 以上は LZ4HC の level となる。
+ */
+static const int block_encoder_ladder[] = { -64, -32, -16, -8, -4, -2, -1, 1, 3, 6, 9, 12 };
+#define BLOCK_ENCODER_LADDER_LENGTH ((int)(sizeof(block_encoder_ladder) / sizeof(block_encoder_ladder[0])))
+
+/* 処理速度を判定する間隔 (入力の長さ) */
+#define AUX_LZ4_ADAPT_WINDOW (256L << 10)
+/* 圧縮レベルを下げた後、上げるのを控える判定の回数 */
+#define AUX_LZ4_ADAPT_HOLD 8
+
+struct block_encoder_adaptive
+{
+  double target; /* 目標とする処理速度 (MB/s、すなわちバイト毎マイクロ秒)。0 であれば適応モードではない */
+  int rank;      /* block_encoder_ladder の位置 */
+  int minrank;
+  int maxrank;
+  int hold;
+  uint64_t bytes; /* 次の判定までに圧縮した長さ */
+  uint64_t usec;  /* 次の判定までに圧縮に費やした時間 */
+  double speed;   /* 直前の判定での処理速度 (MB/s)。未計測であれば負の値 */
+  size_t backlog; /* 呼び出し元が報告した未処理の長さ */
+  size_t lastbacklog;
 };
 
 struct block_encoder
@@ -1101,14 +4869,21 @@ struct block_encoder
   const struct block_encoder_traits *traits;
 
   int level;
+  enum block_encoder_history history;
 
   char *prefix;
-  size_t prefix_length;
+  size_t prefix_length; /* BLOCK_ENCODER_RING では次のブロックを置く位置 */
   size_t prefix_capacity;
 
   void *lz4;
+  size_t context_capacity; /* 適応モードでは LZ4_stream_t と LZ4_streamHC_t のどちらも収まる */
+
+  struct block_encoder_adaptive adaptive;
 
-  /* 直後の連続した領域に prefix と lz4 が確保される */
+  mrb_bool probe;
+  struct aux_probe_stats probestats;
+
+  /* 直後の連続した領域に lz4 と prefix が確保される */
 };
 
 static const mrb_data_type block_encoder_type = {
@@ -1129,13 +4904,99 @@ get_block_encoder(MRB, mrb_value self)
   return p;
 }
 
+/*
+ * level 以下で最も強い段階の位置を返す。
+ */
+static int
+block_encoder_rank(mrb_int level)
+{
+  if (level == 0) { level = LZ4HC_CLEVEL_DEFAULT; }
+
+  int i;
+  for (i = 1; i < BLOCK_ENCODER_LADDER_LENGTH && block_encoder_ladder[i] <= level; i++) { }
+
+  return i - 1;
+}
+
+static void
+blkenc_adaptive_args(MRB, struct block_encoder_adaptive *adaptive, mrb_int level, mrb_value target, mrb_value minlevel, mrb_value maxlevel)
+{
+  memset(adaptive, 0, sizeof(*adaptive));
+  adaptive->speed = -1;
+
+  if (NIL_P(target)) {
+    if (!NIL_P(minlevel) || !NIL_P(maxlevel)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "min_level and max_level need target_speed");
+    }
+
+    return;
+  }
+
+  adaptive->target = mrb_to_flo(mrb, target);
+  if (!(adaptive->target > 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "target_speed must be positive");
+  }
+
+  adaptive->minrank = 0;
+  if (!NIL_P(minlevel)) {
+    mrb_int min = mrb_int(mrb, minlevel);
+    adaptive->minrank = block_encoder_rank(min);
+    if (block_encoder_ladder[adaptive->minrank] < (min == 0 ? LZ4HC_CLEVEL_DEFAULT : min)) {
+      adaptive->minrank++;
+    }
+  }
+
+  adaptive->maxrank = (NIL_P(maxlevel) ? BLOCK_ENCODER_LADDER_LENGTH - 1 : block_encoder_rank(mrb_int(mrb, maxlevel)));
+
+  if (adaptive->minrank > adaptive->maxrank || adaptive->minrank >= BLOCK_ENCODER_LADDER_LENGTH) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "wrong min_level and max_level");
+  }
+
+  adaptive->rank = CLAMP(block_encoder_rank(level), adaptive->minrank, adaptive->maxrank);
+}
+
+/*
+ * 適応モードで level が min_level..max_level の範囲外であれば、
+ * 範囲内に収めた段階の圧縮レベルを返す。
+ */
+static mrb_int
+block_encoder_clamp_level(const struct block_encoder_adaptive *adaptive, mrb_int level)
+{
+  if (adaptive->target > 0) {
+    mrb_int lv = (level == 0 ? LZ4HC_CLEVEL_DEFAULT : level);
+    if (lv < block_encoder_ladder[adaptive->minrank] ||
+        lv > block_encoder_ladder[adaptive->maxrank]) {
+      return block_encoder_ladder[adaptive->rank];
+    }
+  }
+
+  return level;
+}
+
 static void
-blkenc_initialize_args(MRB, const struct block_encoder_traits **traits, mrb_int *level, struct RString **predict, mrb_int *precapa)
+blkenc_initialize_args(MRB, const struct block_encoder_traits **traits, mrb_int *level, struct RString **predict, mrb_int *precapa, enum block_encoder_history *history, struct block_encoder_adaptive *adaptive, mrb_bool *probe)
 {
   mrb_int argc;
   mrb_value *argv;
+  mrb_get_args(mrb, "*", &argv, &argc);
+
+  mrb_value stable = Qnil, target = Qnil, minlevel = Qnil, maxlevel = Qnil, aprobe = Qnil;
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
+                  MRBX_SCANHASH_ARGS("stable", &stable, Qnil),
+                  MRBX_SCANHASH_ARGS("target_speed", &target, Qnil),
+                  MRBX_SCANHASH_ARGS("min_level", &minlevel, Qnil),
+                  MRBX_SCANHASH_ARGS("max_level", &maxlevel, Qnil),
+                  MRBX_SCANHASH_ARGS("probe", &aprobe, Qnil));
+    argc--;
+  }
 
-  switch (mrb_get_args(mrb, "*", &argv, &argc)) {
+  *probe = mrb_test(aprobe);
+
+  switch (argc) {
   case 0:
     *level = convert_to_lz4_level(mrb, Qnil);
     *predict = NULL;
@@ -1160,6 +5021,9 @@ blkenc_initialize_args(MRB, const struct block_encoder_traits **traits, mrb_int
     mrbx_error_arity(mrb, argc, 0, 3);
   }
 
+  blkenc_adaptive_args(mrb, adaptive, *level, target, minlevel, maxlevel);
+  *level = block_encoder_clamp_level(adaptive, *level);
+
   if (*level < 0) {
     *traits = &block_encoder_traits.fast;
   } else {
@@ -1170,15 +5034,163 @@ blkenc_initialize_args(MRB, const struct block_encoder_traits **traits, mrb_int
     mrb_raise(mrb, E_RUNTIME_ERROR,
               "predict を指定されたが、prefix_capacity が小さすぎる");
   }
+
+  /*
+   * NOTE: RING と STABLE は LZ4 の窓 (64 KiB) 全体を履歴として参照するため、
+   *       prefix_capacity を制限した場合は COPY とする。
+   */
+  if (mrb_test(stable)) {
+    if (*precapa < AUX_LZ4_PREFIX_MAX_CAPACITY) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "stable: true can not be used with prefix_capacity less than 65536");
+    }
+    *history = BLOCK_ENCODER_STABLE;
+  } else if (*precapa < AUX_LZ4_PREFIX_MAX_CAPACITY) {
+    *history = BLOCK_ENCODER_COPY;
+  } else {
+    *history = BLOCK_ENCODER_RING;
+    *precapa = AUX_LZ4_RING_CAPACITY;
+  }
+}
+
+/*
+ * 履歴を prefix の先頭に保存する。
+ *
+ * LZ4_saveDict() と LZ4_saveDictHC() はストリームの状態も prefix に付け替えるため、
+ * 改めて辞書を読み込む必要はない。
+ */
+static void
+block_encoder_save_prefix(struct block_encoder *p)
+{
+  size_t capa = MIN(p->prefix_capacity, AUX_LZ4_PREFIX_MAX_CAPACITY);
+
+  if ((p->prefix_length = p->traits->save_dict(p->lz4, p->prefix, capa)) == 0) {
+    /* NOTE: 保存に失敗したため、リンクを切る */
+    p->traits->load_dict(p->lz4, NULL, 0);
+  }
+}
+
+/*
+ * 無圧縮で格納したブロックを、次のブロックが参照する履歴として読み込む。
+ *
+ * 圧縮しなかったブロックはストリームが知らないため、辞書として読み込み直して連結を保つ。
+ * 辞書の読み込みはそれ以前の履歴を捨てるため、環状バッファでは同じ周回の直前の入力も含める。
+ */
+static void
+block_encoder_load_stored(struct block_encoder *p, const char *src, size_t srclen, mrb_bool ring)
+{
+  const char *end = src + srclen;
+  const char *head = (ring ? p->prefix : src);
+  size_t len = MIN((size_t)(end - head), AUX_LZ4_PREFIX_MAX_CAPACITY);
+
+  p->traits->load_dict(p->lz4, end - len, len);
+}
+
+/*
+ * 連結を保ったまま圧縮レベルを変更する。
+ *
+ * fast と HC を切り替える場合は、履歴 (最大 64 KiB) を prefix の先頭に保存してから
+ * もう一方のストリームとして初期化し、保存した履歴を辞書として読み込み直す。
+ */
+static void
+block_encoder_switch(struct block_encoder *p, int level)
+{
+  const struct block_encoder_traits *traits = (level < 0 ? &block_encoder_traits.fast : &block_encoder_traits.hc);
+
+  if (traits != p->traits) {
+    size_t capa = MIN(p->prefix_capacity, AUX_LZ4_PREFIX_MAX_CAPACITY);
+    int len = p->traits->save_dict(p->lz4, p->prefix, capa);
+    if (len < 0) { len = 0; }
+
+    traits->reset_stream(p->lz4, level);
+    traits->load_dict(p->lz4, p->prefix, len);
+    p->traits = traits;
+    p->prefix_length = len;
+  } else if (traits == &block_encoder_traits.hc) {
+    LZ4_setCompressionLevel((LZ4_streamHC_t *)p->lz4, level);
+  }
+
+  p->level = level;
+}
+
+/*
+ * 圧縮したブロックの長さと時間を記録し、判定の間隔に達したら圧縮レベルを一段階動かす。
+ *
+ * 目標の速度を下回るか未処理の長さが増えていれば速い側へ、
+ * 目標の速度に十分な余裕があれば強い側へ移動する。
+ */
+static void
+block_encoder_adapt(struct block_encoder *p, size_t srclen, uint64_t usec)
+{
+  struct block_encoder_adaptive *a = &p->adaptive;
+
+  a->bytes += srclen;
+  a->usec += usec;
+  if (a->bytes < AUX_LZ4_ADAPT_WINDOW) { return; }
+
+  /* NOTE: 時計の分解能より短い時間で終わった場合は 1 µs とみなす */
+  a->speed = (double)a->bytes / (double)MAX(a->usec, 1);
+
+  int rank = a->rank;
+  if (a->speed < a->target || a->backlog > a->lastbacklog) {
+    if (rank > a->minrank) {
+      rank--;
+      a->hold = AUX_LZ4_ADAPT_HOLD;
+    }
+  } else if (a->hold > 0) {
+    a->hold--;
+  } else if (a->speed > a->target * 1.25 && rank < a->maxrank) {
+    rank++;
+  }
+
+  a->bytes = 0;
+  a->usec = 0;
+  a->lastbacklog = a->backlog;
+
+  if (rank != a->rank) {
+    a->rank = rank;
+    block_encoder_switch(p, block_encoder_ladder[rank]);
+  }
 }
 
+/*
+ * call-seq:
+ *  initialize(level = nil, predict = nil, prefix_capacity = nil, opts = {})
+ *
+ * [opts (hash)]
+ *
+ *  stable (true OR false)::
+ *
+ *      compress directly from the given strings, without copying history.
+ *      The caller must keep the previous source strings unchanged (the last 64 KiB).
+ *
+ *  target_speed (nil OR positive number)::
+ *
+ *      enable adaptive mode. Measure the throughput of each 256 KiB of input and
+ *      move the level one step toward faster (when below target MB/s or the backlog grows)
+ *      or stronger (when well above target).
+ *      Switching between fast and HC keeps the linked stream by carrying the history.
+ *
+ *  min_level (nil OR integer)::
+ *  max_level (nil OR integer)::
+ *
+ *      range of level in adaptive mode (-64 .. 12 by default).
+ *
+ *  probe (true OR false)::
+ *
+ *      check the magic number and the sampled entropy of each block before compression
+ *      (same as LZ4::BlockEncoder.encode). See also probe_stats.
+ */
 static mrb_value
 blkenc_initialize(MRB, mrb_value self)
 {
   mrb_int level, precapa;
   struct RString *predict;
   const struct block_encoder_traits *traits;
-  blkenc_initialize_args(mrb, &traits, &level, &predict, &precapa);
+  enum block_encoder_history history;
+  struct block_encoder_adaptive adaptive;
+  mrb_bool probe;
+  blkenc_initialize_args(mrb, &traits, &level, &predict, &precapa, &history, &adaptive, &probe);
 
   if (DATA_PTR(self) || DATA_TYPE(self)) {
     mrb_raisef(mrb, E_TYPE_ERROR,
@@ -1186,23 +5198,34 @@ blkenc_initialize(MRB, mrb_value self)
                self);
   }
 
+  /* NOTE: 適応モードでは fast と HC を切り替えるため、大きい方の領域を確保する */
+  size_t context_capacity = traits->context_size;
+  if (adaptive.target > 0) {
+    context_capacity = MAX(sizeof(LZ4_stream_t), sizeof(LZ4_streamHC_t));
+  }
+
   /* XXX: アライメントの考慮が必要なのかはわからない */
-  size_t size = sizeof(struct block_encoder) + traits->context_size + precapa;
+  size_t size = sizeof(struct block_encoder) + context_capacity + precapa;
 
   struct block_encoder *p = (struct block_encoder *)mrb_malloc(mrb, size);
 
-  memset(p, 0, size);
+  memset(p, 0, sizeof(*p));
   p->traits = traits;
   p->level = level;
+  p->history = history;
   p->lz4 = (void *)((char *)p + sizeof(*p));
-  p->prefix = (char *)p + traits->context_size;
+  p->context_capacity = context_capacity;
+  p->prefix = (char *)p->lz4 + context_capacity;
   p->prefix_capacity = precapa;
+  p->adaptive = adaptive;
+  p->probe = probe;
 
+  memset(p->lz4, 0, context_capacity);
   traits->reset_stream(p->lz4, level);
 
   if (predict) {
     traits->load_dict(p->lz4, RSTR_PTR(predict), RSTR_LEN(predict));
-    traits->save_dict(p->lz4, p->prefix, p->prefix_capacity);
+    block_encoder_save_prefix(p);
   }
 
   mrb_data_init(self, p, &block_encoder_type);
@@ -1236,7 +5259,9 @@ blkenc_reset_args(MRB, mrb_value self, struct block_encoder **p, mrb_int *level,
     mrbx_error_arity(mrb, argc, 0, 2);
   }
 
-  if ((*level < 0 && (*p)->level >= 0) || (*level >= 0 && (*p)->level < 0)) {
+  /* NOTE: 適応モードであれば fast と HC のどちらにも切り替えられる */
+  const struct block_encoder_traits *traits = (*level < 0 ? &block_encoder_traits.fast : &block_encoder_traits.hc);
+  if (traits->context_size > (*p)->context_capacity) {
     mrb_raise(mrb, E_ARGUMENT_ERROR,
               "wrong level (both encoder level and argument level are make up the number sign)");
   }
@@ -1250,23 +5275,37 @@ blkenc_reset(MRB, mrb_value self)
   struct block_encoder *p;
   blkenc_reset_args(mrb, self, &p, &level, &dict);
 
+  if (p->adaptive.target > 0) {
+    struct block_encoder_adaptive *a = &p->adaptive;
+    a->rank = CLAMP(block_encoder_rank(level), a->minrank, a->maxrank);
+    a->hold = 0;
+    a->bytes = 0;
+    a->usec = 0;
+    a->speed = -1;
+    a->backlog = 0;
+    a->lastbacklog = 0;
+    level = block_encoder_clamp_level(a, level);
+  }
+
+  p->traits = (level < 0 ? &block_encoder_traits.fast : &block_encoder_traits.hc);
   p->traits->reset_stream(p->lz4, level);
   p->level = level;
+  p->prefix_length = 0;
 
   if (dict) {
     p->traits->load_dict(p->lz4, RSTR_PTR(dict), RSTR_LEN(dict));
-    p->traits->save_dict(p->lz4, p->prefix, p->prefix_capacity);
+    block_encoder_save_prefix(p);
   }
 
   return self;
 }
 
 static void
-blkenc_encode_args(MRB, mrb_value self, struct block_encoder **p, char **srcp, mrb_int *srclen, mrb_int *maxdest, struct RString **dest)
+blkenc_encode_args(MRB, mrb_value self, struct block_encoder **p, mrb_value *src, mrb_int *maxdest, struct RString **dest)
 {
   mrb_int argc;
   mrb_value *argv;
-  mrb_get_args(mrb, "s*", srcp, srclen, &argv, &argc);
+  mrb_get_args(mrb, "S*", src, &argv, &argc);
 
   switch (argc) {
   case 0:
@@ -1286,7 +5325,7 @@ blkenc_encode_args(MRB, mrb_value self, struct block_encoder **p, char **srcp, m
   }
 
   if (*maxdest < 0) {
-    *maxdest = LZ4_compressBound(*srclen);
+    *maxdest = LZ4_compressBound(RSTRING_LEN(*src));
   }
 
   *dest = mrbx_str_force_recycle(mrb, *dest, *maxdest);
@@ -1297,33 +5336,140 @@ blkenc_encode_args(MRB, mrb_value self, struct block_encoder **p, char **srcp, m
 static mrb_value
 blkenc_encode(MRB, mrb_value self)
 {
-  char *srcp;
-  mrb_int srclen;
+  mrb_value src;
   struct RString *dest;
   mrb_int maxdest;
   struct block_encoder *p;
-  blkenc_encode_args(mrb, self, &p, &srcp, &srclen, &maxdest, &dest);
+  blkenc_encode_args(mrb, self, &p, &src, &maxdest, &dest);
 
-  int s = p->traits->compress_continue(p->lz4, srcp, RSTR_PTR(dest), srclen, maxdest, p->level);
+  const char *srcp = RSTRING_PTR(src);
+  mrb_int srclen = RSTRING_LEN(src);
+  mrb_bool ring = (p->history == BLOCK_ENCODER_RING && srclen <= AUX_LZ4_RING_BLOCK_MAX);
+  uint64_t start = (p->adaptive.target > 0 ? aux_clock_us() : 0);
 
-  if (s <= 0) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR,
-               "%S failed (code:%S)",
-               mrb_str_new_cstr(mrb, p->traits->compress_continue_name),
-               aux_int_value(mrb, s));
+  if (ring) {
+    if (p->prefix_length + srclen > p->prefix_capacity) {
+      p->prefix_length = 0;
+    }
+
+    /* NOTE: LZ4 は以前のブロックと重なる部分を履歴から外す */
+    char *ringp = p->prefix + p->prefix_length;
+    memcpy(ringp, srcp, srclen);
+    srcp = ringp;
+  }
+
+  int s = 0;
+
+  if (p->probe) {
+    enum aux_probe_result r = aux_probe(srcp, srclen);
+    if (r != AUX_PROBE_COMPRESSIBLE) {
+      s = (int)aux_lz4_store_block(RSTR_PTR(dest), maxdest, srcp, srclen);
+      if (s > 0) {
+        block_encoder_load_stored(p, srcp, srclen, ring);
+      } else {
+        r = AUX_PROBE_COMPRESSIBLE;
+      }
+    }
+    aux_probe_count(&p->probestats, r, srclen);
+  }
+
+  if (s == 0) {
+    s = p->traits->compress_continue(p->lz4, srcp, RSTR_PTR(dest), srclen, maxdest, p->level);
+
+    if (s <= 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR,
+                 "%S failed (code:%S)",
+                 mrb_str_new_cstr(mrb, p->traits->compress_continue_name),
+                 aux_int_value(mrb, s));
+    }
   }
   mrbx_str_set_len(mrb, dest, s);
 
-  if ((p->prefix_length = p->traits->save_dict(p->lz4, p->prefix, p->prefix_capacity)) == 0) {
-    /* NOTE: 保存に失敗したため、リンクを切る */
-    p->traits->load_dict(p->lz4, NULL, 0);
+  if (ring) {
+    p->prefix_length += srclen;
+  } else if (p->history == BLOCK_ENCODER_STABLE) {
+    /* NOTE: 次のブロックが参照する入力を GC から守る */
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "mruby-lz4.stable_src"), src);
   } else {
-    p->traits->load_dict(p->lz4, p->prefix, p->prefix_length);
+    block_encoder_save_prefix(p);
+  }
+
+  if (p->adaptive.target > 0) {
+    block_encoder_adapt(p, srclen, aux_clock_us() - start);
   }
 
   return mrb_obj_value(dest);
 }
 
+/*
+ * call-seq:
+ *  level -> integer
+ *
+ * current level. In adaptive mode, this is changed by encode.
+ */
+static mrb_value
+blkenc_get_level(MRB, mrb_value self)
+{
+  return mrb_fixnum_value(get_block_encoder(mrb, self)->level);
+}
+
+/*
+ * call-seq:
+ *  speed -> float OR nil
+ *
+ * throughput (MB/s) measured at the last adaptive decision.
+ * Return nil if not adaptive mode or not measured yet.
+ */
+static mrb_value
+blkenc_get_speed(MRB, mrb_value self)
+{
+  struct block_encoder *p = get_block_encoder(mrb, self);
+
+  if (p->adaptive.target > 0 && p->adaptive.speed >= 0) {
+    return mrb_float_value(mrb, p->adaptive.speed);
+  } else {
+    return Qnil;
+  }
+}
+
+/*
+ * call-seq:
+ *  backlog -> integer
+ *  backlog = size
+ *
+ * bytes waiting to be encoded, reported by the caller.
+ * In adaptive mode, if this grows between decisions, the level moves toward faster.
+ */
+static mrb_value
+blkenc_get_backlog(MRB, mrb_value self)
+{
+  return aux_int_value(mrb, get_block_encoder(mrb, self)->adaptive.backlog);
+}
+
+static mrb_value
+blkenc_set_backlog(MRB, mrb_value self)
+{
+  mrb_int size;
+  mrb_get_args(mrb, "i", &size);
+
+  get_block_encoder(mrb, self)->adaptive.backlog = (size < 0 ? 0 : size);
+
+  return mrb_fixnum_value(size);
+}
+
+/*
+ * call-seq:
+ *  probe_stats -> hash
+ *
+ * Statistics of probe: true since the encoder was created.
+ * See LZ4.probe_stats for the keys.
+ */
+static mrb_value
+blkenc_get_probe_stats(MRB, mrb_value self)
+{
+  return aux_probe_stats_value(mrb, &get_block_encoder(mrb, self)->probestats);
+}
+
 /*
  * call-seq:
  *  encode_size(src) -> unsigned integer (OR float)
@@ -1351,24 +5497,30 @@ blkenc_s_encode_size(MRB, mrb_value self)
 }
 
 static void
-blkenc_s_encode_args(MRB, struct RString **src, struct RString **dest, size_t *maxdest, int *level, struct RString **predict)
+blkenc_s_encode_args(MRB, struct RString **src, struct RString **dest, size_t *maxdest, int *level, struct RString **predict, mrb_bool *sized, mrb_bool *probe)
 {
   mrb_int argc;
   mrb_value *argv;
   mrb_get_args(mrb, "*", &argv, &argc);
   if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-    mrb_value alevel, apredict;
+    mrb_value alevel, apredict, asized, aprobe;
     MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
                   MRBX_SCANHASH_ARGS("level", &alevel, Qnil),
-                  MRBX_SCANHASH_ARGS("predict", &apredict, Qnil));
+                  MRBX_SCANHASH_ARGS("predict", &apredict, Qnil),
+                  MRBX_SCANHASH_ARGS("sized", &asized, Qfalse),
+                  MRBX_SCANHASH_ARGS("probe", &aprobe, Qfalse));
 
     *level = (NIL_P(alevel) ? -1 : mrb_int(mrb, alevel));
     *predict = RString(apredict);
+    *sized = mrb_test(asized);
+    *probe = mrb_test(aprobe);
 
     argc--;
   } else {
     *level = -1;
     *predict = NULL;
+    *sized = FALSE;
+    *probe = FALSE;
   }
 
   switch (argc) {
@@ -1403,7 +5555,7 @@ blkenc_s_encode_args(MRB, struct RString **src, struct RString **dest, size_t *m
   *src = RSTRING(argv[0]);
 
   if (*maxdest == -1) {
-    *maxdest = LZ4_compressBound(RSTR_LEN(*src));
+    *maxdest = LZ4_compressBound(RSTR_LEN(*src)) + (*sized ? AUX_LZ4_VARINT_MAX : 0);
   }
 
   if (*maxdest > AUX_STR_MAX) {
@@ -1434,6 +5586,18 @@ blkenc_s_encode_args(MRB, struct RString **src, struct RString **dest, size_t *m
  *  predict (string OR nil)::
  *
  *      compression with dictionary
+ *
+ *  sized (true OR false)::
+ *
+ *      put the source size (variable length integer, 1..5 bytes) before the block.
+ *      LZ4::BlockDecoder.decode with sized: true reads it and decompresses without scanning the block.
+ *      maxsize includes the size prefix.
+ *
+ *  probe (true OR false)::
+ *
+ *      check the magic number and the sampled entropy of src before compression.
+ *      If src looks already compressed, store it as literals without searching matches.
+ *      The statistics are counted in LZ4.probe_stats.
  */
 static mrb_value
 blkenc_s_encode(MRB, mrb_value self)
@@ -1441,46 +5605,376 @@ blkenc_s_encode(MRB, mrb_value self)
   struct RString *src, *dest, *predict;
   size_t maxdest;
   int level;
-  blkenc_s_encode_args(mrb, &src, &dest, &maxdest, &level, &predict);
+  mrb_bool sized, probe;
+  blkenc_s_encode_args(mrb, &src, &dest, &maxdest, &level, &predict, &sized, &probe);
+
+  size_t prefixlen = 0;
+  if (sized) {
+    char prefix[AUX_LZ4_VARINT_MAX];
+    prefixlen = aux_lz4_put_varint(prefix, RSTR_LEN(src));
+    if (prefixlen > maxdest) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "maxdest is too small for size prefix");
+    }
+    memcpy(RSTR_PTR(dest), prefix, prefixlen);
+  }
+
+  if (probe) {
+    enum aux_probe_result r = aux_probe(RSTR_PTR(src), RSTR_LEN(src));
+    size_t s = 0;
+    if (r != AUX_PROBE_COMPRESSIBLE) {
+      s = aux_lz4_store_block(RSTR_PTR(dest) + prefixlen, maxdest - prefixlen, RSTR_PTR(src), RSTR_LEN(src));
+    }
+
+    /* NOTE: maxsize に収まらなければ、通常どおり圧縮を試みる */
+    struct aux_probe_stats *stats = aux_scratch_probe_stats(mrb);
+    if (stats) { aux_probe_count(stats, (s > 0 ? r : AUX_PROBE_COMPRESSIBLE), RSTR_LEN(src)); }
+
+    if (s > 0) {
+      mrbx_str_set_len(mrb, dest, prefixlen + s);
+      return mrb_obj_value(dest);
+    }
+  }
 
   const struct block_encoder_traits *traits;
+  enum aux_scratch_slot slot;
 
   if (level < 0) {
     traits = &block_encoder_traits.fast;
+    slot = AUX_SCRATCH_FAST;
   } else {
     traits = &block_encoder_traits.hc;
+    slot = AUX_SCRATCH_HC;
   }
 
-  void *lz4 = mrb_malloc(mrb, traits->context_size);
-  traits->reset_stream(lz4, level);
+  void *lz4 = aux_scratch_take(mrb, slot);
+  traits->renew_stream(lz4, level);
   if (predict) {
     traits->load_dict(lz4, RSTR_PTR(predict), RSTR_LEN(predict));
   }
 
-  int s = traits->compress_continue(lz4, RSTR_PTR(src), RSTR_PTR(dest), RSTR_LEN(src), maxdest, level);
-  mrb_free(mrb, lz4);
+  int s = traits->compress_continue(lz4, RSTR_PTR(src), RSTR_PTR(dest) + prefixlen, RSTR_LEN(src), maxdest - prefixlen, level);
+  aux_scratch_give(mrb, slot, lz4);
   if (s <= 0) {
     mrb_raisef(mrb, E_RUNTIME_ERROR,
                "%S failed (code:%S)",
                mrb_str_new_cstr(mrb, traits->compress_continue_name),
                aux_int_value(mrb, s));
   }
-  mrbx_str_set_len(mrb, dest, s);
+  mrbx_str_set_len(mrb, dest, prefixlen + s);
 
   return mrb_obj_value(dest);
 }
 
+/*
+ * 一括処理 (encode_many / decode_many) の作業領域。
+ *
+ * 引数の解析と圧縮状態の確保は一括処理全体で一度だけ行う。
+ * 要素は AUX_LZ4_MANY_GROUP 個ずつ仕事に分けて、複数のスレッドで処理する。
+ * 出力は要素の順序どおりとなり、スレッド数によらない。
+ */
+struct lz4_many_item
+{
+  const char *src;
+  size_t srclen;
+  char *dest;
+  size_t destcapa;
+  int destlen; /* 失敗した場合は負の値 */
+};
+
+struct lz4_many
+{
+  mrb_value srcs; /* 文字列の配列、または区切られた一つの文字列 */
+  mrb_value offsets; /* srcs が一つの文字列の場合の区切り (要素数 + 1 個の整数) */
+  size_t nitems;
+  mrb_bool packed; /* 出力を一つの文字列と区切りの配列にまとめる */
+  int threads;
+  const char *predict;
+  size_t predictlen;
+
+  /* 要素ごとの出力の最大長を返す (圧縮・伸長ごとに異なる) */
+  size_t (*destcapa)(MRB, struct lz4_many *m, size_t index);
+  aux_parallel_job_f *job;
+  mrb_value sizes; /* 伸長後の長さ (伸長のみ) */
+
+  const struct block_encoder_traits *traits; /* 圧縮のみ */
+  int level;
+  void **states;
+  const char *failed_name;
+
+  struct lz4_many_item *items;
+
+  /* 直後の連続した領域に items, states, 圧縮状態が確保される */
+};
+
+#define AUX_LZ4_MANY_GROUP 32
+
+static void
+aux_lz4_many_args(MRB, struct lz4_many *m, mrb_value srcs, mrb_value threads, mrb_value packed, mrb_value predict)
+{
+  m->srcs = srcs;
+  m->threads = aux_lz4f_threads(mrb, threads);
+  m->packed = mrb_test(packed);
+
+  if (!NIL_P(predict)) {
+    mrb_check_type(mrb, predict, MRB_TT_STRING);
+    m->predict = RSTRING_PTR(predict);
+    m->predictlen = RSTRING_LEN(predict);
+  }
+
+  if (NIL_P(m->offsets)) {
+    mrb_check_type(mrb, srcs, MRB_TT_ARRAY);
+    m->nitems = RARRAY_LEN(srcs);
+
+    size_t i;
+    for (i = 0; i < m->nitems; i++) {
+      mrb_check_type(mrb, RARRAY_PTR(srcs)[i], MRB_TT_STRING);
+    }
+  } else {
+    mrb_check_type(mrb, srcs, MRB_TT_STRING);
+    mrb_check_type(mrb, m->offsets, MRB_TT_ARRAY);
+    if (RARRAY_LEN(m->offsets) < 1) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "offsets is empty");
+    }
+    m->nitems = RARRAY_LEN(m->offsets) - 1;
+
+    mrb_int prev = 0, i;
+    for (i = 0; i < RARRAY_LEN(m->offsets); i++) {
+      mrb_int off = mrb_int(mrb, RARRAY_PTR(m->offsets)[i]);
+      if (off < prev || off > RSTRING_LEN(srcs) || (i == 0 && off != 0)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong offsets (index %S)", aux_int_value(mrb, i));
+      }
+      prev = off;
+    }
+  }
+}
+
+static mrb_value
+aux_lz4_many_try(MRB, mrb_value arg)
+{
+  struct lz4_many *m = (struct lz4_many *)mrb_cptr(arg);
+  size_t i;
+
+  for (i = 0; i < m->nitems; i++) {
+    struct lz4_many_item *e = &m->items[i];
+
+    if (NIL_P(m->offsets)) {
+      mrb_value src = RARRAY_PTR(m->srcs)[i];
+      e->src = RSTRING_PTR(src);
+      e->srclen = RSTRING_LEN(src);
+    } else {
+      mrb_int off = mrb_int(mrb, RARRAY_PTR(m->offsets)[i]);
+      e->src = RSTRING_PTR(m->srcs) + off;
+      e->srclen = mrb_int(mrb, RARRAY_PTR(m->offsets)[i + 1]) - off;
+    }
+
+    e->destcapa = m->destcapa(mrb, m, i);
+  }
+
+  /* NOTE: 出力先は仕事を始める前に全て確保しておく (作業者スレッドでは確保できない) */
+  mrb_value dest;
+  int arena = mrb_gc_arena_save(mrb);
+  if (m->packed) {
+    uint64_t total = 0;
+    for (i = 0; i < m->nitems; i++) {
+      total += m->items[i].destcapa;
+    }
+    if (total > AUX_STR_MAX) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "packed output is too large");
+    }
+
+    dest = aux_str_buf_new(mrb, total);
+    char *p = RSTRING_PTR(dest);
+    for (i = 0; i < m->nitems; i++) {
+      m->items[i].dest = p;
+      p += m->items[i].destcapa;
+    }
+  } else {
+    dest = mrb_ary_new_capa(mrb, m->nitems);
+    arena = mrb_gc_arena_save(mrb);
+    for (i = 0; i < m->nitems; i++) {
+      mrb_value d = aux_str_buf_new(mrb, m->items[i].destcapa);
+      mrb_ary_push(mrb, dest, d);
+      m->items[i].dest = RSTRING_PTR(d);
+      mrb_gc_arena_restore(mrb, arena);
+    }
+  }
+
+  aux_parallel_run(m->threads, (m->nitems + AUX_LZ4_MANY_GROUP - 1) / AUX_LZ4_MANY_GROUP,
+                   m->job, m);
+
+  for (i = 0; i < m->nitems; i++) {
+    if (m->items[i].destlen < 0) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR,
+                 "%S failed (index %S)",
+                 mrb_str_new_cstr(mrb, m->failed_name),
+                 aux_int_value(mrb, i));
+    }
+  }
+
+  if (m->packed) {
+    mrb_value offsets = mrb_ary_new_capa(mrb, m->nitems + 1);
+    /* NOTE: dest と offsets を arena に残したまま、要素ごとの一時オブジェクトだけを捨てる */
+    arena = mrb_gc_arena_save(mrb);
+    char *p = RSTRING_PTR(dest);
+    size_t off = 0;
+    mrb_ary_push(mrb, offsets, aux_int_value(mrb, 0));
+    for (i = 0; i < m->nitems; i++) {
+      if (m->items[i].dest != p + off) {
+        memmove(p + off, m->items[i].dest, m->items[i].destlen);
+      }
+      off += m->items[i].destlen;
+      mrb_ary_push(mrb, offsets, aux_int_value(mrb, off));
+      mrb_gc_arena_restore(mrb, arena);
+    }
+    mrbx_str_set_len(mrb, RSTRING(dest), off);
+
+    mrb_value pair[2] = { dest, offsets };
+    return mrb_ary_new_from_values(mrb, 2, pair);
+  } else {
+    for (i = 0; i < m->nitems; i++) {
+      mrbx_str_set_len(mrb, RSTRING(RARRAY_PTR(dest)[i]), m->items[i].destlen);
+    }
+
+    return dest;
+  }
+}
+
+static mrb_value
+aux_lz4_many_ensure(MRB, mrb_value arg)
+{
+  struct lz4_many *m = (struct lz4_many *)mrb_cptr(arg);
+  mrb_free(mrb, m->items);
+  return Qnil;
+}
+
+/*
+ * 作業領域を確保して一括処理を行う。
+ */
+static mrb_value
+aux_lz4_many_run(MRB, struct lz4_many *m)
+{
+  size_t nstates = (m->traits ? (size_t)MAX(1, MIN((size_t)MAX(m->threads, 1), (m->nitems + AUX_LZ4_MANY_GROUP - 1) / AUX_LZ4_MANY_GROUP)) : 0);
+  size_t statesize = (m->traits ? AUX_ALIGN_UP(m->traits->context_size, 16) : 0);
+  size_t headsize = AUX_ALIGN_UP(sizeof(struct lz4_many_item) * m->nitems + sizeof(void *) * nstates, 16);
+
+  m->items = (struct lz4_many_item *)mrb_malloc(mrb, headsize + statesize * nstates);
+  m->states = (void **)(m->items + m->nitems);
+
+  size_t i;
+  for (i = 0; i < nstates; i++) {
+    m->states[i] = (char *)m->items + headsize + statesize * i;
+    m->traits->reset_stream(m->states[i], m->level);
+  }
+
+  return mrb_ensure(mrb,
+                    aux_lz4_many_try, mrb_cptr_value(mrb, m),
+                    aux_lz4_many_ensure, mrb_cptr_value(mrb, m));
+}
+
+static size_t
+lz4_many_encode_capa(MRB, struct lz4_many *m, size_t index)
+{
+  if (m->items[index].srclen > LZ4_MAX_INPUT_SIZE) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR,
+               "source is too large (index %S)", aux_int_value(mrb, index));
+  }
+
+  return LZ4_compressBound(m->items[index].srclen);
+}
+
+static void
+lz4_many_encode_job(void *user, int worker, size_t index)
+{
+  struct lz4_many *m = (struct lz4_many *)user;
+  void *lz4 = m->states[worker];
+  size_t i = index * AUX_LZ4_MANY_GROUP;
+  size_t end = MIN(i + AUX_LZ4_MANY_GROUP, m->nitems);
+
+  for (; i < end; i++) {
+    struct lz4_many_item *e = &m->items[i];
+
+    m->traits->renew_stream(lz4, m->level);
+    if (m->predict) {
+      m->traits->load_dict(lz4, m->predict, m->predictlen);
+    }
+
+    int s = m->traits->compress_continue(lz4, e->src, e->dest, e->srclen, e->destcapa, m->level);
+    e->destlen = (s > 0 ? s : -1);
+  }
+}
+
+/*
+ * call-seq:
+ *  encode_many(srcs, opts = {}) -> array of compressed strings
+ *  encode_many(srcs, opts = { packed: true }) -> [packed_string, offsets]
+ *
+ * Compress each strings as an independent block.
+ * The result is same as LZ4::BlockEncoder.encode for each strings.
+ *
+ * [srcs (array of string)]
+ *
+ * [opts (hash)]
+ *
+ *  level, predict::
+ *
+ *      same as LZ4::BlockEncoder.encode.
+ *
+ *  threads (nil OR 0 OR positive integer)::
+ *
+ *      compress on worker threads. 0 means number of CPUs.
+ *
+ *  packed (true OR false)::
+ *
+ *      return one string and the array of offsets (size + 1 integers), instead of the array of strings.
+ *      The i-th compressed block is ``packed_string.byteslice(offsets[i] ... offsets[i + 1])``.
+ *
+ *  offsets (nil OR array of integer)::
+ *
+ *      give srcs as one string with this offsets (same form as packed).
+ */
+static mrb_value
+blkenc_s_encode_many(MRB, mrb_value self)
+{
+  mrb_value srcs, opts = Qnil;
+  mrb_get_args(mrb, "o|H", &srcs, &opts);
+
+  struct lz4_many m = { 0 };
+  mrb_value level, predict, threads, packed;
+  MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("level", &level, Qnil),
+                MRBX_SCANHASH_ARGS("predict", &predict, Qnil),
+                MRBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                MRBX_SCANHASH_ARGS("packed", &packed, Qfalse),
+                MRBX_SCANHASH_ARGS("offsets", &m.offsets, Qnil));
+  aux_lz4_many_args(mrb, &m, srcs, threads, packed, predict);
+
+  m.level = (NIL_P(level) ? -1 : mrb_int(mrb, level));
+  m.traits = (m.level < 0 ? &block_encoder_traits.fast : &block_encoder_traits.hc);
+  m.failed_name = m.traits->compress_continue_name;
+  m.destcapa = lz4_many_encode_capa;
+  m.job = lz4_many_encode_job;
+
+  return aux_lz4_many_run(mrb, &m);
+}
+
 static void
 init_block_encoder(MRB, struct RClass *mLZ4)
 {
   struct RClass *cBlockEncoder = mrb_define_class_under(mrb, mLZ4, "BlockEncoder", mrb_cObject);
   mrb_define_class_method(mrb, cBlockEncoder, "encode_size", blkenc_s_encode_size, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, cBlockEncoder, "encode", blkenc_s_encode, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, cBlockEncoder, "encode_many", blkenc_s_encode_many, MRB_ARGS_ARG(1, 1));
 
   MRB_SET_INSTANCE_TT(cBlockEncoder, MRB_TT_DATA);
   mrb_define_method(mrb, cBlockEncoder, "initialize", blkenc_initialize, MRB_ARGS_ANY());
   mrb_define_method(mrb, cBlockEncoder, "encode", blkenc_encode, MRB_ARGS_ANY());
   mrb_define_method(mrb, cBlockEncoder, "reset", blkenc_reset, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cBlockEncoder, "level", blkenc_get_level, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cBlockEncoder, "speed", blkenc_get_speed, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cBlockEncoder, "backlog", blkenc_get_backlog, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cBlockEncoder, "backlog=", blkenc_set_backlog, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cBlockEncoder, "probe_stats", blkenc_get_probe_stats, MRB_ARGS_NONE());
 
   mrb_define_const(mrb, cBlockEncoder, "LZ4HC_CLEVEL_MIN", mrb_fixnum_value(LZ4HC_CLEVEL_MIN));
   mrb_define_const(mrb, cBlockEncoder, "LZ4HC_CLEVEL_DEFAULT", mrb_fixnum_value(LZ4HC_CLEVEL_DEFAULT));
@@ -1544,20 +6038,15 @@ blkdec_decode(MRB, mrb_value self)
   mrb_value destv = Qnil;
   mrb_get_args(mrb, "s!|iS!", &srcp, &srclen, &destmax, &destv);
 
-  if (destmax < 0) {
-    size_t size = aux_lz4_scan_size(mrb, srcp, srclen);
-    if (size > MRBX_STR_MAX) {
-      mrb_raise(mrb, E_RUNTIME_ERROR,
-                "maybe out of memory for decompression data");
-    }
-
-    destmax = size;
-  }
-
-  struct RString *dest = mrbx_str_force_recycle(mrb, mrbx_str_ptr(mrb, destv), destmax);
+  struct RString *dest = mrbx_str_force_recycle(mrb, mrbx_str_ptr(mrb, destv), (destmax < 0 ? 0 : destmax));
   struct RString *selfp = RSTRING(self);
+  int destlen;
 
-  int destlen = LZ4_decompress_safe_usingDict(srcp, RSTR_PTR(dest), srclen, destmax, RSTR_PTR(selfp), RSTR_LEN(selfp));
+  if (destmax < 0) {
+    destlen = aux_lz4_decode_unsized(mrb, srcp, srclen, dest, RSTR_PTR(selfp), RSTR_LEN(selfp));
+  } else {
+    destlen = LZ4_decompress_safe_usingDict(srcp, RSTR_PTR(dest), srclen, destmax, RSTR_PTR(selfp), RSTR_LEN(selfp));
+  }
   if (destlen < 0) {
     mrb_raisef(mrb, E_RUNTIME_ERROR, "LZ4_decompress_safe_usingDict failed (%S)", mrb_fixnum_value(destlen));
   }
@@ -1609,39 +6098,42 @@ blkdec_s_decode_size(MRB, mrb_value self)
 }
 
 static void
-blkdec_s_decode_args(MRB, mrb_value *src, mrb_value *dest, mrb_value *predict)
+blkdec_s_decode_args(MRB, mrb_value *src, mrb_value *dest, mrb_value *predict, int32_t *maxdest, mrb_bool *sized)
 {
   mrb_int argc;
   mrb_value *argv;
   mrb_get_args(mrb, "*", &argv, &argc);
   if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    mrb_value asized;
     MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
-                  MRBX_SCANHASH_ARGS("predict", predict, Qnil));
+                  MRBX_SCANHASH_ARGS("predict", predict, Qnil),
+                  MRBX_SCANHASH_ARGS("sized", &asized, Qfalse));
     argc--;
     if (!NIL_P(*predict)) {
       mrb_check_type(mrb, *predict, MRB_TT_STRING);
     }
+    *sized = mrb_test(asized);
   } else {
     *predict = Qnil;
+    *sized = FALSE;
   }
 
-  int32_t maxdest;
   switch (argc) {
   case 1:
-    maxdest = -1;
+    *maxdest = -1;
     *dest = Qnil;
     break;
   case 2:
     if (mrb_string_p(argv[1])) {
-      maxdest = -1;
+      *maxdest = -1;
       *dest = argv[1];
     } else {
-      maxdest = aux_to_u32(mrb, argv[1]);
+      *maxdest = aux_to_u32(mrb, argv[1]);
       *dest = Qnil;
     }
     break;
   case 3:
-    maxdest = aux_to_u32(mrb, argv[1]);
+    *maxdest = aux_to_u32(mrb, argv[1]);
     *dest = argv[2];
     break;
   default:
@@ -1654,17 +6146,15 @@ blkdec_s_decode_args(MRB, mrb_value *src, mrb_value *dest, mrb_value *predict)
   *src = argv[0];
   mrb_check_type(mrb, *src, MRB_TT_STRING);
 
-  if (maxdest == -1) {
-    maxdest = aux_lz4_scan_size(mrb, RSTRING_PTR(*src), RSTRING_LEN(*src));
+  if (*maxdest != -1) {
+    *maxdest = (int32_t)MIN((int64_t)*maxdest, (int64_t)AUX_STR_MAX);
   }
-  maxdest = (int32_t)MIN((int64_t)maxdest, (int64_t)AUX_STR_MAX);
 
   if (NIL_P(*dest)) {
-    *dest = aux_str_buf_new(mrb, maxdest);
+    *dest = aux_str_buf_new(mrb, (*maxdest == -1 ? 0 : *maxdest));
   } else {
     mrb_check_type(mrb, *dest, MRB_TT_STRING);
   }
-  mrbx_str_reserve(mrb, mrbx_str_ptr(mrb, *dest), maxdest);
 }
 
 /*
@@ -1674,29 +6164,141 @@ blkdec_s_decode_args(MRB, mrb_value *src, mrb_value *dest, mrb_value *predict)
  *
  * [opts (hash)]
  *  predict (string OR nil):: decompression with dictionary
+ *  sized (true OR false)::
+ *      src begins with the decompressed size (LZ4::BlockEncoder.encode with sized: true).
+ *      maxsize is used as the upper limit of the size.
  */
 static mrb_value
 blkdec_s_decode(MRB, mrb_value self)
 {
   mrb_value src, dest, predict;
-  blkdec_s_decode_args(mrb, &src, &dest, &predict);
+  int32_t maxdest;
+  mrb_bool sized;
+  blkdec_s_decode_args(mrb, &src, &dest, &predict, &maxdest, &sized);
+
+  const char *srcp = RSTRING_PTR(src);
+  size_t srclen = RSTRING_LEN(src);
+  const char *dict = (NIL_P(predict) ? NULL : RSTRING_PTR(predict));
+  size_t dictsize = (NIL_P(predict) ? 0 : RSTRING_LEN(predict));
+  struct RString *destp = mrbx_str_ptr(mrb, dest);
+  int s;
+
+  if (sized) {
+    uint32_t size = aux_lz4_get_varint(mrb, &srcp, &srclen);
+    if (maxdest != -1 && size > (uint32_t)maxdest) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR,
+                 "size prefix is too large (size prefix=%S, maxsize=%S)",
+                 aux_int_value(mrb, size), aux_int_value(mrb, maxdest));
+    }
+    if (size > AUX_STR_MAX) {
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "maybe out of memory for decompression data");
+    }
+    mrbx_str_reserve(mrb, destp, size);
 
-  LZ4_streamDecode_t *lz4 = (LZ4_streamDecode_t *)mrb_calloc(mrb, 1, sizeof(LZ4_streamDecode_t));
-  if (NIL_P(predict)) {
-    LZ4_setStreamDecode(lz4, NULL, 0);
+    /* NOTE: 単一のブロックであれば LZ4_streamDecode_t は不要 */
+    s = LZ4_decompress_safe_usingDict(srcp, RSTR_PTR(destp), srclen, size, dict, dictsize);
+    if (s >= 0 && (uint32_t)s != size) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "decompressed size mismatch with size prefix");
+    }
+  } else if (maxdest == -1) {
+    s = aux_lz4_decode_unsized(mrb, srcp, srclen, destp, dict, dictsize);
   } else {
-    LZ4_setStreamDecode(lz4, RSTRING_PTR(predict), RSTRING_LEN(predict));
+    mrbx_str_reserve(mrb, destp, maxdest);
+    s = LZ4_decompress_safe_usingDict(srcp, RSTR_PTR(destp), srclen, RSTR_CAPA(destp), dict, dictsize);
   }
-  int s = LZ4_decompress_safe_continue(lz4, RSTRING_PTR(src), RSTRING_PTR(dest), RSTRING_LEN(src), RSTRING_CAPA(dest));
-  mrb_free(mrb, lz4);
+
   if (s < 0) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "LZ4_decompress_safe_continue failed");
+    mrb_raise(mrb, E_RUNTIME_ERROR, "LZ4_decompress_safe_usingDict failed");
   }
-  mrbx_str_set_len(mrb, mrbx_str_ptr(mrb, dest), s);
+  mrbx_str_set_len(mrb, destp, s);
 
   return dest;
 }
 
+static size_t
+lz4_many_decode_capa(MRB, struct lz4_many *m, size_t index)
+{
+  if (NIL_P(m->sizes)) {
+    return aux_lz4_scan_size(mrb, m->items[index].src, m->items[index].srclen);
+  } else if (mrb_array_p(m->sizes)) {
+    if ((mrb_int)index >= RARRAY_LEN(m->sizes)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "sizes is shorter than srcs");
+    }
+    return aux_to_u32(mrb, RARRAY_PTR(m->sizes)[index]);
+  } else {
+    return aux_to_u32(mrb, m->sizes);
+  }
+}
+
+static void
+lz4_many_decode_job(void *user, int worker, size_t index)
+{
+  struct lz4_many *m = (struct lz4_many *)user;
+  size_t i = index * AUX_LZ4_MANY_GROUP;
+  size_t end = MIN(i + AUX_LZ4_MANY_GROUP, m->nitems);
+
+  for (; i < end; i++) {
+    struct lz4_many_item *e = &m->items[i];
+    int s = LZ4_decompress_safe_usingDict(e->src, e->dest, e->srclen, e->destcapa, m->predict, m->predictlen);
+    e->destlen = (s >= 0 ? s : -1);
+  }
+}
+
+/*
+ * call-seq:
+ *  decode_many(srcs, sizes = nil, opts = {}) -> array of decompressed strings
+ *  decode_many(srcs, sizes = nil, opts = { packed: true }) -> [packed_string, offsets]
+ *
+ * Decompress each independent blocks (e.g. by LZ4::BlockEncoder.encode_many).
+ *
+ * [srcs (array of string OR string)]
+ *
+ *      string with offsets option.
+ *
+ * [sizes (nil OR integer OR array of integer)]
+ *
+ *      maximum size of decompressed data.
+ *      nil means scanning each blocks.
+ *      integer is applied to all blocks.
+ *
+ * [opts (hash)]
+ *
+ *  predict::
+ *
+ *      same as LZ4::BlockDecoder.decode.
+ *
+ *  threads, packed, offsets::
+ *
+ *      same as LZ4::BlockEncoder.encode_many.
+ */
+static mrb_value
+blkdec_s_decode_many(MRB, mrb_value self)
+{
+  mrb_value srcs, sizes = Qnil, opts = Qnil;
+  mrb_get_args(mrb, "o|oH", &srcs, &sizes, &opts);
+  if (mrb_hash_p(sizes) && NIL_P(opts)) {
+    opts = sizes;
+    sizes = Qnil;
+  }
+
+  struct lz4_many m = { 0 };
+  mrb_value predict, threads, packed;
+  MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("predict", &predict, Qnil),
+                MRBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                MRBX_SCANHASH_ARGS("packed", &packed, Qfalse),
+                MRBX_SCANHASH_ARGS("offsets", &m.offsets, Qnil));
+  aux_lz4_many_args(mrb, &m, srcs, threads, packed, predict);
+
+  m.sizes = sizes;
+  m.failed_name = "LZ4_decompress_safe_usingDict";
+  m.destcapa = lz4_many_decode_capa;
+  m.job = lz4_many_decode_job;
+
+  return aux_lz4_many_run(mrb, &m);
+}
+
 #ifndef WITHOUT_UNLZ4_GRADUAL
 #include "unlz4-gradual.h"
 
@@ -1861,6 +6463,7 @@ init_block_decoder(MRB, struct RClass *mLZ4)
   struct RClass *cBlockDecoder = mrb_define_class_under(mrb, mLZ4, "BlockDecoder", mrb_cObject);
   mrb_define_class_method(mrb, cBlockDecoder, "decode_size", blkdec_s_decode_size, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, cBlockDecoder, "decode", blkdec_s_decode, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, cBlockDecoder, "decode_many", blkdec_s_decode_many, MRB_ARGS_ARG(1, 2));
 
   /*
    * どうせ prefix (dictionary) バッファのみしか保持しないため、string で事足りる。
@@ -1890,8 +6493,12 @@ mrb_mruby_lz4_gem_init(MRB)
 {
   struct RClass *mLZ4 = mrb_define_module(mrb, "LZ4");
 
+  init_scratch(mrb, mLZ4);
+  init_dictionary(mrb, mLZ4);
   init_encoder(mrb, mLZ4);
   init_decoder(mrb, mLZ4);
+  init_file(mrb, mLZ4);
+  init_seekable_decoder(mrb, mLZ4);
   init_block_encoder(mrb, mLZ4);
   init_block_decoder(mrb, mLZ4);
 }
@@ -1899,4 +6506,5 @@ mrb_mruby_lz4_gem_init(MRB)
 void
 mrb_mruby_lz4_gem_final(MRB)
 {
+  final_scratch(mrb);
 }
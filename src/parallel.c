@@ -0,0 +1,120 @@
+#include "parallel.h"
+
+#if !defined(WITHOUT_LZ4_THREADS) && !defined(_WIN32)
+# define AUX_PARALLEL_USE_PTHREAD 1
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#ifdef AUX_PARALLEL_USE_PTHREAD
+
+struct parallel
+{
+  pthread_mutex_t lock;
+  size_t next;
+  size_t njobs;
+  aux_parallel_job_f *job;
+  void *user;
+};
+
+struct parallel_worker
+{
+  struct parallel *p;
+  int worker;
+};
+
+static void
+parallel_work(struct parallel *p, int worker)
+{
+  for (;;) {
+    size_t index;
+
+    pthread_mutex_lock(&p->lock);
+    index = p->next;
+    if (index < p->njobs) { p->next++; }
+    pthread_mutex_unlock(&p->lock);
+
+    if (index >= p->njobs) { break; }
+
+    p->job(p->user, worker, index);
+  }
+}
+
+static void *
+parallel_worker_main(void *arg)
+{
+  struct parallel_worker *w = (struct parallel_worker *)arg;
+  parallel_work(w->p, w->worker);
+  return NULL;
+}
+
+void
+aux_parallel_run(int nthreads, size_t njobs, aux_parallel_job_f *job, void *user)
+{
+  if (nthreads > AUX_PARALLEL_MAX_THREADS) { nthreads = AUX_PARALLEL_MAX_THREADS; }
+  if ((size_t)nthreads > njobs) { nthreads = (int)njobs; }
+
+  if (nthreads < 2) {
+    size_t i;
+    for (i = 0; i < njobs; i++) { job(user, 0, i); }
+    return;
+  }
+
+  struct parallel p = { .next = 0, .njobs = njobs, .job = job, .user = user };
+  pthread_t threads[AUX_PARALLEL_MAX_THREADS];
+  struct parallel_worker workers[AUX_PARALLEL_MAX_THREADS];
+  int i, nspawned = 0;
+
+  pthread_mutex_init(&p.lock, NULL);
+
+  for (i = 1; i < nthreads; i++) {
+    workers[nspawned].p = &p;
+    workers[nspawned].worker = i;
+    if (pthread_create(&threads[nspawned], NULL, parallel_worker_main, &workers[nspawned]) != 0) {
+      /* NOTE: 生成できなかった分は残りの作業者が肩代わりする */
+      break;
+    }
+    nspawned++;
+  }
+
+  parallel_work(&p, 0);
+
+  for (i = 0; i < nspawned; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&p.lock);
+}
+
+int
+aux_parallel_ncpu(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n > AUX_PARALLEL_MAX_THREADS) { return AUX_PARALLEL_MAX_THREADS; }
+  if (n > 0) { return (int)n; }
+#endif
+
+  return 1;
+}
+
+#else /* AUX_PARALLEL_USE_PTHREAD */
+
+void
+aux_parallel_run(int nthreads, size_t njobs, aux_parallel_job_f *job, void *user)
+{
+  size_t i;
+
+  (void)nthreads;
+
+  for (i = 0; i < njobs; i++) { job(user, 0, i); }
+}
+
+int
+aux_parallel_ncpu(void)
+{
+  return 1;
+}
+
+#endif /* AUX_PARALLEL_USE_PTHREAD */
@@ -0,0 +1,38 @@
+/**
+ * @file parallel.h
+ */
+
+#ifndef MRUBY_LZ4_PARALLEL_H
+#define MRUBY_LZ4_PARALLEL_H 1
+
+#include <stddef.h>
+
+#define AUX_PARALLEL_MAX_THREADS 256
+
+/**
+ * aux_parallel_run() から呼ばれる仕事関数の型です。
+ *
+ * worker は 0 から (nthreads - 1) までの作業者番号で、同時に同じ番号が使われることはありません。
+ * 作業者ごとの作業領域の添字として利用できます。
+ *
+ * index は 0 から (njobs - 1) までの仕事番号です。
+ *
+ * 作業者スレッドから呼ばれるため、mruby の API (例外の発生やメモリの確保を含む) を用いてはなりません。
+ */
+typedef void aux_parallel_job_f(void *user, int worker, size_t index);
+
+/**
+ * njobs 個の仕事を最大 nthreads 個のスレッドで処理し、全てが終わってから戻ります。
+ *
+ * 呼び出し元のスレッドも作業者番号 0 として仕事をします。
+ * スレッドの生成に失敗した場合や WITHOUT_LZ4_THREADS が定義されている場合は、
+ * 残りの作業者だけで (最悪は呼び出し元のスレッドだけで) 全ての仕事を処理します。
+ */
+void aux_parallel_run(int nthreads, size_t njobs, aux_parallel_job_f *job, void *user);
+
+/**
+ * 利用可能な CPU の数を返します。不明であれば 1 を返します。
+ */
+int aux_parallel_ncpu(void);
+
+#endif /* MRUBY_LZ4_PARALLEL_H */
@@ -0,0 +1,143 @@
+#include "probe.h"
+#include <math.h>
+#include <string.h>
+
+/* 標本の長さ。AUX_PROBE_SLICE ごとに均等な間隔で取り出す */
+#define AUX_PROBE_SAMPLE 4096
+#define AUX_PROBE_SLICE 256
+
+/*
+ * 圧縮しないと判定するエントロピー (ビット毎バイト)。
+ * 一様な乱数の 1 KiB の標本でも 7.8 前後となるため、余裕を持たせる。
+ */
+#define AUX_PROBE_ENTROPY_THRESHOLD 7.5
+
+/*
+ * マジックナンバーが一致した場合に圧縮しないと判定するエントロピー。
+ * マジックナンバーだけでは、偶然一致した (あるいは先頭だけを偽った) 圧縮できるデータを見逃すため、
+ * 標本も圧縮済みのデータらしいことを確かめる。
+ */
+#define AUX_PROBE_MAGIC_ENTROPY_THRESHOLD 7.0
+
+struct aux_probe_magic
+{
+  size_t offset;
+  size_t size;
+  const char *magic;
+};
+
+static const struct aux_probe_magic aux_probe_magics[] = {
+  { 0, 3, "\xff\xd8\xff" },                     /* JPEG */
+  { 0, 8, "\x89PNG\r\n\x1a\n" },                /* PNG */
+  { 0, 6, "GIF87a" },                           /* GIF */
+  { 0, 6, "GIF89a" },
+  { 0, 3, "\x1f\x8b\x08" },                     /* gzip (deflate) */
+  { 0, 4, "\x28\xb5\x2f\xfd" },                 /* zstd */
+  { 0, 4, "\x04\x22\x4d\x18" },                 /* LZ4 frame */
+  { 0, 6, "\xfd" "7zXZ\x00" },                  /* xz */
+  { 0, 6, "7z\xbc\xaf\x27\x1c" },               /* 7-Zip */
+  { 0, 4, "OggS" },                             /* Ogg */
+  { 0, 4, "fLaC" },                             /* FLAC */
+  { 0, 4, "wOF2" },                             /* WOFF2 */
+  { 4, 4, "ftyp" },                             /* MP4 / QuickTime / HEIF */
+};
+
+static int
+aux_probe_magic_p(const unsigned char *p, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(aux_probe_magics) / sizeof(aux_probe_magics[0]); i++) {
+    const struct aux_probe_magic *m = &aux_probe_magics[i];
+    if (m->offset + m->size <= size && memcmp(p + m->offset, m->magic, m->size) == 0) {
+      return 1;
+    }
+  }
+
+  /* NOTE: bzip2 は "BZh" と水準 (1..9) に最初のブロックの識別子が続く */
+  if (size >= 10 && memcmp(p, "BZh", 3) == 0 && p[3] >= '1' && p[3] <= '9' &&
+      memcmp(p + 4, "\x31\x41\x59\x26\x53\x59", 6) == 0) {
+    return 1;
+  }
+
+  /* NOTE: WebP は RIFF コンテナに収められる */
+  if (size >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static double
+aux_probe_entropy(const unsigned char *p, size_t size)
+{
+  uint32_t counts[256] = { 0 };
+  size_t total = 0;
+
+  if (size <= AUX_PROBE_SAMPLE) {
+    size_t i;
+    for (i = 0; i < size; i++) { counts[p[i]]++; }
+    total = size;
+  } else {
+    size_t nslices = AUX_PROBE_SAMPLE / AUX_PROBE_SLICE;
+    size_t stride = (size - AUX_PROBE_SLICE) / (nslices - 1);
+    size_t i, j;
+    for (i = 0; i < nslices; i++) {
+      const unsigned char *q = p + stride * i;
+      for (j = 0; j < AUX_PROBE_SLICE; j++) { counts[q[j]]++; }
+    }
+    total = nslices * AUX_PROBE_SLICE;
+  }
+
+  double sum = 0;
+  int i;
+  for (i = 0; i < 256; i++) {
+    if (counts[i] > 0) { sum += counts[i] * log2((double)counts[i]); }
+  }
+
+  return log2((double)total) - sum / total;
+}
+
+enum aux_probe_result
+aux_probe(const void *src, size_t size)
+{
+  const unsigned char *p = (const unsigned char *)src;
+
+  if (size < AUX_PROBE_MIN_SIZE) {
+    return AUX_PROBE_COMPRESSIBLE;
+  }
+
+  double entropy = aux_probe_entropy(p, size);
+
+  if (entropy >= AUX_PROBE_MAGIC_ENTROPY_THRESHOLD && aux_probe_magic_p(p, size)) {
+    return AUX_PROBE_MAGIC;
+  }
+
+  if (entropy >= AUX_PROBE_ENTROPY_THRESHOLD) {
+    return AUX_PROBE_ENTROPY;
+  }
+
+  return AUX_PROBE_COMPRESSIBLE;
+}
+
+void
+aux_probe_count(struct aux_probe_stats *stats, enum aux_probe_result result, size_t size)
+{
+  /* NOTE: aux_probe() は AUX_PROBE_MIN_SIZE 未満のブロックを調べずに AUX_PROBE_COMPRESSIBLE を返す */
+  if (size < AUX_PROBE_MIN_SIZE) { return; }
+
+  stats->probed++;
+
+  switch (result) {
+  case AUX_PROBE_MAGIC:
+    stats->magic++;
+    stats->bypassed += size;
+    break;
+  case AUX_PROBE_ENTROPY:
+    stats->entropy++;
+    stats->bypassed += size;
+    break;
+  default:
+    break;
+  }
+}
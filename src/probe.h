@@ -0,0 +1,54 @@
+/**
+ * @file probe.h
+ */
+
+#ifndef MRUBY_LZ4_PROBE_H
+#define MRUBY_LZ4_PROBE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * aux_probe() が調べる最小の長さです。これより短ければ常に AUX_PROBE_COMPRESSIBLE を返します。
+ */
+#define AUX_PROBE_MIN_SIZE 1024
+
+/**
+ * aux_probe() の判定結果です。
+ */
+enum aux_probe_result
+{
+  AUX_PROBE_COMPRESSIBLE = 0, /* 圧縮を試みる */
+  AUX_PROBE_MAGIC,            /* 既知の圧縮済み形式のマジックナンバーで始まり、標本のエントロピーも高い */
+  AUX_PROBE_ENTROPY,          /* 標本のエントロピーが高い */
+};
+
+/**
+ * aux_probe() の判定を数えた統計です。全ての要素を 0 で初期化してから用いて下さい。
+ */
+struct aux_probe_stats
+{
+  uint64_t probed;  /* 調べたブロック (AUX_PROBE_MIN_SIZE 以上) の数 */
+  uint64_t magic;   /* AUX_PROBE_MAGIC と判定したブロックの数 */
+  uint64_t entropy; /* AUX_PROBE_ENTROPY と判定したブロックの数 */
+  uint64_t bypassed; /* 圧縮せずに格納した入力の長さ */
+};
+
+/**
+ * src が圧縮を試みる価値のないデータであるかを調べます。
+ *
+ * 全体から均等に取り出した最大 4 KiB の標本でバイトのエントロピーを求めます。
+ * 先頭が JPEG / PNG / gzip / zstd / xz / bzip2 などのマジックナンバーと一致する場合は、
+ * エントロピーの閾値を緩めて判定します (マジックナンバーだけでは判定しません)。
+ * 作業者スレッドからも呼び出せます。
+ */
+enum aux_probe_result aux_probe(const void *src, size_t size);
+
+/**
+ * 判定結果を統計に加えます。size は判定したブロックの長さです。
+ *
+ * size が AUX_PROBE_MIN_SIZE 未満であれば、調べていないブロックとして数えません。
+ */
+void aux_probe_count(struct aux_probe_stats *stats, enum aux_probe_result result, size_t size);
+
+#endif /* MRUBY_LZ4_PROBE_H */
@@ -45,6 +45,7 @@ struct unlz4_gradual_real
   int32_t match_length;
   int32_t offset;
   int32_t prefix_length;
+  int32_t prefix_head; /* NOTE: prefix は循環バッファで、次に書き込む位置を示す */
   int32_t prefix_capacity;
   char prefix[];
 };
@@ -55,21 +56,30 @@ get_ready_to_suspend(struct unlz4_gradual_real *p, const char *const begin_in, c
   size_t used_in = p->port.next_in - begin_in;
   size_t used_out = p->port.next_out - begin_out;
 
+  /*
+   * 今回の出力を prefix に追記する。
+   * prefix は循環バッファなので、既存の内容を移動することはない。
+   */
+
   if (p->prefix_capacity <= used_out) {
     memcpy(p->prefix, p->port.next_out - p->prefix_capacity, p->prefix_capacity);
     p->prefix_length = p->prefix_capacity;
-  } else {
-    int32_t cutlen = used_out - (p->prefix_capacity - p->prefix_length);
-
-    if (cutlen <= 0) {
-      memcpy(p->prefix + p->prefix_length, begin_out, used_out);
-      p->prefix_length += used_out;
+    p->prefix_head = 0;
+  } else if (used_out > 0) {
+    int32_t tail = p->prefix_capacity - p->prefix_head;
+
+    if ((int32_t)used_out > tail) {
+      memcpy(p->prefix + p->prefix_head, begin_out, tail);
+      memcpy(p->prefix, begin_out + tail, used_out - tail);
+      p->prefix_head = used_out - tail;
     } else {
-      memmove(p->prefix, p->prefix + cutlen, p->prefix_length - cutlen);
-      memcpy(p->prefix + p->prefix_capacity - used_out, begin_out, used_out);
-
-      p->prefix_length = p->prefix_capacity;
+      memcpy(p->prefix + p->prefix_head, begin_out, used_out);
+      p->prefix_head += used_out;
+      if (p->prefix_head == p->prefix_capacity) { p->prefix_head = 0; }
     }
+
+    p->prefix_length += used_out;
+    if (p->prefix_length > p->prefix_capacity) { p->prefix_length = p->prefix_capacity; }
   }
 
   p->port.avail_in -= used_in;
@@ -106,51 +116,201 @@ expand_length(struct unlz4_gradual_real *p, int32_t *len, const uintptr_t term_i
   return UNLZ4_GRADUAL_NEED_INPUT;
 }
 
-enum { copy_word_size = 16, copy_word_size_mask = copy_word_size - 1 };
+/*
+ * コピー関数群
+ *
+ * 出力先は利用者のバッファであり、その終端を越えて書き込むことは出来ないため、
+ * コピー関数群は全て長さちょうどで書き込む。
+ *
+ * ただし decode_fast() の短いシーケンスに限っては、liblz4 と同様の wildcopy
+ * (シーケンスの末尾を越えて余分に書き込む) を行う。
+ * リテラルは 16 バイト、一致は 32 バイト単位で書き込むため、出力はシーケンスの書き込み開始位置から最大
+ * 14 + 32 バイト先 (入力はトークンから 1 + 16 + 2 バイト先) まで触れる。
+ * これは FAST_LOOP_MARGIN_OUT (FAST_LOOP_MARGIN_IN) の余裕がある間だけ行うため、
+ * 書き込みは avail_out の範囲に収まり、余分に書き込んだ部分は後続のシーケンスで上書きされるか、
+ * next_out より後ろの未使用領域として残るだけである。
+ *
+ * x86-64 では SSE2 (-mavx2 等で __AVX2__ が定義されていれば AVX2 も) を用いる。
+ * UNLZ4_GRADUAL_NO_SIMD が定義されていれば、固定長の memcpy による可搬な実装となる。
+ */
+
+#if !defined(UNLZ4_GRADUAL_NO_SIMD) && defined(__AVX2__)
+# define UNLZ4_GRADUAL_USE_AVX2 1
+# include <immintrin.h>
+#endif
+
+#if !defined(UNLZ4_GRADUAL_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+# define UNLZ4_GRADUAL_USE_SSE2 1
+# include <emmintrin.h>
+#endif
+
+enum { copy_word_size = 16 };
 
+static inline void
+copy8(char *dest, const char *src)
+{
+  memcpy(dest, src, 8);
+}
+
+static inline void
+copy16(char *dest, const char *src)
+{
+#ifdef UNLZ4_GRADUAL_USE_SSE2
+  _mm_storeu_si128((__m128i *)dest, _mm_loadu_si128((const __m128i *)src));
+#else
+  memcpy(dest, src, 16);
+#endif
+}
+
+/*
+ * 重ならない 16 バイト未満のコピー。
+ * 先頭と末尾から重なり合うように書き込むことで、バイト単位のループを避ける。
+ */
+static inline void
+copy_short(char *dest, const char *src, int32_t len)
+{
+  if (len >= 8) {
+    uint64_t a, b;
+    memcpy(&a, src, 8);
+    memcpy(&b, src + len - 8, 8);
+    memcpy(dest, &a, 8);
+    memcpy(dest + len - 8, &b, 8);
+  } else if (len >= 4) {
+    uint32_t a, b;
+    memcpy(&a, src, 4);
+    memcpy(&b, src + len - 4, 4);
+    memcpy(dest, &a, 4);
+    memcpy(dest + len - 4, &b, 4);
+  } else if (len > 0) {
+    char a = src[0], b = src[len >> 1], c = src[len - 1];
+    dest[0] = a;
+    dest[len >> 1] = b;
+    dest[len - 1] = c;
+  }
+}
+
+/*
+ * 重ならない領域のコピー。
+ */
 static void
 fast_copy(char *dest, const char *src, int32_t len)
 {
-#ifdef UNLZ4_GRADUAL_USE_MEMCPY
+  if (len < copy_word_size) {
+    copy_short(dest, src, len);
+    return;
+  }
+
+  char *const term = dest + len;
+  const char *const srcterm = src + len;
+
+#ifdef UNLZ4_GRADUAL_USE_AVX2
+  for (; len >= 32; len -= 32) {
+    _mm256_storeu_si256((__m256i *)dest, _mm256_loadu_si256((const __m256i *)src));
+    dest += 32;
+    src += 32;
+  }
+#endif
+
   for (; len >= copy_word_size; len -= copy_word_size) {
-    memcpy(dest, src, copy_word_size);
+    copy16(dest, src);
     dest += copy_word_size;
     src += copy_word_size;
   }
 
-  memcpy(dest, src, len);
+  if (len > 0) {
+    /* NOTE: 書き込み済みの範囲と重ねて、末尾の 16 バイトをまとめて書き込む */
+    copy16(term - copy_word_size, srcterm - copy_word_size);
+  }
+}
+
+/*
+ * offset が 16 未満の自己参照コピー (src + offset == dest)。
+ *
+ * 周期 offset の模様を 16 バイトに展開し、offset の倍数ずつ進めながら書き込む。
+ */
+static void
+copy_pattern(char *dest, const char *src, int32_t offset, int32_t len)
+{
+  char pattern[copy_word_size];
+  int32_t step, i;
+
+  if (offset == 1) {
+    memset(pattern, src[0], copy_word_size);
+    step = copy_word_size;
+  } else {
+    for (i = 0; i < offset; i++) { pattern[i] = src[i]; }
+    for (; i < copy_word_size; i++) { pattern[i] = pattern[i - offset]; }
+    step = copy_word_size - (copy_word_size % offset);
+  }
+
+#ifdef UNLZ4_GRADUAL_USE_SSE2
+  const __m128i v = _mm_loadu_si128((const __m128i *)pattern);
+
+  for (; len >= copy_word_size; len -= step) {
+    _mm_storeu_si128((__m128i *)dest, v);
+    dest += step;
+  }
 #else
-  for (; len > 0; len--) { *dest++ = *src++; }
+  for (; len >= copy_word_size; len -= step) {
+    memcpy(dest, pattern, copy_word_size);
+    dest += step;
+  }
 #endif
+
+  copy_short(dest, pattern, len);
 }
 
+/*
+ * 一致範囲のコピー。src と dest は重なっていてもよい (前方へのバイト単位のコピーと同じ結果になる)。
+ */
 static void
 copy(char *dest, const char *src, int32_t len)
 {
-#ifdef UNLZ4_GRADUAL_USE_MEMCPY
-  size_t s;
+  uintptr_t offset = (uintptr_t)dest - (uintptr_t)src;
 
-  if ((s = dest - src) < len) {
-    if (s < copy_word_size) {
-      s = copy_word_size - s;
-      len -= s;
-
-      for (; s > 0; s--) {
-        *dest++ = *src++;
-      }
+  if (likely(offset >= (uintptr_t)len)) {
+    fast_copy(dest, src, len);
+  } else if (offset < copy_word_size) {
+    /* NOTE: offset 0 は呼び出し元で不正なデータとして弾いているが、念のため書き込まない */
+    if (likely(offset > 0)) { copy_pattern(dest, src, (int32_t)offset, len); }
+  } else {
+    /* NOTE: offset が 16 以上なので、16 バイトずつであれば読み込む範囲は書き込み済み */
+    char *const term = dest + len;
+    const char *const srcterm = src + len;
+
+    for (; len >= copy_word_size; len -= copy_word_size) {
+      copy16(dest, src);
+      dest += copy_word_size;
+      src += copy_word_size;
     }
 
-    if (len < copy_word_size) {
-      for (; len > 0; len--) {
-        *dest++ = *src++;
-      }
-
-      return;
+    if (len > 0) {
+      copy16(term - copy_word_size, srcterm - copy_word_size);
     }
   }
-#endif
+}
 
-  fast_copy(dest, src, len);
+/*
+ * prefix の末尾から backward バイト前の位置にある len バイトをコピーする (len <= backward であること)。
+ *
+ * prefix は循環バッファなので、終端を跨ぐ場合は 2 回に分けてコピーする。
+ */
+static void
+copy_from_prefix(const struct unlz4_gradual_real *p, char *dest, int32_t backward, int32_t len)
+{
+  int32_t pos = p->prefix_head - backward;
+
+  if (pos < 0) { pos += p->prefix_capacity; }
+
+  int32_t tail = p->prefix_capacity - pos;
+
+  if (len > tail) {
+    fast_copy(dest, p->prefix + pos, tail);
+    fast_copy(dest + tail, p->prefix, len - tail);
+  } else {
+    fast_copy(dest, p->prefix + pos, len);
+  }
 }
 
 static enum unlz4_gradual_status
@@ -196,6 +356,149 @@ copy_match(struct unlz4_gradual_real *p, const char *src, int32_t len, const uin
   return s;
 }
 
+static enum unlz4_gradual_status
+copy_match_prefix(struct unlz4_gradual_real *p, int32_t backward, int32_t len, const uintptr_t term_out)
+{
+  enum unlz4_gradual_status s;
+
+  if (unlikely(len > (term_out - (uintptr_t)p->port.next_out))) {
+    len = term_out - (uintptr_t)p->port.next_out;
+    s = UNLZ4_GRADUAL_NEED_OUTPUT;
+  } else {
+    s = UNLZ4_GRADUAL_OK;
+  }
+
+  copy_from_prefix(p, p->port.next_out, backward, len);
+  p->port.next_out += len;
+  p->match_length -= len;
+
+  return s;
+}
+
+/*
+ * 一致範囲のコピー (高速処理用)。
+ *
+ * offset は検証済みであること。
+ * 前回までの出力 (prefix) にかかる場合は、prefix からのコピーに続けて今回の出力からコピーする。
+ */
+static void
+copy_match_fast(struct unlz4_gradual_real *p, char *op, const char *const begin_out, int32_t offset, int32_t len)
+{
+  int32_t backward = offset - (int32_t)(op - begin_out);
+
+  if (likely(backward <= 0)) {
+    copy(op, op - offset, len);
+  } else if (backward >= len) {
+    copy_from_prefix(p, op, backward, len);
+  } else {
+    copy_from_prefix(p, op, backward, backward);
+    copy(op + backward, begin_out, len - backward);
+  }
+}
+
+enum {
+  FAST_LOOP_MARGIN_IN = 32,
+  FAST_LOOP_MARGIN_OUT = 64,
+};
+
+/*
+ * 入出力バッファに十分な余裕がある間、コルーチンによる中断を考慮せずにシーケンスを伸長する。
+ *
+ * liblz4 の伸長処理と同様に、リテラル長も一致長も短いシーケンス (大半がこれにあたる) は
+ * 余裕分を利用して 16 バイト単位で書き込むことで、長さの検査とコピーを簡略化する。
+ *
+ * next_in と next_out はシーケンスを処理し終えるたびに進めるため、途中で抜けた場合は
+ * 通常の処理がそのシーケンスの先頭から引き継ぐ。
+ * 入出力の終端に近づいた場合や、prefix を超える offset などの例外的な場合もそのまま抜けて、
+ * 通常の処理に任せる。
+ */
+static void
+decode_fast(struct unlz4_gradual_real *p, const char *const begin_out, const uintptr_t term_in, const uintptr_t term_out)
+{
+  const uint8_t *ip = (const uint8_t *)p->port.next_in;
+  char *op = p->port.next_out;
+
+  while (likely(term_in - (uintptr_t)ip >= FAST_LOOP_MARGIN_IN &&
+                term_out - (uintptr_t)op >= FAST_LOOP_MARGIN_OUT)) {
+    const uint8_t token = *ip;
+    int32_t litlen = token >> 4;
+    int32_t matchlen = token & 0x0f;
+    int32_t offset;
+
+    if (likely(litlen < 15 && matchlen < 15)) {
+      /* NOTE: 入力は 1 + 16 + 2 バイト、出力は 14 + 32 バイトの余裕が確保されている */
+      offset = loadu16le(ip + 1 + litlen);
+
+      if (likely(offset >= copy_word_size && offset <= (op + litlen) - begin_out)) {
+        const char *match;
+
+        copy16(op, (const char *)ip + 1);
+        op += litlen;
+        ip += 1 + litlen + 2;
+        match = op - offset;
+        copy16(op, match);
+        copy16(op + copy_word_size, match + copy_word_size);
+        op += matchlen + MINIMAL_MATCH_LENGTH;
+
+        p->port.next_in = (const char *)ip;
+        p->port.next_out = op;
+        continue;
+      }
+    }
+
+    {
+      /* 一般的なシーケンス。全ての長さを読み込んで検査してから書き込む */
+
+      const uint8_t *cur = ip + 1;
+
+      if (litlen == 15) {
+        uint8_t w;
+        do {
+          if (unlikely((uintptr_t)cur >= term_in)) { return; }
+          w = *cur++;
+          litlen += w;
+        } while (w == 255);
+      }
+
+      if (unlikely((uintptr_t)litlen + 2 > (term_in - (uintptr_t)cur) ||
+                   litlen > (term_out - (uintptr_t)op))) {
+        return;
+      }
+
+      const uint8_t *lit = cur;
+      cur += litlen;
+      offset = loadu16le(cur);
+      cur += 2;
+
+      if (matchlen == 15) {
+        uint8_t w;
+        do {
+          if (unlikely((uintptr_t)cur >= term_in)) { return; }
+          w = *cur++;
+          matchlen += w;
+        } while (w == 255);
+      }
+
+      matchlen += MINIMAL_MATCH_LENGTH;
+
+      if (unlikely(matchlen > (term_out - (uintptr_t)op) - litlen ||
+                   offset == 0 ||
+                   offset - ((op + litlen) - begin_out) > p->prefix_length)) {
+        return;
+      }
+
+      fast_copy(op, (const char *)lit, litlen);
+      op += litlen;
+      copy_match_fast(p, op, begin_out, offset, matchlen);
+      op += matchlen;
+      ip = cur;
+
+      p->port.next_in = (const char *)ip;
+      p->port.next_out = op;
+    }
+  }
+}
+
 enum unlz4_gradual_status
 unlz4_gradual(struct unlz4_gradual *g)
 {
@@ -208,6 +511,9 @@ unlz4_gradual(struct unlz4_gradual *g)
   co_begin(&p->co_state);
 
   for (;;) {
+    /* NOTE: トークンの読み込み前であれば、状態を持たずに高速処理へ移ることが出来る */
+    decode_fast(p, begin_out, term_in, term_out);
+
     {
       /* 最初のトークンを読み込む */
 
@@ -273,6 +579,12 @@ unlz4_gradual(struct unlz4_gradual *g)
 
         p->offset |= (uint16_t)(*(const uint8_t *)p->port.next_in++) << 8;
       }
+
+      /* NOTE: offset 0 は lz4 の仕様上ありえない (copy_pattern で 0 除算になる) */
+      if (unlikely(p->offset == 0)) {
+        get_ready_to_suspend(p, begin_in, begin_out);
+        co_halt(UNLZ4_GRADUAL_ERROR_INVALID_OFFSET);
+      }
     }
 
     {
@@ -306,11 +618,11 @@ unlz4_gradual(struct unlz4_gradual *g)
           get_ready_to_suspend(p, begin_in, begin_out);
           co_halt(UNLZ4_GRADUAL_ERROR_OUT_OF_PREFIX_BUFFER);
         } else if (backward > p->match_length) {
-          if (likely(copy_match(p, p->prefix + p->prefix_length - backward, p->match_length, term_out) == UNLZ4_GRADUAL_OK)) {
+          if (likely(copy_match_prefix(p, backward, p->match_length, term_out) == UNLZ4_GRADUAL_OK)) {
             break;
           }
         } else {
-          if (likely(copy_match(p, p->prefix + p->prefix_length - backward, backward, term_out) == UNLZ4_GRADUAL_OK &&
+          if (likely(copy_match_prefix(p, backward, backward, term_out) == UNLZ4_GRADUAL_OK &&
                      copy_match(p, begin_out, p->match_length, term_out) == UNLZ4_GRADUAL_OK)) {
             break;
           }
@@ -376,16 +688,20 @@ unlz4_gradual_reset(struct unlz4_gradual *g, const void *prefix, int32_t prefixl
     /* NOTE: keep prefix buffer contents */
   } else if (prefix == NULL || prefixlen < 1) {
     p->prefix_length = 0;
+    p->prefix_head = 0;
   } else {
     memcpy(p->prefix, prefix, prefixlen);
     p->prefix_length = prefixlen;
+    p->prefix_head = (prefixlen < p->prefix_capacity ? prefixlen : 0);
   }
 
   int32_t preflen = p->prefix_length;
+  int32_t prefhead = p->prefix_head;
   int32_t prefcapa = p->prefix_capacity;
   memset(&p->co_state, 0, offsetof(struct unlz4_gradual_real, prefix) - offsetof(struct unlz4_gradual_real, co_state));
   p->co_state = CO_INIT;
   p->prefix_length = preflen;
+  p->prefix_head = prefhead;
   p->prefix_capacity = prefcapa;
 
   return UNLZ4_GRADUAL_OK;
@@ -407,6 +723,8 @@ unlz4_gradual_str_status(enum unlz4_gradual_status s)
     return "ERROR_NO_MEMORY";
   case UNLZ4_GRADUAL_ERROR_OUT_OF_PREFIX_BUFFER:
     return "ERROR_OUT_OF_PREFIX_BUFFER";
+  case UNLZ4_GRADUAL_ERROR_INVALID_OFFSET:
+    return "ERROR_INVALID_OFFSET";
   case UNLZ4_GRADUAL_ERROR_UNEXPECT_REACHED_HERE:
     return "ERROR_UNEXPECT_REACHED_HERE";
   default:
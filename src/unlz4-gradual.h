@@ -60,6 +60,9 @@ enum unlz4_gradual_status
   /** lz4 シーケンスの offset が prefix buffer を超えたため続行できません。 */
   UNLZ4_GRADUAL_ERROR_OUT_OF_PREFIX_BUFFER = 2,
 
+  /** lz4 シーケンスの offset が 0 であるため続行できません (不正なデータです)。 */
+  UNLZ4_GRADUAL_ERROR_INVALID_OFFSET = 3,
+
   /** 内部バグです。作者に報告して下さい。 */
   UNLZ4_GRADUAL_ERROR_UNEXPECT_REACHED_HERE = 99,
 };
@@ -81,6 +81,39 @@ assert("LZ4 Block API - one step processing") do
   assert_equal s, LZ4.block_decode(LZ4.block_encode(s, predict: "123456789123456789"), predict: "123456789123456789")
   # predict を用いて圧縮したデータは、伸長時にも必要
   assert_raise(RuntimeError) { LZ4.block_decode(LZ4.block_encode(s, predict: "123456789123456789")) }
+
+  # 圧縮状態を使い回しても、直前の呼び出しによって結果は変わらない
+  [nil, -8, 0, 9].each do |level|
+    d = LZ4.block_encode(s, level: level)
+    LZ4.block_encode(s.reverse, level: level, predict: "987654321")
+    LZ4.block_encode(s.reverse, level: (level ? -1 - level : 9))
+    assert_equal d, LZ4.block_encode(s, level: level)
+  end
+end
+
+assert("LZ4 Block API - size prefix") do
+  ["", "A", "123456789" * 1111, "abc" * 99999].each do |s|
+    d = LZ4.block_encode(s, sized: true)
+    assert_equal s, LZ4.block_decode(d, sized: true)
+    assert_equal s, LZ4.block_decode(d, s.bytesize, sized: true)
+    assert_equal LZ4.block_encode(s), d.byteslice(d.bytesize - LZ4.block_encode(s).bytesize, d.bytesize)
+  end
+
+  # 128 以上の長さは複数バイトで表す
+  assert_equal "\x80\x01", LZ4.block_encode("A" * 128, sized: true).byteslice(0, 2)
+
+  s = "123456789" * 1111
+  d = LZ4.block_encode(s, sized: true, predict: "123456789123456789", level: 9)
+  assert_equal s, LZ4.block_decode(d, sized: true, predict: "123456789123456789")
+  assert_raise(RuntimeError) { LZ4.block_decode(d, 100, sized: true, predict: "123456789123456789") }
+  assert_raise(RuntimeError) { LZ4.block_decode("\x80\x80", sized: true) }
+  assert_raise(RuntimeError) { LZ4.block_decode("\x05\x10A", sized: true) }
+  assert_raise(RuntimeError) { LZ4.block_encode("A", 1, sized: true) }
+
+  # 長さを与えなくても、伸長先の見積もりを超える高圧縮率のデータを伸長できる
+  s = "\0" * 999999
+  assert_equal s, LZ4.block_decode(LZ4.block_encode(s))
+  assert_equal s, LZ4::BlockDecoder.new.decode(LZ4.block_encode(s))
 end
 
 assert "streaming LZ4 Block decode" do
@@ -98,3 +131,300 @@ assert "streaming LZ4 Block encode" do
   assert_equal az104, LZ4.block_decode(lz4.encode(az104))
   assert_equal az104, LZ4.block_decode(lz4.encode(az104), predict: az104)
 end
+
+assert "streaming LZ4 Block encode with history" do
+  s = "abcdefghijklmnopqrstuvwxyz0123456789" * 5000
+  sizes = [1, 100, 4096, 40000, 7, 30000, 65536, 5]
+  pieces = []
+  off = 0
+  while off < s.bytesize
+    pieces << s.byteslice(off, sizes[pieces.size % sizes.size])
+    off += pieces[-1].bytesize
+  end
+
+  [nil, 0].each do |level|
+    [[], [nil, nil, {}], [nil, nil, { stable: true }], [nil, 4096]].each do |args|
+      lz4 = LZ4::BlockEncoder.new(level, *args)
+      dec = LZ4::BlockDecoder.new
+      z = pieces.map { |e| lz4.encode(e) }
+      d = ""
+      z.each_with_index { |e, i| d << dec.decode(e, pieces[i].bytesize) }
+      assert_equal s, d
+    end
+  end
+
+  # 前のブロックを参照して圧縮される
+  lz4 = LZ4::BlockEncoder.new
+  a = lz4.encode(s.byteslice(0, 4096))
+  assert_true lz4.encode(s.byteslice(0, 4096)).bytesize < a.bytesize
+
+  assert_raise(ArgumentError) { LZ4::BlockEncoder.new(nil, nil, 4096, stable: true) }
+end
+
+assert "adaptive LZ4 Block encode" do
+  s = "abcdefghijklmnopqrstuvwxyz0123456789" * 40000
+  pieces = []
+  off = 0
+  while off < s.bytesize
+    pieces << s.byteslice(off, 16384)
+    off += 16384
+  end
+
+  # 目標に届かないため、HC から fast へ移る
+  # 目標を大きく上回るため、fast から HC へ移る
+  [[3, { target_speed: 1000000000 }, ->(lv) { lv < 0 }],
+   [-4, { target_speed: 0.000001, max_level: 3 }, ->(lv) { lv >= 0 }]].each do |level, opts, check|
+    [opts, opts.merge(stable: true)].each do |o|
+      lz4 = LZ4::BlockEncoder.new(level, nil, nil, o)
+      dec = LZ4::BlockDecoder.new
+      assert_nil lz4.speed
+      d = ""
+      pieces.each { |e| d << dec.decode(lz4.encode(e), e.bytesize) }
+      assert_equal s, d
+      assert_true check.call(lz4.level)
+      assert_kind_of Float, lz4.speed
+    end
+  end
+
+  lz4 = LZ4::BlockEncoder.new(-1, nil, nil, target_speed: 100)
+  lz4.reset(9)
+  assert_equal 9, lz4.level
+  assert_raise(ArgumentError) { LZ4::BlockEncoder.new(-1).reset(9) }
+
+  # 開始レベルが min_level..max_level の範囲外であれば範囲内に収める
+  lz4 = LZ4::BlockEncoder.new(-1, nil, nil, target_speed: 1, min_level: 6)
+  assert_equal 6, lz4.level
+  assert_equal pieces[0], LZ4.block_decode(lz4.encode(pieces[0]), pieces[0].bytesize)
+  lz4.reset(-1)
+  assert_equal 6, lz4.level
+  lz4 = LZ4::BlockEncoder.new(9, nil, nil, target_speed: 1, max_level: -4)
+  assert_equal(-4, lz4.level)
+  assert_equal pieces[0], LZ4.block_decode(lz4.encode(pieces[0]), pieces[0].bytesize)
+  lz4.reset(12)
+  assert_equal(-4, lz4.level)
+  assert_raise(ArgumentError) { LZ4::BlockEncoder.new(-1, nil, nil, min_level: -8) }
+  assert_raise(ArgumentError) { LZ4::BlockEncoder.new(-1, nil, nil, target_speed: 100, min_level: 9, max_level: 3) }
+end
+
+assert "LZ4 Block encode with probe" do
+  x = 1
+  noise = (0 ... 65536).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+  text = "abcdefghijklmnopqrstuvwxyz0123456789" * 2000
+
+  LZ4.probe_stats(true)
+  z = LZ4::BlockEncoder.encode(noise, probe: true)
+  assert_equal noise, LZ4.block_decode(z)
+  assert_true LZ4::BlockEncoder.encode(text, probe: true).bytesize < text.bytesize / 10
+  assert_equal noise, LZ4.block_decode(LZ4::BlockEncoder.encode(noise, probe: true, sized: true), sized: true)
+  assert_equal({ probed: 3, magic: 0, entropy: 2, bypassed: 2 * noise.bytesize }, LZ4.probe_stats)
+
+  gz = "\x1f\x8b\x08" + noise
+  assert_equal gz, LZ4.block_decode(LZ4::BlockEncoder.encode(gz, probe: true))
+  assert_equal 1, LZ4.probe_stats(true)[:magic]
+  assert_equal 0, LZ4.probe_stats[:probed]
+
+  # マジックナンバーが一致しても、圧縮できるデータは圧縮する
+  gz = "\x1f\x8b\x08" + text
+  z = LZ4::BlockEncoder.encode(gz, probe: true)
+  assert_equal gz, LZ4.block_decode(z)
+  assert_true z.bytesize < gz.bytesize / 10
+  assert_equal({ probed: 1, magic: 0, entropy: 0, bypassed: 0 }, LZ4.probe_stats(true))
+
+  # 1 KiB 未満のブロックは調べないため数えない
+  assert_equal "\x1f\x8b\x08", LZ4.block_decode(LZ4::BlockEncoder.encode("\x1f\x8b\x08", probe: true))
+  lz4 = LZ4::BlockEncoder.new(nil, nil, nil, probe: true)
+  lz4.encode(text.byteslice(0, 1023))
+  assert_equal 0, lz4.probe_stats[:probed]
+  assert_equal 0, LZ4.probe_stats[:probed]
+
+  # 無圧縮で格納したブロックの後も連結ブロックとして伸長できる
+  pieces = [text.byteslice(0, 30000), noise.byteslice(0, 30000), text.byteslice(30000, 30000),
+            noise.byteslice(30000, 35536), text.byteslice(0, 30000), text.byteslice(100, 30000)]
+  [[nil, nil, nil, { probe: true }],
+   [nil, nil, nil, { probe: true, stable: true }],
+   [nil, nil, 4096, { probe: true }],
+   [9, nil, nil, { probe: true }]].each do |args|
+    lz4 = LZ4::BlockEncoder.new(*args)
+    dec = LZ4::BlockDecoder.new
+    d = ""
+    pieces.each { |e| d << dec.decode(lz4.encode(e), e.bytesize) }
+    assert_equal pieces.join, d
+    assert_equal 2, lz4.probe_stats[:entropy]
+  end
+end
+
+assert "LZ4 Block API - encode_many / decode_many" do
+  srcs = (0 ... 100).map { |i| "abcdefg#{i}" * (i * 3) }
+  predict = "abcdefg0123456789"
+
+  [nil, 0].each do |threads|
+    [{}, { level: 9 }, { predict: predict }].each do |opts|
+      z = LZ4::BlockEncoder.encode_many(srcs, opts.merge(threads: threads))
+      assert_equal srcs.map { |e| LZ4::BlockEncoder.encode(e, opts) }, z
+
+      decopts = { threads: threads }
+      decopts[:predict] = predict if opts[:predict]
+      assert_equal srcs, LZ4::BlockDecoder.decode_many(z, decopts)
+      assert_equal srcs, LZ4::BlockDecoder.decode_many(z, srcs.map { |e| e.bytesize }, decopts)
+
+      buf, offsets = LZ4::BlockEncoder.encode_many(srcs, opts.merge(threads: threads, packed: true))
+      assert_equal z.join, buf
+      assert_equal srcs.size + 1, offsets.size
+      assert_equal z[1], buf.byteslice(offsets[1] ... offsets[2])
+
+      assert_equal srcs, LZ4::BlockDecoder.decode_many(buf, 1000, decopts.merge(offsets: offsets))
+      out, outoffsets = LZ4::BlockDecoder.decode_many(buf, decopts.merge(offsets: offsets, packed: true))
+      assert_equal srcs.join, out
+      assert_equal srcs[5], out.byteslice(outoffsets[5] ... outoffsets[6])
+    end
+  end
+
+  assert_equal [], LZ4::BlockEncoder.encode_many([])
+  assert_equal ["", [0]], LZ4::BlockEncoder.encode_many([], packed: true)
+  assert_raise(TypeError) { LZ4::BlockEncoder.encode_many(["a", 1]) }
+  assert_raise(ArgumentError) { LZ4::BlockEncoder.encode_many(["a"], wrong_keyword: nil) }
+  assert_raise(RuntimeError) { LZ4::BlockDecoder.decode_many([LZ4.block_encode("abcdefg" * 10)], 10) }
+  assert_raise(ArgumentError) { LZ4::BlockDecoder.decode_many("abc", offsets: [0, 4]) }
+end
+
+assert "LZ4 Block API - encode_many / decode_many (packed, under GC)" do
+  srcs = (0 ... 3000).map { |i| "xyz#{i}" * (i % 17 + 1) }
+  z = srcs.map { |e| LZ4.block_encode(e) }
+
+  # NOTE: 要素ごとに GC が走るように、GC の間隔を最小にする
+  interval = GC.interval_ratio if GC.respond_to?(:interval_ratio)
+  begin
+    GC.interval_ratio = 1 if interval
+    3.times do
+      buf, offsets = LZ4::BlockEncoder.encode_many(srcs, packed: true)
+      GC.start
+      assert_equal z.join, buf
+      assert_equal srcs.size + 1, offsets.size
+      assert_equal z[-1], buf.byteslice(offsets[-2] ... offsets[-1])
+
+      out, outoffsets = LZ4::BlockDecoder.decode_many(buf, offsets: offsets, packed: true)
+      GC.start
+      assert_equal srcs.join, out
+      assert_equal srcs[1234], out.byteslice(outoffsets[1234] ... outoffsets[1235])
+    end
+  ensure
+    GC.interval_ratio = interval if interval
+  end
+end
+
+if LZ4::BlockDecoder.const_defined?(:Gradual)
+  # 一つのシーケンス (literal + match) と終端のリテラルからなる LZ4 ブロックを組み立てる。
+  # tail は 15 バイト未満であること。
+  build_lz4_block = ->(literal, offset, matchlen, tail) {
+    extend_length = ->(z, len) {
+      if len >= 15
+        len -= 15
+        while len >= 255
+          z << 255.chr
+          len -= 255
+        end
+        z << len.chr
+      end
+    }
+
+    ll = literal.bytesize
+    ml = matchlen - 4
+    z = (((ll < 15 ? ll : 15) << 4) | (ml < 15 ? ml : 15)).chr
+    extend_length.(z, ll)
+    z << literal << (offset & 0xff).chr << (offset >> 8).chr
+    extend_length.(z, ml)
+    z << (tail.bytesize << 4).chr << tail
+  }
+
+  gradual_decode = ->(z, piece = 65536, *args) {
+    g = LZ4::BlockDecoder::Gradual.new(z, *args)
+    dest = ""
+    buf = ""
+    while g.read(piece, buf)
+      dest << buf
+    end
+    dest
+  }
+
+  assert "LZ4 Block API - Gradual overlapping matches" do
+    tail = "12345"
+    (1 .. 15).each do |offset|
+      literal = "abcdefghijklmno".byteslice(0, offset)
+      [4, 5, offset + 4, offset + 5, 18, 19, 300, 70000].each do |matchlen|
+        expect = (literal * (matchlen / offset + 2)).byteslice(0, offset + matchlen) << tail
+
+        z = build_lz4_block.(literal, offset, matchlen, tail)
+        assert_equal expect, LZ4.block_decode(z)
+        assert_equal expect, gradual_decode.(z)
+        assert_equal expect, gradual_decode.(z, 7)
+      end
+    end
+  end
+
+  assert "LZ4 Block API - Gradual zero offset" do
+    z = build_lz4_block.("a", 0, 20, "12345")
+    assert_raise(RuntimeError) { gradual_decode.(z) }
+    assert_raise(RuntimeError) { gradual_decode.(z, 1) }
+  end
+
+  # 与えられた長さを順に繰り返しながら、入力を少しずつ返す。
+  class GradualPieceReader
+    def initialize(src, pieces)
+      @src = src
+      @pieces = pieces
+      @off = 0
+      @i = 0
+    end
+
+    def read(size = nil, buf = nil)
+      return nil if @off >= @src.bytesize
+      n = @pieces[@i % @pieces.size]
+      n = size if size && size < n
+      @i += 1
+      piece = @src.byteslice(@off, n)
+      @off += piece.bytesize
+      buf ? buf.replace(piece) : piece
+    end
+  end
+
+  assert "LZ4 Block API - Gradual piecewise input" do
+    x = 1
+    noise = (0 ... 10000).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+    s = "abcdefghijklmnopqrstuvwxyz0123456789" * 500 + noise + "0123" * 3000 + noise.byteslice(0, 5000) + "A" * 3000 + "xyz"
+    z = LZ4.block_encode(s)
+
+    # 1 バイトずつと、リテラルと一致の境界を跨ぐ奇数長で与え、大きな入力と交互にして高速経路と再開可能な経路を行き来させる
+    [[1], [1, 2, 3, 5, 7, 11, 13], [3, 4099, 1, 65537, 7]].each do |pieces|
+      [7, 65536].each do |outpiece|
+        assert_equal s, gradual_decode.(GradualPieceReader.new(z, pieces), outpiece)
+      end
+    end
+  end
+
+  assert "LZ4 Block API - Gradual large input" do
+    s = ("abcdefghijklmnopqrstuvwxyz" * 40000 + "0123456789" * 30000) * 4
+    z = LZ4.block_encode(s)
+    assert_equal s, gradual_decode.(z, s.bytesize)
+    assert_equal s, gradual_decode.(z)
+  end
+
+  assert "LZ4 Block API - Gradual ring buffer wraparound" do
+    x = 7
+    noise = (0 ... 50000).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+    dict = (0 ... 65536).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+
+    # 50000 バイトごとの繰り返しのため、一致は 65536 バイトの環状バッファの折り返しを跨いで参照する
+    s = noise * 5 + noise.byteslice(123, 40000)
+    sd = dict.byteslice(1000, 30000) + dict.byteslice(50000, 15536) + s
+
+    [[s, {}], [sd, { predict: dict }]].each do |src, opts|
+      z = LZ4::BlockEncoder.encode(src, opts)
+      assert_equal src, LZ4.block_decode(z, opts)
+
+      [7, 1000, 4099, 65536].each do |piece|
+        assert_equal src, gradual_decode.(z, piece, opts)
+      end
+      assert_equal src, gradual_decode.(GradualPieceReader.new(z, [1, 3, 4099]), 777, opts)
+    end
+  end
+end
@@ -38,6 +38,210 @@ assert("LZ4 Frame API - stream processing") do
   end
 end
 
+assert("LZ4 Frame API - stream processing (flush policy)") do
+  lines = (0 ... 1000).map { |i| "#{i}: the quick brown fox jumps over the lazy dog\n" }
+  s = lines.join
+
+  # << の呼び出しを数える出力先
+  newport = -> do
+    port = Object.new
+    def port.buf; @buf; end
+    def port.calls; @calls; end
+    def port.<<(d)
+      @buf ||= ""
+      @calls = (@calls || 0) + 1
+      @buf << d
+      self
+    end
+    port
+  end
+
+  results = [{}, { autoflush: false }, { flush_size: 4096 }, { autoflush: false, flush_size: 1 << 20 }].map do |opts|
+    out = newport.call
+    LZ4::Encoder.wrap(out, opts) { |lz4| lines.each { |e| lz4 << e } }
+    assert_equal s, LZ4.decode(out.buf)
+    out
+  end
+
+  assert_true results[0].calls > lines.size
+  assert_true results[1].calls < 10
+  assert_true results[1].buf.bytesize < results[0].buf.bytesize
+  assert_true results[2].calls < results[0].calls / 10
+  assert_equal results[0].buf, results[2].buf
+  assert_equal 1, results[3].calls
+
+  # 明示的なフラッシュは溜め込んだ全てを出力先へ渡す
+  out = newport.call
+  lz4 = LZ4::Encoder.new(out, autoflush: false, flush_size: 1 << 20)
+  lz4 << s
+  assert_nil out.calls
+  lz4.flush
+  assert_equal 1, out.calls
+  lz4.close
+  assert_equal 2, out.calls
+  assert_equal s, LZ4.decode(out.buf)
+
+  # 待ち時間が 0 でなければ、書き込みのたびには出力しない
+  out = newport.call
+  LZ4::Encoder.wrap(out, autoflush: false, flush_interval: 60000) { |lz4| lines.each { |e| lz4 << e } }
+  assert_true out.calls < 10
+  assert_equal s, LZ4.decode(out.buf)
+end
+
+assert("LZ4 Frame API - stream processing (stable source)") do
+  pieces = (0 ... 200).map { |i| "#{i}:" + "abcdefghijklmnopqrstuvwxyz" * (i % 7 * 500 + 1) }
+  s = pieces.join
+
+  expected = ""
+  LZ4::Encoder.wrap(expected) { |lz4| pieces.each { |e| lz4 << e } }
+
+  # 凍結した文字列と stable: true は履歴を複写せずに圧縮するが、出力は変わらない
+  d = ""
+  LZ4::Encoder.wrap(d) do |lz4|
+    pieces.each_with_index do |e, i|
+      case i % 3
+      when 0 then lz4 << e.dup.freeze
+      when 1 then lz4.write(e.dup, stable: true)
+      else lz4 << e.dup
+      end
+      GC.start if Object.const_defined?(:GC) && i % 50 == 0
+    end
+  end
+  assert_equal expected, d
+  assert_equal s, LZ4.decode(d)
+
+  d = ""
+  LZ4::Encoder.wrap(d, autoflush: false) do |lz4|
+    pieces.each { |e| lz4.write(e.dup, stable: true) }
+  end
+  assert_equal s, LZ4.decode(d)
+end
+
+assert("LZ4 Frame API - stream processing (String port)") do
+  s = "123456789" * 11111
+
+  # 出力先の文字列の末尾へ直接圧縮する
+  d = "HEAD"
+  assert_equal d.object_id, LZ4::Encoder.wrap(d) { |lz4| 0.step(s.bytesize - 1, 100) { |i| lz4 << s.byteslice(i, 100) }; lz4.port }.object_id
+  assert_equal "HEAD", d.byteslice(0, 4)
+  assert_equal s, LZ4.decode(d.byteslice(4 .. -1))
+
+  d1 = ""
+  d2 = ""
+  lz4 = LZ4::Encoder.new(d1, blocklink: false, threads: 2)
+  lz4 << s
+  lz4.close
+  z = d1.dup
+  lz4.reset(d2)
+  lz4 << "abc"
+  lz4.close
+  assert_equal z, d1
+  assert_equal s, LZ4.decode(d1)
+  assert_equal "abc", LZ4.decode(d2)
+
+  assert_raise(RuntimeError) { LZ4::Encoder.new("".freeze) }
+end
+
+assert("LZ4 Frame API - stream processing (chunk)") do
+  s = "123456789" * 33333
+  d = LZ4.encode(s, blocksize: 64 << 10) + LZ4.encode("ABCDEFG")
+
+  chunks = []
+  LZ4::Decoder.wrap(d) { |lz4| lz4.each_chunk { |c| chunks << c } }
+  assert_equal s + "ABCDEFG", chunks.join
+  assert_true chunks.all? { |c| c.bytesize > 0 && c.bytesize <= 64 << 10 }
+  assert_true chunks.size > 4
+
+  # 新しく作られた短いチャンクも、切り詰めた後でそのまま使える
+  assert_equal "ABCDEFG", chunks.last
+  assert_equal "ABCDEFGH", chunks.last << "H"
+
+  # 与えた文字列を毎回再利用する
+  buf = ""
+  sizes = []
+  LZ4::Decoder.wrap(d) do |lz4|
+    lz4.each_chunk(buf) { |c| assert_same buf, c; sizes << c.bytesize }
+    assert_nil lz4.read_chunk(buf)
+  end
+  assert_equal chunks.map(&:bytesize), sizes
+end
+
+assert("LZ4 Frame API - stream processing (nonblock)") do
+  s = "123456789" * 11111
+
+  # 一部だけを受け付けたり、待たせたりする出力先
+  out = Object.new
+  def out.data; @data ||= ""; end
+  def out.write_nonblock(buf, exception: true)
+    @n = (@n || 0) + 1
+    return :wait_writable if @n % 3 == 0
+    size = [buf.bytesize, 1000].min
+    data << buf.byteslice(0, size)
+    size
+  end
+
+  lz4 = LZ4::Encoder.new(out)
+  off = 0
+  waits = 0
+  while off < s.bytesize
+    r = lz4.write_nonblock(s.byteslice(off, 5000))
+    if r == :wait_writable
+      waits += 1
+    else
+      off += r
+    end
+  end
+  waits += 1 while lz4.close_nonblock == :wait_writable
+  assert_true waits > 0
+  assert_equal s, LZ4.decode(out.data)
+
+  # 少しずつ与えたり、待たせたりする入力元
+  inp = Object.new
+  def inp.start(src); @src = src; @off = 0; @n = 0; end
+  def inp.read_nonblock(size, buf = nil, exception: true)
+    @n += 1
+    return :wait_readable if @n % 2 == 0
+    return nil if @off >= @src.bytesize
+    chunk = @src.byteslice(@off, [size, 700].min)
+    @off += chunk.bytesize
+    chunk
+  end
+  inp.start(out.data)
+
+  lz4 = LZ4::Decoder.new(inp)
+  d = ""
+  waits = 0
+  while r = lz4.read_nonblock(4096)
+    if r == :wait_readable
+      waits += 1
+    else
+      assert_true r.bytesize <= 4096
+      d << r
+    end
+  end
+  assert_true waits > 0
+  assert_equal s, d
+end
+
+if Object.const_defined?(:IO) && IO.respond_to?(:pipe)
+  assert("LZ4 Frame API - stream processing (nonblock, pipe)") do
+    x = 1
+    noise = (0 ... 65536).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+    r, w = IO.pipe
+    begin
+      # ブロッキングのパイプであっても、読み手がいなければ待たずに :wait_writable を返す
+      lz4 = LZ4::Encoder.new(w)
+      res = nil
+      64.times { break if (res = lz4.write_nonblock(noise)) == :wait_writable }
+      assert_equal :wait_writable, res
+      assert_equal :wait_writable, lz4.flush_nonblock
+    ensure
+      r.close
+      w.close
+    end
+  end
+end
+
 assert("LZ4 Frame API - stream processing (huge)") do
   s = "123456789" * 1111111 + "ABCDEFG"
   d = ""
@@ -67,4 +271,439 @@ assert("LZ4 Frame API - stream processing (huge)") do
   end
 end
 
+assert("LZ4 Frame API - multi-threaded compression") do
+  s = "123456789" * 111111 + "ABCDEFG"
+  d1 = LZ4.encode(s, blocklink: false, threads: 1)
+  assert_equal s, LZ4.decode(d1)
+  assert_equal d1, LZ4.encode(s, blocklink: false, threads: 4)
+  assert_equal s, LZ4.decode(LZ4.encode(s, blocklink: false, checksum: true, level: 4, threads: 3))
+  assert_equal LZ4.encode(s, blocklink: false, checksum: true), LZ4.encode(s, blocklink: false, checksum: true, threads: 2)
+
+  d2 = ""
+  LZ4::Encoder.wrap(d2, blocklink: false, checksum: true, threads: 2) do |lz4|
+    off = 0
+    slicesize = 7777
+    while off < s.bytesize
+      assert_equal lz4, lz4.write(s.byteslice(off, slicesize))
+      off += slicesize
+      slicesize = slicesize * 3 + 7
+    end
+  end
+  assert_equal s, LZ4.decode(d2)
+
+  assert_raise(ArgumentError) { LZ4.encode(s, threads: 2) }
+  assert_raise(ArgumentError) { LZ4.encode(s, blocklink: false, threads: -1) }
+end
+
+assert("LZ4 Frame API - multi-threaded decompression") do
+  s = "123456789" * 111111 + "ABCDEFG"
+  assert_equal s, LZ4::Decoder.decode(LZ4.encode(s, blocklink: false), threads: 4)
+  assert_equal s, LZ4::Decoder.decode(LZ4.encode(s, blocklink: false, checksum: true, size: s.bytesize), threads: 4)
+  assert_equal s, LZ4::Decoder.decode(LZ4.encode(s, blocklink: false, threads: 2), threads: 0)
+
+  # 連結ブロックであれば単一スレッドで処理される
+  assert_equal s, LZ4::Decoder.decode(LZ4.encode(s), threads: 4)
+
+  # 小さなブロックばかりで、ブロックの最大長で確保すると大きすぎる場合は逐次処理で伸長する
+  [nil, 1000].each do |size|
+    d = ""
+    lz4 = LZ4::Encoder.new(d, blocklink: false, blocksize: 4 << 20, size: size)
+    1000.times { lz4 << "a" }
+    lz4.close
+    assert_equal "a" * 1000, LZ4::Decoder.decode(d, threads: 4)
+  end
+
+  # contentSize があっても、途中に満たされていないブロックがあれば逐次処理で伸長する
+  d = ""
+  lz4 = LZ4::Encoder.new(d, blocklink: false, blocksize: 64 << 10, size: 65536 + 100 + 65536)
+  lz4 << s.byteslice(0, 65536)
+  lz4 << s.byteslice(65536, 100)
+  lz4 << s.byteslice(65636, 65536)
+  lz4.close
+  assert_equal s.byteslice(0, 65536 + 100 + 65536), LZ4::Decoder.decode(d, threads: 4)
+
+  d = ""
+  assert_equal d.object_id, LZ4::Decoder.decode(LZ4.encode(s, blocklink: false), d, threads: 2).object_id
+  assert_equal s, d
+
+  broken = LZ4.encode(s, blocklink: false, checksum: true)
+  broken.setbyte(-1, broken.getbyte(-1) ^ 1)
+  assert_raise(RuntimeError) { LZ4::Decoder.decode(broken, threads: 2) }
+end
+
+assert("LZ4 Frame API - trusted input") do
+  s = "123456789" * 111111 + "ABCDEFG"
+
+  [{}, { blocklink: false }].each do |opts|
+    broken = LZ4.encode(s, opts.merge(checksum: true))
+    broken.setbyte(-1, broken.getbyte(-1) ^ 1)
+    assert_raise(RuntimeError) { LZ4.decode(broken) }
+    assert_raise(RuntimeError) { LZ4::Decoder.new(broken).read }
+    assert_equal s, LZ4.decode(broken, trusted: true)
+    assert_equal s, LZ4::Decoder.decode(broken, trusted: true, threads: 2)
+    assert_equal s, LZ4::Decoder.new(broken, trusted: true).read
+  end
+end
+
+assert("LZ4 Frame API - concatenated frames") do
+  s = "123456789" * 111111 + "ABCDEFG"
+  a = s.byteslice(0, 400000)
+  b = s.byteslice(400000 .. -1)
+  skippable = "\x50\x2A\x4D\x18\x03\x00\x00\x00abc"
+
+  z = LZ4.encode(a) + skippable + LZ4.encode(b, blocklink: false, checksum: true) + skippable
+  assert_equal s, LZ4.decode(z)
+  assert_equal s, LZ4::Decoder.decode(z, threads: 4)
+  assert_equal s.byteslice(0, 500000), LZ4::Decoder.decode(z, 500000)
+  assert_equal "", LZ4.decode(skippable)
+
+  # contentSize がないフレームを含めば単一スレッドで処理される
+  z = LZ4.encode(a, size: false) + LZ4.encode(b)
+  assert_equal s, LZ4::Decoder.decode(z, threads: 4)
+
+  broken = LZ4.encode(a) + LZ4.encode(b).byteslice(0, 1000)
+  assert_raise(RuntimeError) { LZ4.decode(broken) }
+  assert_raise(RuntimeError) { LZ4::Decoder.decode(broken, threads: 4) }
+
+  # contentSize を 1 GiB と偽った "abc" のフレーム。事前確保はせずに逐次処理で失敗する
+  forged = "\x04\x22\x4D\x18\x68\x40\x00\x00\x00\x40\x00\x00\x00\x00\x61" <<
+           "\x03\x00\x00\x80abc\x00\x00\x00\x00"
+  assert_raise(RuntimeError) { LZ4::Decoder.decode(forged + forged, threads: 4) }
+end
+
+assert("LZ4 Frame API - content size") do
+  s = "123456789" * 111111 + "ABCDEFG"
+
+  # FLG の content size ビット
+  assert_equal 0x08, LZ4.encode(s).getbyte(4) & 0x08
+  assert_equal 0x08, LZ4.encode(s, blocklink: false, threads: 2).getbyte(4) & 0x08
+  assert_equal 0x00, LZ4.encode(s, size: false).getbyte(4) & 0x08
+  assert_equal 0x00, LZ4.encode("").getbyte(4) & 0x08
+
+  assert_equal s, LZ4.decode(LZ4.encode(s))
+  assert_equal s, LZ4.decode(LZ4.encode(s, size: false))
+  assert_equal s, LZ4::Decoder.new(LZ4.encode(s)).read
+  assert_equal s, LZ4::Decoder.new(LZ4.encode(s, size: false)).read
+
+  LZ4::Decoder.wrap(LZ4.encode(s)) do |lz4|
+    assert_equal s.byteslice(0, 1000), lz4.read(1000)
+    assert_equal s.byteslice(1000 .. -1), lz4.read
+  end
+end
+
+assert("LZ4 Frame API - reset") do
+  s1 = "123456789" * 1111
+  s2 = "abcdefg" * 2222
+
+  d1 = ""
+  lz4 = LZ4::Encoder.new(d1)
+  lz4 << s1
+  lz4.close
+  d2 = ""
+  assert_equal lz4, lz4.reset(d2, level: 9)
+  lz4 << s2
+  lz4.close
+  assert_equal s1, LZ4.decode(d1)
+  assert_equal s2, LZ4.decode(d2)
+
+  d3 = ""
+  d4 = ""
+  lz4 = LZ4::Encoder.new(d3, blocklink: false, checksum: true, threads: 2)
+  lz4 << s1
+  lz4.close
+  lz4.reset(d4)
+  lz4 << s2
+  lz4.close
+  assert_equal s1, LZ4.decode(d3)
+  assert_equal s2, LZ4.decode(d4)
+
+  dec = LZ4::Decoder.new(d1)
+  assert_equal s1, dec.read
+  assert_equal dec, dec.reset(d2)
+  assert_equal s2, dec.read
+
+  # 途中で読み込みをやめたフレームは破棄される
+  dec.reset(d1)
+  assert_equal s1.byteslice(0, 100), dec.read(100)
+  dec.reset(d4)
+  assert_equal s2, dec.read
+end
+
+assert("LZ4 Frame API - one step processing with context") do
+  enc = LZ4::Encoder::Context.new
+  dec = LZ4::Decoder::Context.new
+
+  10.times do |i|
+    s = "123456789" * (i * 100 + 1)
+    d = LZ4::Encoder.encode(s, context: enc, level: i)
+    assert_equal LZ4::Encoder.encode(s, level: i), d
+    assert_equal s, LZ4::Decoder.decode(d, context: dec)
+  end
+
+  s = "123456789" * 11111
+  assert_equal s, LZ4::Decoder.decode(LZ4.encode(s, blocklink: false, threads: 2, context: enc), context: dec, threads: 2)
+
+  # 例外で中断しても続けて使える
+  assert_raise(RuntimeError) { LZ4::Decoder.decode("broken data", context: dec) }
+  assert_equal "abc", LZ4::Decoder.decode(LZ4.encode("abc"), context: dec)
+  assert_raise(RuntimeError) { LZ4::Decoder.decode("broken data") }
+  assert_equal "abc", LZ4::Decoder.decode(LZ4.encode("abc"))
+
+  assert_raise(TypeError) { LZ4::Encoder.encode("abc", context: dec) }
+  assert_raise(TypeError) { LZ4::Decoder.decode(LZ4.encode("abc"), context: enc) }
+end
+
+assert("LZ4 Frame API - dictionary") do
+  dict = LZ4::Dictionary.new("0123456789abcdefghijklmnopqrstuvwxyz" * 100)
+  assert_equal 3600, dict.size
+  assert_equal "0123456789abcdefghijklmnopqrstuvwxyz" * 100, dict.to_s
+  assert_equal dict.id, LZ4::Dictionary.new(dict.to_s).id
+  assert_equal 12345, LZ4::Dictionary.new("abc", 12345).id
+  assert_raise(ArgumentError) { LZ4::Dictionary.new("abc", 0) }
+  assert_equal 65536, LZ4::Dictionary.new("a" * 100000).size
+
+  s = "abcdefghijklmnopqrstuvwxyz0123456789" * 10
+  d = LZ4.encode(s, dictionary: dict)
+  assert_equal 0x01, d.getbyte(4) & 0x01 # FLG.DictID
+  assert_true d.bytesize < LZ4.encode(s).bytesize
+  assert_equal s, LZ4.decode(d, dictionary: dict)
+  assert_equal s, LZ4.decode(d, dictionary: [LZ4::Dictionary.new("xyz"), dict])
+  assert_equal s, LZ4.decode(d, dictionary: dict.to_s)
+  assert_equal s, LZ4::Decoder.new(d, dictionary: dict).read
+  assert_equal s, LZ4::Decoder.new(d, predict: dict.to_s).read
+
+  # 文字列の辞書は末尾 64 KiB だけを最初に取り出し、後から変更されても影響しない
+  str = "x" * 100000 + dict.to_s
+  dec = LZ4::Decoder.new(d, dictionary: str)
+  str.replace("")
+  assert_equal s, dec.read
+  assert_equal s + s, LZ4.decode(d + d, dictionary: "x" * 100000 + dict.to_s)
+
+  # 一文字ずつ与えてもヘッダから辞書を選べる
+  io = Object.new
+  io.instance_variable_set(:@src, d)
+  def io.read(size, buf = nil)
+    return nil if @src.empty?
+    ch = @src.byteslice(0, 1)
+    @src = @src.byteslice(1 .. -1)
+    buf ? buf.replace(ch) : ch
+  end
+  assert_equal s, LZ4::Decoder.new(io, dictionary: [dict]).read
+
+  enc = LZ4::Encoder.new("", dictionary: dict)
+  enc << s
+  enc.close
+  assert_equal s, LZ4.decode(enc.port, dictionary: dict)
+
+  assert_raise(RuntimeError) { LZ4.decode(d) }
+  assert_raise(RuntimeError) { LZ4.decode(d, dictionary: LZ4::Dictionary.new("xyz")) }
+  assert_raise(ArgumentError) { LZ4.encode(s, dictionary: dict, blocklink: false, threads: 2) }
+  assert_raise(TypeError) { LZ4.decode(d, dictionary: 1) }
+
+  LZ4::Dictionary.register(dict)
+  begin
+    assert_equal dict, LZ4::Dictionary[dict.id]
+    assert_equal s, LZ4.decode(d)
+    assert_equal s, LZ4::Decoder.new(d).read
+  ensure
+    LZ4::Dictionary.unregister(dict)
+  end
+  assert_nil LZ4::Dictionary[dict.id]
+end
+
+assert("LZ4 Frame API - seekable format") do
+  s = (1..3000).map { |i| i.to_s * 7 }.join
+
+  [{ frame_size: 1000 }, { frame_size: 4096, blocklink: false, checksum: false }, {}].each do |opts|
+    z = ""
+    LZ4::SeekableEncoder.wrap(z, opts) { |e| 0.step(s.bytesize - 1, 777) { |i| e << s.byteslice(i, 777) } }
+
+    dec = LZ4::SeekableDecoder.new(z)
+    frames = (s.bytesize + (opts[:frame_size] || (1 << 20)) - 1) / (opts[:frame_size] || (1 << 20))
+    assert_equal s.bytesize, dec.size
+    assert_equal frames, dec.frames
+    assert_equal s, dec.pread(0, s.bytesize)
+    assert_equal s, LZ4.decode(z)
+
+    [0, 1, 999, 1000, 1001, 4095, 4097, 12345, s.bytesize - 10].each do |off|
+      [1, 10, 1000, 5000].each { |len| assert_equal s.byteslice(off, len), dec.pread(off, len) }
+    end
+
+    buf = "xyz"
+    assert_same buf, dec.pread(500, 3000, buf)
+    assert_equal s.byteslice(500, 3000), buf
+    assert_nil dec.pread(s.bytesize, 1)
+    assert_equal "", dec.pread(s.bytesize, 0)
+    assert_raise(ArgumentError) { dec.pread(-1, 1) }
+  end
+
+  assert_raise(RuntimeError) { LZ4::SeekableDecoder.new(LZ4.encode(s)) }
+  assert_raise(ArgumentError) { LZ4::SeekableEncoder.new("", frame_size: 0) }
+end
+
+assert("LZ4 Frame API - probe") do
+  x = 1
+  noise = (0 ... 200000).map { x = (x * 1103515245 + 12345) & 0x7fffffff; ((x >> 16) & 0xff).chr }.join
+  text = "abcdefghijklmnopqrstuvwxyz0123456789" * 6000
+  s = text + noise + text
+
+  LZ4.probe_stats(true)
+  z = LZ4.encode(s, blocklink: false, probe: true)
+  assert_equal s, LZ4.decode(z)
+  stats = LZ4.probe_stats
+  blocks = (s.bytesize + 65535) / 65536
+  assert_equal blocks, stats[:probed]
+  assert_true stats[:entropy] >= 2
+  assert_true stats[:bypassed] >= 2 * 65536
+
+  [{}, { threads: 2, checksum: true }].each do |opts|
+    d = ""
+    lz4 = LZ4::Encoder.new(d, opts.merge(blocklink: false, probe: true))
+    0.step(s.bytesize - 1, 10000) { |i| lz4 << s.byteslice(i, 10000) }
+    lz4.close
+    assert_equal s, LZ4.decode(d)
+    assert_equal stats, lz4.probe_stats
+
+    # 設定を与えない reset は probe: true を引き継ぐ
+    d2 = ""
+    lz4.reset(d2)
+    0.step(s.bytesize - 1, 10000) { |i| lz4 << s.byteslice(i, 10000) }
+    lz4.close
+    assert_equal d, d2
+    assert_equal stats[:probed] * 2, lz4.probe_stats[:probed]
+  end
+
+  assert_equal 0, LZ4.probe_stats(true)[:magic]
+  LZ4.encode("\x1f\x8b\x08" + noise.byteslice(0, 60000), blocklink: false, probe: true)
+  assert_equal 1, LZ4.probe_stats(true)[:magic]
+  gz = "\x1f\x8b\x08" + text
+  z = LZ4.encode(gz, blocklink: false, probe: true)
+  assert_equal gz, LZ4.decode(z)
+  assert_true z.bytesize < gz.bytesize / 10
+  assert_equal 0, LZ4.probe_stats[:magic]
+  assert_equal 0, LZ4.probe_stats[:bypassed]
+
+  assert_raise(ArgumentError) { LZ4.encode(s, probe: true) }
+  assert_raise(ArgumentError) { LZ4::Encoder.new("", probe: true) }
+end
+
+if Object.const_defined?(:File) && File.respond_to?(:unlink)
+  assert("LZ4 Frame API - file") do
+    src = "mruby-lz4-test.src.tmp"
+    lz4 = "mruby-lz4-test.lz4.tmp"
+    out = "mruby-lz4-test.out.tmp"
+    read = ->(path) { File.open(path, "rb") { |f| f.read } || "" }
+
+    begin
+      s = "123456789" * 111111 + "ABCDEFG"
+      File.open(src, "wb") { |f| f.write s }
+
+      # contentSize が記録されていれば、出力先を対応付けて伸長する
+      size = LZ4.encode_file(src, lz4)
+      assert_equal read.call(lz4).bytesize, size
+      assert_equal s, LZ4.decode(read.call(lz4))
+      assert_equal s.bytesize, LZ4.decode_file(lz4, out)
+      assert_equal s, read.call(out)
+
+      # contentSize がなければ、少しずつ書き出す
+      LZ4.encode_file(src, lz4, size: false, blocklink: false, threads: 2)
+      assert_equal s.bytesize, LZ4.decode_file(lz4, out)
+      assert_equal s, read.call(out)
+
+      File.open(lz4, "wb") { |f| f.write LZ4.encode(s, level: 9) }
+      assert_equal s.bytesize, LZ4.decode_file(lz4, out)
+      assert_equal s, read.call(out)
+
+      # 連結されたフレームとスキップ可能フレーム
+      skippable = "\x50\x2A\x4D\x18\x03\x00\x00\x00abc"
+      a = s.byteslice(0, 400000)
+      b = s.byteslice(400000 .. -1)
+      [LZ4.encode(a) + skippable + LZ4.encode(b, blocklink: false, checksum: true) + skippable,
+       LZ4.encode(a, size: false) + LZ4.encode(b) + skippable].each do |d|
+        File.open(lz4, "wb") { |f| f.write d }
+        assert_equal s.bytesize, LZ4.decode_file(lz4, out)
+        assert_equal s, read.call(out)
+
+        File.open(lz4, "wb") { |f| f.write d + LZ4.encode(b).byteslice(0, 1000) }
+        assert_raise(RuntimeError) { LZ4.decode_file(lz4, out) }
+      end
+
+      File.open(src, "wb") { |f| }
+      LZ4.encode_file(src, lz4)
+      assert_equal 0, LZ4.decode_file(lz4, out)
+      assert_equal "", read.call(out)
+
+      File.open(lz4, "wb") { |f| f.write LZ4.encode(s).byteslice(0, 1000) }
+      assert_raise(RuntimeError) { LZ4.decode_file(lz4, out) }
+      assert_raise(ArgumentError) { LZ4.encode_file(src, src) }
+
+      # 別名のパスで同じファイルを指していても、入力を切り詰めずに拒否する
+      File.open(src, "wb") { |f| f.write s }
+      File.open(lz4, "wb") { |f| f.write LZ4.encode(s) }
+      assert_raise(ArgumentError) { LZ4.encode_file(src, "./" + src) }
+      assert_raise(ArgumentError) { LZ4.decode_file(lz4, "./" + lz4) }
+      assert_equal s, read.call(src)
+      assert_equal s, LZ4.decode(read.call(lz4))
+      assert_raise(StandardError) { LZ4.decode_file("mruby-lz4-test.nonexistent.tmp", out) }
+    ensure
+      [src, lz4, out].each { |path| File.unlink(path) rescue nil }
+    end
+  end
+
+  assert("LZ4 Frame API - IO port") do
+    lz4 = "mruby-lz4-test.io.tmp"
+    s = "123456789" * 111111 + "ABCDEFG"
+
+    begin
+      [{}, { autoflush: false, flush_size: 100000 }, { blocklink: false, threads: 2 }].each do |opts|
+        File.open(lz4, "wb") do |f|
+          LZ4.encode(f, opts) { |e| 0.step(s.bytesize - 1, 70000) { |i| e << s.byteslice(i, 70000) } }
+        end
+        assert_equal s, LZ4.decode(File.open(lz4, "rb") { |f| f.read })
+
+        File.open(lz4, "rb") do |f|
+          dec = LZ4::Decoder.new(f)
+          assert_equal s.byteslice(0, 1000), dec.read(1000)
+          assert_equal s.byteslice(1000 .. -1), dec.read
+        end
+      end
+
+      # 先に読み込んだ次のフレームは reset で続けて読める
+      File.open(lz4, "wb") { |f| f << LZ4.encode("abc") << LZ4.encode("defg") }
+      File.open(lz4, "rb") do |f|
+        dec = LZ4::Decoder.new(f)
+        assert_equal "abc", dec.read
+        dec.reset
+        assert_equal "defg", dec.read
+      end
+
+      # IO が読み込み済みのデータを持っていても、続きから伸長できる
+      File.open(lz4, "wb") { |f| f << "HEAD" << LZ4.encode(s) }
+      File.open(lz4, "rb") do |f|
+        assert_equal "HEAD", f.read(4)
+        assert_equal s, LZ4::Decoder.new(f).read
+      end
+    ensure
+      File.unlink(lz4) rescue nil
+    end
+  end
+
+  assert("LZ4 Frame API - seekable format (File)") do
+    lz4 = "mruby-lz4-test.seek.tmp"
+    s = "123456789" * 111111 + "ABCDEFG"
+
+    begin
+      File.open(lz4, "wb") { |f| LZ4::SeekableEncoder.wrap(f, frame_size: 65536) { |e| e << s } }
+      File.open(lz4, "rb") do |f|
+        dec = LZ4::SeekableDecoder.new(f)
+        assert_equal s.bytesize, dec.size
+        assert_equal s.byteslice(65530, 20), dec.pread(65530, 20)
+        assert_equal s.byteslice(-7, 7), dec.pread(s.bytesize - 7, 100)
+      end
+    ensure
+      File.unlink(lz4) rescue nil
+    end
+  end
+end
+
 end # LZ4::Encoder defined